@@ -16,9 +16,39 @@
 #define CAMERA_POSITION 14.8467, 49.5787, -46.4311
 #define CAMERA_ROTATION -0.547712, -3.70633, 0
 
+#define LIGHT_DIRECTION 0.0,0.0,-1.0  // also used by the CPU traced reference reflections
 #define NEAR 0.01f
 #define FAR 1000.0f
 #define MEASURE_TIME_S 6
+#define LOD_PIXEL_ERROR_CAMERA 0.5    // max. allowed screen space error of the scene LOD in pixels
+#define LOD_PIXEL_ERROR_PROBE 2.0     // cubemap captures are filtered anyway, so allow coarser LODs
+
+#define DRAW_FLAG_SKY 1               // per-draw flags of the batched path, must match shader_3d.fs
+#define DRAW_FLAG_MARKER 2
+#define DRAW_FLAG_MIRROR 4
+
+#define BATCH_DRAW_SKY 0              // order of the draws in the batch, each pass draws a prefix
+#define BATCH_DRAW_SCENE 1
+#define BATCH_DRAW_MIRROR 2
+#define BATCH_DRAW_BOX_1 3
+#define BATCH_DRAW_BOX_2 4
+#define BATCH_SKY_TEXTURE_UNIT 10
+
+#define NUMBER_OF_PROPS 256           // instanced props scattered over the scene (-o)
+
+#define MIRROR_WAVE_AMPLITUDE 0.03    // deforming mirror (-d), in mirror model units
+#define MIRROR_WAVE_FREQUENCY 12.0
+#define MIRROR_WAVE_SPEED 3.0
+
+#define FRAME_DATA_BINDING_POINT 0    // uniform buffer binding of frame_data_include.txt
+
+#define TRACER_FEATURE_FILL_UNRESOLVED 1      // bits of the shader_quad.fs permutation, switchable at runtime
+#define TRACER_FEATURE_EFFICIENT_SAMPLING 2
+#define TRACER_FEATURE_ANALYTICAL 4
+#define TRACER_FEATURE_SELF_REFLECTIONS 8
+
+#define TRACE_FRAMES 16               // frames captured by -t after the initialisation
+#define TRACE_FILENAME "trace.json"
 //#define SHADER_LOG
 
 // global flags and parameters, set these with command line parameters:
@@ -33,8 +63,17 @@ bool measure = false;
 bool fill_unresolved = false;
 bool efficient = false;
 bool analytical = false;
+bool baked_probes = false;
+bool batched = false;
+bool deforming_mirror = false;
+bool scatter_props = false;
+bool sweep_variants = false;
+bool trace = false;
+unsigned int trace_frames = 0;        // frames captured so far with -t
+bool show_frame_graph = false;        // toggled with G
 
 string shader_defines = "";           // defines inserted into shaders
+string shader_3d_defines = "";
 
 unsigned int cubemap_resolution = 256;
 unsigned int reflector = 0;
@@ -48,6 +87,16 @@ unsigned int measure_start_time_s;
 unsigned int cubemap_rendering_time;
 unsigned int acc_recompute_time;
 
+glm::vec3 lod_camera_position;        // LOD selection and culling parameters of the current pass
+float lod_viewport_height;
+float lod_fov;
+float lod_pixel_error;
+glm::mat4 cull_view_projection_matrix;
+
+unsigned int scene_triangles_drawn;   // counted over a pass
+unsigned int scene_triangles_camera;
+unsigned int scene_triangles_cubemaps;
+
 TransformationTRSModel transformation_scene;
 TransformationTRSModel transformation_mirror;
 TransformationTRSModel transformation_sky;
@@ -58,9 +107,20 @@ Geometry3D *geometry_line;            // helper marking line
 Geometry3D *geometry_mirror;
 Geometry3D *geometry_box;             // box marking the cube map position
 
+Geometry3D *geometry_prop;             // instanced prop
+
+vector<glm::mat4> marker_matrices(2);
+vector<unsigned int> marker_flags(2,DRAW_FLAG_MARKER);
+
+BVH *scene_bvh = 0;                   // for CPU traced reference reflections, built when needed
+Image2D *scene_image = 0;             // scene texture for the CPU tracer, the GPU one may be block compressed
+string scene_texture_filename;        // without the extension, see load_texture()
+
+GeometryBatch *scene_batch;           // everything above in one batch, for the batched path
+vector<Vertex3D> mirror_rest_vertices; // undeformed mirror vertices for the deforming mirror
+
 ShaderLog *shader_log;
 
-glm::mat4 view_matrix = glm::mat4(1.0f);
 glm::mat4 projection_matrix = glm::perspective(45.0f, 4.0f / 3.0f, NEAR, FAR);
 
 UniformVariable uniform_mirror("mirror");
@@ -70,19 +130,34 @@ UniformVariable uniform_texture_color("texture_color");
 UniformVariable uniform_texture_normal("texture_normal");
 UniformVariable uniform_texture_position("texture_position");
 UniformVariable uniform_texture_stencil("texture_stencil");
-UniformVariable uniform_texture_to_display("texture_to_display");
-UniformVariable uniform_acceleration_on("acceleration_on");
-UniformVariable uniform_view_matrix("view_matrix");
 UniformVariable uniform_sky("sky");
+UniformVariable uniform_texture_sky_2d("texture_sky_2d");
+UniformVariable uniform_instanced("instanced");
 UniformVariable uniform_rendering_cubemap("rendering_cubemap");
 UniformVariable uniform_marker("marker");
 UniformVariable uniform_model_matrix("model_matrix");
-UniformVariable uniform_projection_matrix("projection_matrix");
-UniformVariable uniform_camera_position("camera_position");
+
+/**
+ * Per-frame data shared by shader_3d and shader_quad in a uniform buffer,
+ * in std140 layout of the block in frame_data_include.txt.
+ */
+
+typedef struct
+  {
+    float view_matrix[16];
+    float projection_matrix[16];
+    float camera_position[4];
+    float cubemap_positions[2][4];
+  } frame_data;
+
+UniformBuffer *frame_uniforms;
 UniformVariable uniform_cubemap_position("cubemap_position");
 
 Shader *shader_3d;                   // for the first pass: renders a 3D scene
-Shader *shader_quad;                 // for the second pass: draws textures on a quad
+Shader *shader_quad;                 // for the second pass: draws textures on a quad, current permutation
+ShaderPermutations *quad_permutations;
+unsigned int quad_permutation = 0;           // TRACER_FEATURE_* bits
+unsigned int requested_quad_permutation = 0; // switched to when compiled
 
 Shader *shader_compute;
 Shader *shader_quad2;                // only draws a texture modified by compute shader
@@ -148,6 +223,7 @@ void print_info()
     
     cout << "last (all) cubemap rendering (ms): " << cubemap_rendering_time << endl;
     cout << "last (all) acc. struct. recompute (ms): " << acc_recompute_time << endl;
+    cout << "scene triangles drawn (camera / last all cubemaps): " << scene_triangles_camera << " / " << scene_triangles_cubemaps << endl;
     
     if (!measure)
       {
@@ -169,11 +245,65 @@ void print_info()
     cout << "-------" << endl;
   }
 
+/**
+ * Loads a texture from block compressed KTX file (made with the texture
+ * converter tool) if it exists, otherwise from the ppm file.
+ */
+
+void load_texture(Texture2D *texture, string filename_base)
+  {
+    if (ifstream(filename_base + ".ktx").good())
+      texture->load_ktx(filename_base + ".ktx");
+    else
+      texture->load_ppm(filename_base + ".ppm");
+  }
+
+void draw_props()
+  {
+    if (!scatter_props)
+      return;
+      
+    texture_scene->bind(1);
+    uniform_instanced.update_int(1);
+    uniform_model_matrix.update_mat4(geometry_prop->get_dequantization_matrix());
+    geometry_prop->draw_instanced();
+    uniform_instanced.update_int(0);
+  }
+
+/**
+ * Batched version of draw_scene(): the whole pass is one multi-draw with
+ * the per-draw data in an SSBO.
+ */
+
+void draw_scene_batched()
+  {
+    scene_batch->set_model_matrix(BATCH_DRAW_SKY,transformation_sky.get_matrix());
+    scene_batch->set_model_matrix(BATCH_DRAW_SCENE,transformation_scene.get_matrix());
+    scene_batch->set_model_matrix(BATCH_DRAW_MIRROR,transformation_mirror.get_matrix());
+    scene_batch->set_model_matrix(BATCH_DRAW_BOX_1,cubemaps[0]->transformation.get_matrix());
+    scene_batch->set_model_matrix(BATCH_DRAW_BOX_2,cubemaps[1]->transformation.get_matrix());
+    
+    texture_scene->bind(1);
+    texture_sky->bind(BATCH_SKY_TEXTURE_UNIT);
+    
+    // mirror has to be always drawn for self reflections
+    scene_batch->draw(0,draw_mirror ? BATCH_DRAW_BOX_2 + 1 : (self_reflections ? BATCH_DRAW_MIRROR + 1 : BATCH_DRAW_SCENE + 1));
+    scene_triangles_drawn += geometry_scene->triangles.size() / 3;
+    
+    draw_props();
+  }
+
 void draw_scene()
   {        
     glClear(GL_COLOR_BUFFER_BIT);
     glClear(GL_DEPTH_BUFFER_BIT);
     
+    if (batched)
+      {
+        draw_scene_batched();
+        return;
+      }
+    
     uniform_sky.update_int(1);
     texture_sky->bind(1);
     uniform_model_matrix.update_mat4(transformation_sky.get_matrix());
@@ -182,8 +312,12 @@ void draw_scene()
     
     texture_scene->bind(1);
     
-    uniform_model_matrix.update_mat4(transformation_scene.get_matrix());
-    geometry_scene->draw_as_triangles();
+    uniform_model_matrix.update_mat4(transformation_scene.get_matrix() * geometry_scene->get_dequantization_matrix());
+    unsigned int lod = geometry_scene->select_lod(transformation_scene.get_matrix(),lod_camera_position,lod_viewport_height,lod_fov,lod_pixel_error);
+    
+    scene_triangles_drawn += geometry_scene->draw_culled(transformation_scene.get_matrix(),cull_view_projection_matrix,lod_camera_position,true,lod);
+    
+    draw_props();
     
     uniform_marker.update_int(1);
     uniform_model_matrix.update_mat4(glm::mat4(1.0));
@@ -194,28 +328,27 @@ void draw_scene()
     
     if (draw_mirror)
       { // draw the mark boxes:
-        uniform_marker.update_int(1);
-        uniform_model_matrix.update_mat4(cubemaps[0]->transformation.get_matrix());
-        geometry_box->draw_as_triangles();
-        
-        uniform_model_matrix.update_mat4(cubemaps[1]->transformation.get_matrix());
-        
-        geometry_box->draw_as_triangles();       
-        uniform_marker.update_int(0);
+        marker_matrices[0] = cubemaps[0]->transformation.get_matrix();
+        marker_matrices[1] = cubemaps[1]->transformation.get_matrix();
+        geometry_box->set_instances(marker_matrices,&marker_flags);
+        uniform_instanced.update_int(1);
+        uniform_model_matrix.update_mat4(glm::mat4(1.0));
+        geometry_box->draw_instanced();
+        uniform_instanced.update_int(0);
         
         // draw the mirror:
-        uniform_model_matrix.update_mat4(transformation_mirror.get_matrix());
+        uniform_model_matrix.update_mat4(transformation_mirror.get_matrix() * geometry_mirror->get_dequantization_matrix());
         uniform_mirror.update_int(1);
-        profiler->fragment_count_measure_begin();
+        profiler->fragment_count_measure_begin(2);
         geometry_mirror->draw_as_triangles();    
-        profiler->record_value(2,profiler->fragment_count_measure_end());
+        profiler->fragment_count_measure_end(2);
         uniform_mirror.update_int(0);
       }
       
     if (self_reflections)
       {
         // mirror has to be always drawn for self reflections
-        uniform_model_matrix.update_mat4(transformation_mirror.get_matrix());
+        uniform_model_matrix.update_mat4(transformation_mirror.get_matrix() * geometry_mirror->get_dequantization_matrix());
         uniform_mirror.update_int(1);
         geometry_mirror->draw_as_triangles();
         uniform_mirror.update_int(0);
@@ -239,10 +372,10 @@ void set_up_pass1()
   {
     shader_3d->use();
     uniform_texture_2d.update_int(1);
-    uniform_view_matrix.update_mat4(view_matrix);
-    uniform_light_direction.update_float_3(0.0,0.0,-1.0);
+    uniform_light_direction.update_float_3(LIGHT_DIRECTION);
     uniform_mirror.update_int(0);
     uniform_rendering_cubemap.update_int(0);
+    uniform_texture_sky_2d.update_int(BATCH_SKY_TEXTURE_UNIT);
   }
   
 void set_up_pass2()
@@ -254,13 +387,163 @@ void set_up_pass2()
     uniform_texture_normal.update_int(1);
     uniform_texture_position.update_int(2);
     uniform_texture_stencil.update_int(3);
-    uniform_texture_to_display.update_int(texture_to_display);
-    uniform_acceleration_on.update_int(acceleration_on);
-    uniform_camera_position.update_vec3(CameraHandler::camera_transformation.get_translation());      
+  }
+
+/**
+ * Sets the view for the following draws and the rest of the per-frame
+ * data, nothing is uploaded if nothing has changed.
+ */
+
+void update_frame_data(glm::mat4 view, glm::mat4 projection)
+  {
+    frame_data *data = (frame_data *) frame_uniforms->get_data_pointer();
+    glm::vec3 camera_position = CameraHandler::camera_transformation.get_translation();
+    
+    memcpy(data->view_matrix,glm::value_ptr(view),sizeof(data->view_matrix));
+    memcpy(data->projection_matrix,glm::value_ptr(projection),sizeof(data->projection_matrix));
+    memcpy(data->camera_position,glm::value_ptr(camera_position),3 * sizeof(float));
+    
+    for (int i = 0; i < 2; i++)
+      {
+        glm::vec3 position = cubemaps[i]->transformation.get_translation();
+        memcpy(data->cubemap_positions[i],glm::value_ptr(position),3 * sizeof(float));
+      }
+      
+    frame_uniforms->update_gpu();
+  }
+
+void recompute_all();
+
+void retrieve_shader_3d_uniforms()
+  {
+    uniform_mirror.retrieve_location(shader_3d);
+    uniform_rendering_cubemap.retrieve_location(shader_3d);
+    uniform_light_direction.retrieve_location(shader_3d);
+    uniform_sky.retrieve_location(shader_3d);
+    uniform_texture_sky_2d.retrieve_location(shader_3d);
+    uniform_instanced.retrieve_location(shader_3d);
+    uniform_texture_2d.retrieve_location(shader_3d);   
+    uniform_model_matrix.retrieve_location(shader_3d);
+    uniform_marker.retrieve_location(shader_3d);
+    uniform_cubemap_position.retrieve_location(shader_3d);
+  }
+
+/**
+ * Switches the second pass to given permutation of shader_quad.fs (waits
+ * for its compilation if needed) and retrieves its uniforms.
+ */
+
+void use_tracer_variant(unsigned int permutation)
+  {
+    shader_quad = quad_permutations->get(permutation);
+    quad_permutation = permutation;
+    requested_quad_permutation = permutation;
+    
+    fill_unresolved = permutation & TRACER_FEATURE_FILL_UNRESOLVED;
+    efficient = permutation & TRACER_FEATURE_EFFICIENT_SAMPLING;
+    analytical = permutation & TRACER_FEATURE_ANALYTICAL;
+    
+    cubemaps[0]->retrieve_uniform_locations(shader_quad);
+    cubemaps[1]->retrieve_uniform_locations(shader_quad);
+    uniform_texture_color.retrieve_location(shader_quad);
+    uniform_texture_normal.retrieve_location(shader_quad);
+    uniform_texture_position.retrieve_location(shader_quad);
+    uniform_texture_stencil.retrieve_location(shader_quad);
+    
+    shader_quad->use();
+    
+    cubemaps[0]->update_uniforms();
+    cubemaps[1]->update_uniforms();
+    uniform_texture_color.update_int(0);
+    uniform_texture_normal.update_int(1);
+    uniform_texture_position.update_int(2);
+    uniform_texture_stencil.update_int(3);    
+    
+    shader_quad->validate();    // delayed validation, for AMD GPUs
+    
+    bool self = permutation & TRACER_FEATURE_SELF_REFLECTIONS;
+    
+    if (self != self_reflections)    // the cubemaps have to capture the mirror too
+      {
+        self_reflections = self;
+        recompute_all();
+      }
+  }
+
+/**
+ * Bakes the current display mode and acceleration switch into the tracer
+ * shader as constants, the variant is switched to in render() once it's
+ * compiled.
+ */
+
+void specialize_tracer()
+  {
+    quad_permutations->specialize("texture_to_display",texture_to_display);
+    quad_permutations->specialize("acceleration_on",acceleration_on);
+    quad_permutations->request(requested_quad_permutation);
+  }
+
+/**
+ * Recompiles the shaders whose source files (or their includes) have been
+ * edited, the programs are only swapped if they compile.
+ */
+
+void reload_changed_shaders()
+  {
+    if (shader_3d->has_changed() &&
+      shader_3d->replace_program(file_text("shader_3d.vs",true,shader_3d_defines),file_text("shader_3d.fs",true,shader_3d_defines),""))
+      {
+        cout << "shader_3d reloaded" << endl;
+        retrieve_shader_3d_uniforms();
+        recompute_all();    // the probes are captured with it
+      }
+      
+    if (quad_permutations->reload_if_changed(shader_quad))
+      {
+        cout << "shader_quad reloaded" << endl;
+        use_tracer_variant(quad_permutation);
+      }
+  }
+
+/**
+ * Runs waves over the mirror surface, for testing dynamic geometry. The
+ * normals are tilted by the gradient of the displacement.
+ */
+
+void deform_mirror()
+  {
+    float time = glutGet(GLUT_ELAPSED_TIME) / 1000.0;
+    
+    for (unsigned int i = 0; i < mirror_rest_vertices.size(); i++)
+      {
+        Vertex3D *rest = &(mirror_rest_vertices[i]);
+        float phase = time * MIRROR_WAVE_SPEED + rest->position.y * MIRROR_WAVE_FREQUENCY;
+        glm::vec3 gradient = glm::vec3(0.0,MIRROR_WAVE_AMPLITUDE * MIRROR_WAVE_FREQUENCY * cos(phase),0.0);
+        
+        geometry_mirror->vertices[i].position = rest->position + rest->normal * (float) (MIRROR_WAVE_AMPLITUDE * sin(phase));
+        geometry_mirror->vertices[i].normal = glm::normalize(rest->normal - (gradient - rest->normal * glm::dot(gradient,rest->normal)));
+      }
+      
+    geometry_mirror->update_vertices_gpu();
   }
 
 void render()
   { 
+    if (trace && TraceProfiler::is_capturing())
+      {
+        trace_frames++;
+        
+        if (trace_frames > TRACE_FRAMES)
+          {
+            TraceProfiler::stop_capture();
+            TraceProfiler::save_chrome_trace(TRACE_FILENAME);
+            cout << "saved " << TraceProfiler::get_number_of_events() << " trace scopes to " << TRACE_FILENAME << endl;
+          }
+      }
+    
+    ProfileScope frame_scope("frame");
+    profiler->frame_begin();
+    
     info_countdown--;
     wait_for_key_release = false;
     
@@ -270,18 +553,44 @@ void render()
         print_info();
       }
     
+    reload_changed_shaders();
+    
+    Shader *requested_shader = quad_permutations->get(requested_quad_permutation,false);
+    
+    if (requested_shader != 0 && requested_shader != shader_quad)
+      {
+        bool print_variant = requested_quad_permutation != quad_permutation;
+        
+        use_tracer_variant(requested_quad_permutation);
+        
+        if (print_variant)
+          cout << "tracer variant " << quad_permutation << ":" << endl << quad_permutations->get_defines(quad_permutation);
+      }
+    
+    if (deforming_mirror)
+      deform_mirror();
+    
     set_up_pass1();
     
     // set up the camera:
-    uniform_view_matrix.update_mat4(CameraHandler::camera_transformation.get_matrix());
-    uniform_projection_matrix.update_mat4(projection_matrix);
+    update_frame_data(CameraHandler::camera_transformation.get_matrix(),projection_matrix);
+    
+    lod_camera_position = CameraHandler::camera_transformation.get_translation();
+    lod_viewport_height = window_height;
+    lod_fov = 45.0 / 180.0 * M_PI;
+    lod_pixel_error = LOD_PIXEL_ERROR_CAMERA;
+    cull_view_projection_matrix = projection_matrix * CameraHandler::camera_transformation.get_matrix();
     
     // 1st pass:
-    profiler->time_measure_begin();
+    TraceProfiler::begin("G-buffer pass");
+    profiler->time_measure_begin(0);
     frame_buffer_camera->activate();
+    scene_triangles_drawn = 0;
     draw_scene();
+    scene_triangles_camera = scene_triangles_drawn;
     frame_buffer_camera->deactivate();
-    profiler->record_value(0,profiler->time_measure_end());
+    profiler->time_measure_end(0);
+    TraceProfiler::end();
    
     // 2nd pass:
     shader_log->bind();
@@ -293,7 +602,8 @@ void render()
         pixel_storage_buffer->update_gpu();
       }
 
-    profiler->time_measure_begin(); 
+    TraceProfiler::begin("trace pass");
+    profiler->time_measure_begin(1);
     set_up_pass2();
     draw_quad();
     
@@ -330,7 +640,14 @@ void render()
       shader_log->update_gpu();
     #endif
     
-    profiler->record_value(1,profiler->time_measure_end());
+    profiler->time_measure_end(1);
+    TraceProfiler::end();
+    profiler->record_value(3,GLState::get_changes_avoided());
+    profiler->record_value(4,GLState::get_changes_made());
+    GLState::reset_counters();
+    
+    if (show_frame_graph)
+      profiler->draw_frame_graph();
     
     ErrorWriter::checkGlErrors("rendering loop");  
     glutSwapBuffers();
@@ -340,12 +657,24 @@ void render()
     if (measure && profiler->get_cpu_seconds() - measure_start_time_s >= MEASURE_TIME_S)
       {
         print_info();
-        glutLeaveMainLoop();
+        
+        if (sweep_variants && quad_permutation + 1 < quad_permutations->get_number_of_permutations())
+          {
+            use_tracer_variant(quad_permutation + 1);
+            cout << "tracer variant " << quad_permutation << ":" << endl << quad_permutations->get_defines(quad_permutation);
+            profiler->reset();
+            measure_start_time_s = profiler->get_cpu_seconds();
+          }
+        else
+          glutLeaveMainLoop();
       }
   }
   
 void recompute_cubemap_side(ReflectionTraceCubeMap *cube_map, GLuint side) 
   {
+    const char *face_names[] = {"face +X","face -X","face +Y","face -Y","face +Z","face -Z"};
+    ProfileScope scope(face_names[side - GL_TEXTURE_CUBE_MAP_POSITIVE_X]);
+    
     frame_buffer_cube->set_textures
       (
         cube_map->get_texture_depth(),side,
@@ -357,7 +686,13 @@ void recompute_cubemap_side(ReflectionTraceCubeMap *cube_map, GLuint side)
       
     frame_buffer_cube->activate();
     // set the camera:
-    uniform_view_matrix.update_mat4(cube_map->get_camera_transformation(side).get_matrix());
+    update_frame_data(cube_map->get_camera_transformation(side).get_matrix(),ReflectionTraceCubeMap::get_projection_matrix());
+    
+    lod_camera_position = cube_map->transformation.get_translation();
+    lod_viewport_height = cubemap_resolution;
+    lod_fov = M_PI / 2.0;
+    lod_pixel_error = LOD_PIXEL_ERROR_PROBE;
+    cull_view_projection_matrix = ReflectionTraceCubeMap::get_projection_matrix() * cube_map->get_camera_transformation(side).get_matrix();
     
     draw_mirror = false;
     draw_scene();
@@ -389,10 +724,12 @@ void save_images()
   
 void recompute_cubemap()
   {
+    ProfileScope scope("cubemap capture");
+    
     set_up_pass1();
     uniform_rendering_cubemap.update_int(1);
-    
-    uniform_projection_matrix.update_mat4(ReflectionTraceCubeMap::get_projection_matrix());
+
+    scene_triangles_drawn = 0;
     
     uniform_cubemap_position.update_vec3(cubemaps[0]->transformation.get_translation());
     cubemaps[0]->set_viewport();
@@ -415,6 +752,7 @@ void recompute_cubemap()
     recompute_cubemap_side(cubemaps[1],GL_TEXTURE_CUBE_MAP_POSITIVE_Z);
     recompute_cubemap_side(cubemaps[1],GL_TEXTURE_CUBE_MAP_NEGATIVE_Z);
     cubemaps[1]->unset_viewport();  
+    scene_triangles_cubemaps = scene_triangles_drawn;
 
     cubemaps[0]->get_texture_color()->load_from_gpu();  
     cubemaps[0]->get_texture_depth()->load_from_gpu();
@@ -426,6 +764,111 @@ void recompute_cubemap()
     cubemaps[1]->get_texture_normal()->load_from_gpu();   
   }  
 
+/**
+ * Traces the reflections of the mirror pixels of the last frame on CPU,
+ * with a BVH of the scene, and saves them as a reference image to compare
+ * the cubemap tracing against. Rays that miss the scene (the sky) are
+ * black. The hit points are shaded like in shader_3d.fs.
+ */
+
+void save_ground_truth_image()
+  {
+    if (scene_bvh == 0)
+      {
+        cout << "building scene BVH..." << endl;
+        scene_bvh = new BVH();
+        scene_bvh->build(geometry_scene,transformation_scene.get_matrix());
+      }
+      
+    if (scene_image == 0)
+      {
+        scene_image = new Image2D(16,16,TEXEL_TYPE_COLOR);
+        scene_image->load_ppm(scene_texture_filename + ".ppm");
+      }
+      
+    cout << "tracing reference reflections..." << endl;
+    
+    texture_camera_position->load_from_gpu();
+    texture_camera_normal->load_from_gpu();
+    texture_camera_stencil->load_from_gpu();
+    
+    Image2D result(window_width,window_height,TEXEL_TYPE_COLOR);
+    glm::vec3 light_direction = glm::vec3(LIGHT_DIRECTION);
+    glm::vec3 camera_position = CameraHandler::camera_transformation.get_translation();
+    glm::vec3 origins[BVH_MAX_PACKET_SIZE];
+    glm::vec3 directions[BVH_MAX_PACKET_SIZE];
+    unsigned int packet_x[BVH_MAX_PACKET_SIZE];
+    bvh_hit hits[BVH_MAX_PACKET_SIZE];
+    
+    for (unsigned int y = 0; y < window_height; y++)
+      {
+        unsigned int packet_size = 0;
+        
+        for (unsigned int x = 0; x <= window_width; x++)
+          {
+            float r, g, b, a;
+            
+            if (x < window_width)
+              {
+                texture_camera_stencil->get_image_data()->get_pixel(x,y,&r,&g,&b,&a);
+                result.set_pixel(x,y,0,0,0,1);
+                
+                if (r > 0.5)   // mirror pixel, add its reflected ray to the packet
+                  {
+                    glm::vec3 position, normal;
+                    texture_camera_position->get_image_data()->get_pixel(x,y,&position.x,&position.y,&position.z,&a);
+                    texture_camera_normal->get_image_data()->get_pixel(x,y,&normal.x,&normal.y,&normal.z,&a);
+                    normal = glm::normalize(normal);
+                    
+                    glm::vec3 view = glm::normalize(position - camera_position);
+                    directions[packet_size] = view - normal * (2.0f * glm::dot(view,normal));
+                    origins[packet_size] = position + normal * 0.001f;
+                    packet_x[packet_size] = x;
+                    packet_size++;
+                  }
+              }
+              
+            if (packet_size == BVH_MAX_PACKET_SIZE || (x == window_width && packet_size != 0))
+              {
+                scene_bvh->intersect_packet(origins,directions,packet_size,hits);
+                
+                for (unsigned int i = 0; i < packet_size; i++)
+                  {
+                    if (hits[i].triangle == BVH_NO_HIT)
+                      continue;
+                    
+                    glm::vec3 uv = glm::vec3(0,0,0);
+                    glm::vec3 normal = glm::vec3(0,0,0);
+                    float weights[3] = {1.0f - hits[i].u - hits[i].v,hits[i].u,hits[i].v};
+                    
+                    for (unsigned int j = 0; j < 3; j++)
+                      {
+                        Vertex3D *vertex = &(geometry_scene->vertices[geometry_scene->triangles[hits[i].triangle * 3 + j]]);
+                        uv += vertex->texture_coord * weights[j];
+                        normal += vertex->normal * weights[j];
+                      }
+                    
+                    // same as shader_3d.fs, with the model matrix the scene is drawn with:
+                    
+                    normal = glm::normalize(glm::vec3(transformation_scene.get_matrix() * geometry_scene->get_dequantization_matrix() * glm::vec4(normal,0.0)));
+                    float lighting = glm::clamp(0.4f + glm::clamp(glm::dot(normal,-1.0f * light_direction),0.0f,1.0f),0.0f,1.0f);
+                    float shade = 0.8f + 0.2f * lighting;
+                    
+                    uv.x -= floor(uv.x);
+                    uv.y -= floor(uv.y);
+                    scene_image->get_pixel(uv.x * (scene_image->get_width() - 1),uv.y * (scene_image->get_height() - 1),&r,&g,&b,&a);
+                    result.set_pixel(packet_x[i],y,r * shade,g * shade,b * shade,1);
+                  }
+                  
+                packet_size = 0;
+              }
+          }
+      }
+      
+    result.save_ppm("cubemap_images/ground_truth.ppm");
+    cout << "saved cubemap_images/ground_truth.ppm" << endl;
+  }
+
 void recompute_all()
   {      
     cout << "rendering cubemaps..." << endl;
@@ -436,6 +879,7 @@ void recompute_all()
     
     cout << "recomputing acceleration structures..." << endl;
     
+    TraceProfiler::begin("acceleration pyramid");
     profiler->time_measure_begin();
 
     if (use_compute_shaders)
@@ -458,12 +902,97 @@ void recompute_all()
       }
       
     acc_recompute_time = profiler->time_measure_end();
+    TraceProfiler::end();
     
     ErrorWriter::checkGlErrors("acceleration structure recompute",true);
           
     save_images();    
   }
   
+/**
+ * Gets the probe file name, it contains everything that changes the
+ * capture: the scene, the resolution and, with self reflections, the mirror
+ * model.
+ */
+
+string probe_filename(unsigned int cubemap_index)
+  {
+    string mirror = self_reflections ? "_m" + to_string(reflector) : "";
+    return "../resources/probe_s" + to_string(scene) + mirror + "_" + to_string(cubemap_resolution) + "_" + to_string(cubemap_index) + ".probe";
+  }
+
+/**
+ * Loads both cubemaps, including their acceleration structures, from baked
+ * probe files. Returns false if any of the files is missing or invalid, in
+ * which case the cubemaps have to be recomputed.
+ */
+
+bool load_baked_probes()
+  {
+    cout << "loading baked probes..." << endl;
+
+    profiler->time_measure_begin();
+
+    bool loaded = true;
+    
+    for (int i = 0; i < 2 && loaded; i++)
+      loaded = cubemaps[i]->load_probe(probe_filename(i));
+
+    double loading_time = profiler->time_measure_end();   // the query has to be ended on failure too
+    
+    if (!loaded)
+      return false;
+      
+    cubemap_rendering_time = loading_time;
+    acc_recompute_time = 0;
+
+    for (int i = 0; i < 2; i++)
+      {
+        cubemaps[i]->get_texture_color()->load_from_gpu();
+        cubemaps[i]->get_texture_distance()->load_from_gpu();
+        cubemaps[i]->get_texture_normal()->load_from_gpu();
+      }
+
+    ErrorWriter::checkGlErrors("probe loading",true);
+    return true;
+  }
+
+void save_baked_probes()
+  {
+    cout << "saving baked probes..." << endl;
+
+    for (int i = 0; i < 2; i++)
+      cubemaps[i]->save_probe(probe_filename(i));
+  }
+
+void keyboard_callback(unsigned char key, int x, int y)
+  {
+    if (key >= '1' && key <= '4')
+      {
+        if (!wait_for_key_release)
+          {
+            requested_quad_permutation ^= 1 << (key - '1');
+            quad_permutations->request(requested_quad_permutation);   // switched in render() once compiled
+            wait_for_key_release = true;
+          }
+          
+        return;
+      }
+      
+    if (key == 'g')
+      {
+        if (!wait_for_key_release)
+          {
+            show_frame_graph = !show_frame_graph;
+            wait_for_key_release = true;
+          }
+          
+        return;
+      }
+      
+    CameraHandler::key_callback(key,x,y);
+  }
+
 void special_callback(int key, int x, int y)
   {
     switch(key)
@@ -506,36 +1035,44 @@ void special_callback(int key, int x, int y)
           
         case GLUT_KEY_F1:
           texture_to_display = 1;
+          specialize_tracer();
           break;
         
         case GLUT_KEY_F2:
           texture_to_display = 2;
+          specialize_tracer();
           break;
           
         case GLUT_KEY_F3:
           texture_to_display = 3;
+          specialize_tracer();
           break;
           
         case GLUT_KEY_F4:
           texture_to_display = 4;
+          specialize_tracer();
           break;
           
         case GLUT_KEY_F5:
           texture_to_display = 0;
+          specialize_tracer();
           break;
 
         case GLUT_KEY_F6:
           texture_to_display = 5;
+          specialize_tracer();
           break;
 
         case GLUT_KEY_F7:
           texture_to_display = 6;
+          specialize_tracer();
           break;
           
         case GLUT_KEY_F8:
           if (!wait_for_key_release)
             {
               acceleration_on = !acceleration_on;
+              specialize_tracer();
               cout << "acceleration: " << acceleration_on << endl;
               wait_for_key_release = true;
             }
@@ -546,6 +1083,14 @@ void special_callback(int key, int x, int y)
           CameraHandler::camera_transformation.set_rotation(glm::vec3(CAMERA_ROTATION));
           break;
           
+        case GLUT_KEY_F10:
+          if (!wait_for_key_release)
+            {
+              save_ground_truth_image();
+              wait_for_key_release = true;
+            }
+          break;
+          
         case GLUT_KEY_F11:
           cubemaps[0]->transformation.set_translation(CameraHandler::camera_transformation.get_translation());
           cubemaps[0]->transformation.add_translation(CameraHandler::camera_transformation.get_direction_forward() * 5.0f);
@@ -586,6 +1131,10 @@ void handle_args(int argc, char **argv)
             cout << "F4                    render stencil" << endl;
             cout << "F5                    render iterations" << endl;
             cout << "F9                    reset camera" << endl;
+            cout << "F10                   save CPU traced reference reflections" << endl;
+            cout << "1, 2, 3, 4            toggle fill unresolved/efficient sampling/" << endl;
+            cout << "                      analytical intersections/self reflections" << endl;
+            cout << "G                     show frame time graph (interval/CPU/GPU)" << endl;
             
             cout << "command line arguments:" << endl; 
             cout << "-f        fill unresolved intersections with env. mapping" << endl;
@@ -598,6 +1147,12 @@ void handle_args(int argc, char **argv)
             cout << "-s        use SW for acc computation" << endl;
             cout << "-n        no acceleration" << endl;
             cout << "-m        measure performance" << endl;
+            cout << "-r        load baked probes (bake them if not present)" << endl;
+            cout << "-b        batched scene submission (one multi-draw per view)" << endl;
+            cout << "-d        deforming mirror (streamed every frame)" << endl;
+            cout << "-o        scatter instanced props over the scene" << endl;
+            cout << "-v        with -m, measure all tracer variants (-f -e -a -s combinations)" << endl;
+            cout << "-t        save a CPU/GPU timeline of the start and " << TRACE_FRAMES << " frames to " << TRACE_FILENAME << endl;
             cout << "-WN       set different window resolutions, N = 0 ... 3" << endl;
             cout << "-CN       set cubemap resolution (non-cs only), N = 0 .. 3 " << endl;
             cout << "-MN       mirror geometry model, N = 0 .. 4 " << endl;
@@ -608,18 +1163,17 @@ void handle_args(int argc, char **argv)
         else if (strcmp(argv[i],"-f") == 0)
           {
             fill_unresolved = true;
-            shader_defines += "#define FILL_UNRESOLVED\n";
+            quad_permutation |= TRACER_FEATURE_FILL_UNRESOLVED;
           }
         else if (strcmp(argv[i],"-e") == 0)
           {
             efficient = true;
-            shader_defines += "#define EFFICIENT_SAMPLING\n";
+            quad_permutation |= TRACER_FEATURE_EFFICIENT_SAMPLING;
           }
         else if (strcmp(argv[i],"-a") == 0)
           {
             analytical = true;
-            shader_defines += "#define ANALYTICAL_INTERSECTION\n";
-            shader_defines += "#define USE_ACCELERATION_LEVELS 6\n";
+            quad_permutation |= TRACER_FEATURE_ANALYTICAL;
           }
         else if (strcmp(argv[i],"-c") == 0)
           {
@@ -630,7 +1184,7 @@ void handle_args(int argc, char **argv)
         else if (strcmp(argv[i],"-s") == 0)
           {
             self_reflections = true;
-            shader_defines += "#define SELF_REFLECTIONS\n";
+            quad_permutation |= TRACER_FEATURE_SELF_REFLECTIONS;
           }
         else if (strcmp(argv[i],"-s") == 0)
           {
@@ -692,6 +1246,30 @@ void handle_args(int argc, char **argv)
           {
             measure = true;
           }
+        else if (strcmp(argv[i],"-r") == 0)
+          {
+            baked_probes = true;
+          }
+        else if (strcmp(argv[i],"-b") == 0)
+          {
+            batched = true;
+          }
+        else if (strcmp(argv[i],"-d") == 0)
+          {
+            deforming_mirror = true;
+          }
+        else if (strcmp(argv[i],"-o") == 0)
+          {
+            scatter_props = true;
+          }
+        else if (strcmp(argv[i],"-v") == 0)
+          {
+            sweep_variants = true;
+          }
+        else if (strcmp(argv[i],"-t") == 0)
+          {
+            trace = true;
+          }
         else
           {
             cout << "unrecognized option: " << argv[i] << ", ignoring" << endl;
@@ -707,6 +1285,12 @@ int main(int argc, char** argv)
     
     if (help)
       return 0;
+      
+    if (sweep_variants)   // the sweep starts with no features
+      {
+        quad_permutation = 0;
+        self_reflections = false;
+      }
 
     if (measure)
       ErrorWriter::enabled = false;
@@ -724,7 +1308,7 @@ int main(int argc, char** argv)
 
     GLSession *session;
     session = GLSession::get_instance();
-    session->keyboard_callback = CameraHandler::key_callback;
+    session->keyboard_callback = keyboard_callback;
     session->mouse_callback = CameraHandler::mouse_click_callback;
     session->mouse_pressed_motion_callback = CameraHandler::mouse_move_callback;
     session->mouse_not_pressed_motion_callback = CameraHandler::mouse_move_callback;
@@ -732,11 +1316,20 @@ int main(int argc, char** argv)
     session->window_size[0] = window_width;
     session->window_size[1] = window_height;
     session->init(render);
+    GLState::set_dsa(true);
+    
+    if (trace)   // the initialisation (shader compilation, probe capture) is traced too
+      TraceProfiler::start_capture();
     
     profiler = new Profiler();
     profiler->new_value("pass 1");
     profiler->new_value("pass 2");
     profiler->new_value("mirror fragments");
+    profiler->new_value("GL state changes avoided");
+    profiler->new_value("GL state changes made");
+    
+    if (measure)
+      profiler->set_frame_skip(0);    // every frame is a sample, so that the percentiles catch the spikes
     
     CameraHandler::camera_transformation.set_translation(glm::vec3(CAMERA_POSITION));
     CameraHandler::camera_transformation.set_rotation(glm::vec3(CAMERA_ROTATION));
@@ -766,45 +1359,51 @@ int main(int argc, char** argv)
     
     switch (reflector)
       {
-        case 0: g5 = load_obj("../resources/teapot.obj"); break;
+        case 0: g5 = load_obj_cached("../resources/teapot.obj"); break;
         case 1: g5 = make_box_sharp(1,1,1); break;
-        case 2: g5 = load_obj("../resources/self_reflection_test.obj"); break;
-        case 3: g5 = load_obj("../resources/ball.obj"); break;
-        case 4: g5 = load_obj("../resources/monkey.obj"); break;
+        case 2: g5 = load_obj_cached("../resources/self_reflection_test.obj"); break;
+        case 3: g5 = load_obj_cached("../resources/ball.obj"); break;
+        case 4: g5 = load_obj_cached("../resources/monkey.obj"); break;
         default: break;
       }
       
     geometry_mirror = &g5;
+    geometry_mirror->set_vertex_format(VERTEX_FORMAT_COMPACT);
+    geometry_mirror->set_dynamic(deforming_mirror);
     geometry_mirror->update_gpu();
+    mirror_rest_vertices = geometry_mirror->vertices;
     
-    texture_sky = new Texture2D(16,16,TEXEL_TYPE_COLOR);
-    texture_sky->load_ppm("../resources/sky.ppm");
+    texture_sky = new Texture2D(16,16,TEXEL_TYPE_COLOR,true);
+    load_texture(texture_sky,"../resources/sky");
     texture_sky->update_gpu();
     
-    texture_scene = new Texture2D(16,16,TEXEL_TYPE_COLOR);
+    texture_scene = new Texture2D(16,16,TEXEL_TYPE_COLOR,true);
     
     Geometry3D g3;
     
     switch (scene)
       {
         case 0:
-          g3 = load_obj("../resources/scene.obj");
-          texture_scene->load_ppm("../resources/scene.ppm");
+          g3 = load_obj_cached("../resources/scene.obj");
+          scene_texture_filename = "../resources/scene";
+          load_texture(texture_scene,scene_texture_filename);
           transformation_scene.set_translation(glm::vec3(0.0,0.0,-7.0));
           transformation_scene.set_scale(glm::vec3(6,6,6));
           break;
 
         case 1:
-          g3 = load_obj("../resources/sponza simple.obj");
-          texture_scene->load_ppm("../resources/sponza simple.ppm");
+          g3 = load_obj_cached("../resources/sponza simple.obj");
+          scene_texture_filename = "../resources/sponza simple";
+          load_texture(texture_scene,scene_texture_filename);
           transformation_scene.set_translation(glm::vec3(60.0,2.0,-30.0));
           transformation_scene.set_scale(glm::vec3(60,60,60));
           break;
 
         case 2:
         default:
-          g3 = load_obj("../resources/library.obj");
-          texture_scene->load_ppm("../resources/library.ppm");
+          g3 = load_obj_cached("../resources/library.obj");
+          scene_texture_filename = "../resources/library";
+          load_texture(texture_scene,scene_texture_filename);
           transformation_scene.set_translation(glm::vec3(0.0,2.0,-30.0));
           transformation_scene.set_rotation(glm::vec3(0,3.14,0));
           transformation_scene.set_scale(glm::vec3(40,40,40));
@@ -812,9 +1411,47 @@ int main(int argc, char** argv)
       }
  
     geometry_scene = &g3;
+    geometry_scene->set_vertex_format(VERTEX_FORMAT_COMPACT);
     geometry_scene->update_gpu();
     
     texture_scene->update_gpu();
+    
+    Geometry3D g6;
+    
+    if (scatter_props)
+      {
+        g6 = load_obj_cached("../resources/rock.obj");
+        geometry_prop = &g6;
+        geometry_prop->set_vertex_format(VERTEX_FORMAT_COMPACT);
+        geometry_prop->update_gpu();
+        
+        // scatter the props over the scene floor, deterministically:
+        
+        glm::vec3 corner1 = glm::vec3(transformation_scene.get_matrix() * glm::vec4(geometry_scene->get_aabb_min(),1.0));
+        glm::vec3 corner2 = glm::vec3(transformation_scene.get_matrix() * glm::vec4(geometry_scene->get_aabb_max(),1.0));
+        glm::vec3 scene_min = glm::min(corner1,corner2);
+        glm::vec3 scene_max = glm::max(corner1,corner2);
+        float prop_scale = glm::length(scene_max - scene_min) / 100.0 / glm::length(geometry_prop->get_aabb_max() - geometry_prop->get_aabb_min());
+        vector<glm::mat4> prop_matrices;
+        
+        srand(0);
+        
+        for (unsigned int i = 0; i < NUMBER_OF_PROPS; i++)
+          {
+            TransformationTRSModel transformation;
+            float random[4];
+            
+            for (int j = 0; j < 4; j++)
+              random[j] = rand() / (float) RAND_MAX;
+            
+            transformation.set_translation(glm::vec3(scene_min.x + random[0] * (scene_max.x - scene_min.x),scene_min.y,scene_min.z + random[1] * (scene_max.z - scene_min.z)));
+            transformation.set_rotation(glm::vec3(0.0,random[2] * 2.0 * M_PI,0.0));
+            transformation.set_scale(glm::vec3(prop_scale * (0.5 + random[3])));
+            prop_matrices.push_back(transformation.get_matrix());
+          }
+        
+        geometry_prop->set_instances(prop_matrices);
+      }
 
     texture_camera_color = new Texture2D(window_width,window_height,TEXEL_TYPE_COLOR);
     texture_camera_color->update_gpu();
@@ -831,10 +1468,10 @@ int main(int argc, char** argv)
     texture_camera_stencil = new Texture2D(window_width,window_height,TEXEL_TYPE_COLOR);  // couldn't get stencil texture to work => using color instead
     texture_camera_stencil->update_gpu();
     
-    cubemaps[0] = new ReflectionTraceCubeMap(cubemap_resolution,"cubemaps[0].texture_color","cubemaps[0].texture_distance","cubemaps[0].texture_normal","cubemaps[0].position",4,5,6);
+    cubemaps[0] = new ReflectionTraceCubeMap(cubemap_resolution,"cubemaps[0].texture_color","cubemaps[0].texture_distance","cubemaps[0].texture_normal","",4,5,6);
     cubemaps[0]->update_gpu();
     
-    cubemaps[1] = new ReflectionTraceCubeMap(cubemap_resolution,"cubemaps[1].texture_color","cubemaps[1].texture_distance","cubemaps[1].texture_normal","cubemaps[1].position",7,8,9);
+    cubemaps[1] = new ReflectionTraceCubeMap(cubemap_resolution,"cubemaps[1].texture_color","cubemaps[1].texture_distance","cubemaps[1].texture_normal","",7,8,9);
     cubemaps[1]->update_gpu();
     
     ErrorWriter::checkGlErrors("cube map init",true);
@@ -848,6 +1485,17 @@ int main(int argc, char** argv)
     transformation_mirror.set_scale(glm::vec3(15.0,15.0,15.0));
     transformation_mirror.set_rotation(glm::vec3(0.0,0.0,0));
     
+    if (batched)
+      {
+        scene_batch = new GeometryBatch(VERTEX_FORMAT_UV_HALF | VERTEX_FORMAT_NORMAL_1010102);
+        scene_batch->add(geometry_sky,transformation_sky.get_matrix(),DRAW_FLAG_SKY);
+        scene_batch->add(geometry_scene,transformation_scene.get_matrix());
+        scene_batch->add(geometry_mirror,transformation_mirror.get_matrix(),DRAW_FLAG_MIRROR);
+        scene_batch->add(geometry_box,cubemaps[0]->transformation.get_matrix(),DRAW_FLAG_MARKER);
+        scene_batch->add(geometry_box,cubemaps[1]->transformation.get_matrix(),DRAW_FLAG_MARKER);
+        scene_batch->update_gpu();
+      }
+    
     texture_mirror = new Texture2D(512,512,TEXEL_TYPE_COLOR);
     texture_mirror->set_parameter_int(GL_TEXTURE_MIN_FILTER,GL_NEAREST);
     texture_mirror->set_parameter_int(GL_TEXTURE_MAG_FILTER,GL_NEAREST);
@@ -858,11 +1506,39 @@ int main(int argc, char** argv)
     texture_mirror_depth->set_parameter_int(GL_TEXTURE_MAG_FILTER,GL_NEAREST);
     texture_mirror_depth->update_gpu();
     
-    Shader shad1(file_text("shader_3d.vs",true,""),file_text("shader_3d.fs",true,""),"");
-    Shader shad2(VERTEX_SHADER_QUAD_TEXT,file_text("shader_quad.fs",true,shader_defines),"",0,false);
+    Shader::set_binary_cache_directory("shader_cache");   // repeated launches skip the compilation
+    
+    shader_3d_defines = batched ? "#define BATCHED\n" : "";
+    
+    vector<string> shader_3d_files;      // watched for hot reload, with the includes
+    shader_3d_files.push_back("shader_3d.vs");
+    shader_3d_files.push_back("shader_3d.fs");
+    
+    Shader shad1(file_text("shader_3d.vs",true,shader_3d_defines,&shader_3d_files),file_text("shader_3d.fs",true,shader_3d_defines,&shader_3d_files),"");
+    shad1.watch_files(shader_3d_files);
+    
+    vector<string> tracer_features;
+    tracer_features.push_back("#define FILL_UNRESOLVED\n");
+    tracer_features.push_back("#define EFFICIENT_SAMPLING\n");
+    tracer_features.push_back("#define ANALYTICAL_INTERSECTION\n#define USE_ACCELERATION_LEVELS 6\n");
+    tracer_features.push_back("#define SELF_REFLECTIONS\n");
+    
+    quad_permutations = new ShaderPermutations(VERTEX_SHADER_QUAD_TEXT,file_text("shader_quad.fs",false,""),tracer_features,
+      shader_defines + cubemaps[0]->get_shader_defines(),false);
+    quad_permutations->watch_files("","shader_quad.fs");
+    quad_permutations->specialize("texture_to_display",texture_to_display);   // switching these compiles a new variant
+    quad_permutations->specialize("acceleration_on",acceleration_on);
+    
+    if (sweep_variants)
+      quad_permutations->request_all();    // compile in the background while the first ones are measured
     
     shader_3d = &shad1;
-    shader_quad = &shad2;
+    shader_quad = quad_permutations->get(quad_permutation);
+    
+    frame_uniforms = new UniformBuffer(sizeof(frame_data),FRAME_DATA_BINDING_POINT);
+    
+    if (shader_3d->loaded_from_cache() && shader_quad->loaded_from_cache())
+      cerr << "shaders loaded from the binary cache" << endl;
     
     if (!shader_3d->loaded_succesfully() || !shader_quad->loaded_succesfully())
       {
@@ -870,37 +1546,12 @@ int main(int argc, char** argv)
         return 1;
       }
     
-    uniform_mirror.retrieve_location(shader_3d);
-    uniform_rendering_cubemap.retrieve_location(shader_3d);
-    uniform_light_direction.retrieve_location(shader_3d);
-    uniform_sky.retrieve_location(shader_3d);
-    uniform_texture_2d.retrieve_location(shader_3d);   
-    uniform_model_matrix.retrieve_location(shader_3d);
-    uniform_view_matrix.retrieve_location(shader_3d);
-    uniform_projection_matrix.retrieve_location(shader_3d);
-    uniform_marker.retrieve_location(shader_3d);
-    uniform_cubemap_position.retrieve_location(shader_3d);
+    retrieve_shader_3d_uniforms();
     
-    cubemaps[0]->retrieve_uniform_locations(shader_quad);
-    cubemaps[1]->retrieve_uniform_locations(shader_quad);
-    uniform_texture_color.retrieve_location(shader_quad);
-    uniform_texture_normal.retrieve_location(shader_quad);
-    uniform_texture_position.retrieve_location(shader_quad);
-    uniform_texture_stencil.retrieve_location(shader_quad);
-    uniform_texture_to_display.retrieve_location(shader_quad);
-    uniform_acceleration_on.retrieve_location(shader_quad);
-    uniform_camera_position.retrieve_location(shader_quad);
+    use_tracer_variant(quad_permutation);
     
-    shader_quad->use();
-    
-    cubemaps[0]->update_uniforms();
-    cubemaps[1]->update_uniforms();
-    uniform_texture_color.update_int(0);
-    uniform_texture_normal.update_int(1);
-    uniform_texture_position.update_int(2);
-    uniform_texture_stencil.update_int(3);    
-    
-    shader_quad->validate();    // delayed validation, for AMD GPUs
+    if (sweep_variants)
+      cout << "tracer variant " << quad_permutation << ":" << endl << quad_permutations->get_defines(quad_permutation);
     
     ErrorWriter::checkGlErrors("after init",true);
     
@@ -918,7 +1569,13 @@ int main(int argc, char** argv)
     shader_log->set_print_limit(20);
     shader_log->update_gpu();
     
-    recompute_all();   // compute the cubemaps
+    if (!baked_probes || !load_baked_probes())
+      {
+        recompute_all();   // compute the cubemaps
+
+        if (baked_probes)
+          save_baked_probes();
+      }
     
     ErrorWriter::checkGlErrors("shader log init",true);
     
@@ -946,6 +1603,8 @@ int main(int argc, char** argv)
         delete shader_compute;
       }
     
+    delete quad_permutations;
+    delete frame_uniforms;
     delete shader_log;
     delete frame_buffer_cube;
     delete texture_camera_color;
@@ -1,4 +1,4 @@
-#version 330
+#version 430
 
 in vec3 transformed_normal;         // normal in world space
 in vec4 transformed_position;       // position in world space
@@ -12,6 +12,16 @@ uniform bool marker;                // whether marking geometry is being rendere
 uniform bool rendering_cubemap;     // whether cubemap is being rendered
 uniform vec3 cubemap_position;      // if rendering_cubemap = true, contains cubemap world position
 
+#define DRAW_FLAG_SKY 1
+#define DRAW_FLAG_MARKER 2
+#define DRAW_FLAG_MIRROR 4
+
+flat in uint draw_flags;            // per instance or batched draw, combined with the uniforms
+
+#ifdef BATCHED
+uniform sampler2D texture_sky_2d;   // the sky has its own texture in the batch
+#endif
+
 layout(location = 0) out vec4 fragment_color;
 layout(location = 1) out vec3 output_position_distance;   /* x y z position in space if rendering_cubemap = true,
                                                              otherwise distance to cubemap in red channel */
@@ -25,18 +35,26 @@ float distance_from_cubemap;
   
 void main()
   {
+    bool is_sky = sky || (draw_flags & DRAW_FLAG_SKY) != 0;
+    bool is_marker = marker || (draw_flags & DRAW_FLAG_MARKER) != 0;
+    bool is_mirror = mirror || (draw_flags & DRAW_FLAG_MIRROR) != 0;
+
     diffuse_intensity = clamp(dot(normalize(transformed_normal),-1 * light_direction),0.0,1.0);
     lighting_intensity = clamp(0.4 + diffuse_intensity,0.0,1.0);
   
-    if (sky)
+    if (is_sky)
       {
+#ifdef BATCHED
+        fragment_color = texture(texture_sky_2d,uv_coords);
+#else
         fragment_color = texture(texture_2d,uv_coords);
+#endif
       }
-    else if (marker)
+    else if (is_marker)
       {
         fragment_color = vec4(1,0,0,1);
       }
-    else if (!mirror)
+    else if (!is_mirror)
       {
         fragment_color = 0.8 + 0.2 * vec4(lighting_intensity, lighting_intensity, lighting_intensity, 1.0);
         fragment_color *= texture(texture_2d,uv_coords);
@@ -45,7 +63,7 @@ void main()
     if (rendering_cubemap)
       {
         distance_from_cubemap = distance(world_position.xyz,cubemap_position);
-        output_position_distance = vec3(distance_from_cubemap,distance_from_cubemap,mirror ? 1000.0 : 0.0); // save the mirror mask in z
+        output_position_distance = vec3(distance_from_cubemap,distance_from_cubemap,is_mirror ? 1000.0 : 0.0); // save the mirror mask in z
       }
     else
       {
@@ -53,5 +71,5 @@ void main()
       }
   
     output_normal = transformed_normal.xyz;
-    output_stencil = mirror ? vec3(1.0,1.0,1.0) : vec3(0.0,0.0,0.0);
+    output_stencil = is_mirror ? vec3(1.0,1.0,1.0) : vec3(0.0,0.0,0.0);
   }
\ No newline at end of file
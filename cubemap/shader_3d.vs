@@ -1,8 +1,8 @@
-#version 330
+#version 430
+
+#include frame_data_include.txt
 
 uniform mat4 model_matrix;
-uniform mat4 view_matrix;
-uniform mat4 projection_matrix;
 
 layout (location = 0) in vec3 position;
 layout (location = 1) in vec3 texture_coords;
@@ -12,12 +12,53 @@ out vec3 transformed_normal;    // normal in world space
 out vec4 world_position;        // position in world space
 out vec4 transformed_position;  // position in view space
 out vec2 uv_coords;
+flat out uint draw_flags;       // DRAW_FLAG_* of the instance or batched draw
+
+// per-instance data of Geometry3D::draw_instanced():
+
+uniform bool instanced;
+layout (location = 4) in mat4 instance_matrix;   // takes locations 4 - 7
+layout (location = 8) in uint instance_flags;
+
+#ifdef BATCHED
+// per-draw data of GeometryBatch:
+
+layout (location = 3) in uint draw_id;
+
+struct batch_draw
+  {
+    mat4 model_matrix;
+    uint flags;
+  };
+
+layout (std430, binding = 2) readonly buffer batch_draw_data
+  {
+    batch_draw draws[];
+  };
+#endif
 
 void main()
 {
-  world_position = vec4(position,1.0) * model_matrix;
+  mat4 model = model_matrix;
+  draw_flags = 0u;
+
+#ifdef BATCHED
+  if (!instanced)
+    {
+      model = draws[draw_id].model_matrix;
+      draw_flags = draws[draw_id].flags;
+    }
+#endif
+
+  if (instanced)
+    {
+      model = model_matrix * instance_matrix;
+      draw_flags = instance_flags;
+    }
+
+  world_position = vec4(position,1.0) * model;
   transformed_position = world_position * view_matrix;
   gl_Position = transformed_position * projection_matrix;
-  transformed_normal = normalize(vec4(normal,0.0) * model_matrix).xyz;
+  transformed_normal = normalize(vec4(normal,0.0) * model).xyz;
   uv_coords = texture_coords.xy;
 }
\ No newline at end of file
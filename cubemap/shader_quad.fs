@@ -1,14 +1,17 @@
 #version 430
 #define INTERSECTION_LIMIT 1.5         // what distance means intersection, applies only if ANALYTICAL_INTERSECTION is not defined
 #define NUMBER_OF_CUBEMAPS 2
-#define ACCELERATION_LEVELS 9
-#define ACCELERATION_MIPMAP_LEVELS 9
 #define INFINITY_T 999999              // infinite value for t (line parameter) 
 
 // these defines will be set from main.cpp, they're here just for reference:
 
+#ifndef ACCELERATION_MIPMAP_LEVELS     // derived from the cubemap size, see ReflectionTraceCubeMap::get_shader_defines()
+  #define ACCELERATION_LEVELS 9
+  #define ACCELERATION_MIPMAP_LEVELS 9
+#endif
+
 #ifndef USE_ACCELERATION_LEVELS
-  #define USE_ACCELERATION_LEVELS 8      // how many levels in acceleration texture to use
+  #define USE_ACCELERATION_LEVELS (ACCELERATION_MIPMAP_LEVELS - 1)    // how many levels in acceleration texture to use
 #endif
 
 //#define FILL_UNRESOLVED              // if defined, unresolved intersections are filled with environment mapping
@@ -36,7 +39,6 @@ struct environment_cubemap             // CMO struct
     samplerCube texture_color;         // contains color
     samplerCube texture_distance;      // contains distance to cubemap center, this is NOT a depth texture
     samplerCube texture_normal;
-    vec3 position;                     // cubemap world position
   };
   
 #ifdef COMPUTE_SHADER
@@ -57,9 +59,9 @@ layout (std430, binding=1) buffer output_buffer_data
   
 uniform environment_cubemap cubemaps[NUMBER_OF_CUBEMAPS];
 
-uniform vec3 camera_position;
-uniform int texture_to_display;       // which texture to display (1 = color, 2 = normal etc.)
-uniform int acceleration_on;
+#include frame_data_include.txt
+uniform int texture_to_display;       // which texture to display (1 = color, 2 = normal etc.), specialized to a constant
+uniform int acceleration_on;          // specialized to a constant
 
 uniform sampler2D texture_color;
 uniform sampler2D texture_normal;
@@ -323,7 +325,7 @@ void main()
                   
                 normal = textureLod(texture_normal,uv_coords,0).xyz;
                 position1 = textureLod(texture_position,uv_coords,0).xyz;
-                camera_to_position1 = normalize(position1 - camera_position);
+                camera_to_position1 = normalize(position1 - camera_position.xyz);
                 reflection_vector = reflect(camera_to_position1,normal);
                 
                 position2 = position1 + reflection_vector * 1000;
@@ -353,9 +355,9 @@ void main()
                       for (i = 0; i < NUMBER_OF_CUBEMAPS; i++)  // iterate the cubemaps
                         {
                           position1_to_position2 = position2 - position1;
-                          position1_to_cube_center = cubemaps[i].position - position1;
-                          cube_coordinates1 = normalize(position1 - cubemaps[i].position);
-                          cube_coordinates2 = normalize(position2 - cubemaps[i].position);
+                          position1_to_cube_center = cubemap_positions[i].xyz - position1;
+                          cube_coordinates1 = normalize(position1 - cubemap_positions[i].xyz);
+                          cube_coordinates2 = normalize(position2 - cubemap_positions[i].xyz);
                         
                           cube_coordinates_current = normalize(-1 * position1_to_cube_center);
               
@@ -383,7 +385,7 @@ void main()
                                 get_acc_cell_info(
                                   cube_coordinates_current,
                                   ACCELERATION_MIPMAP_LEVELS,
-                                  cubemaps[i].position,
+                                  cubemap_positions[i].xyz,
                                   position1,
                                   position2,
                                   min_max,
@@ -398,7 +400,7 @@ void main()
                               iteration_counter += 1;
                       
                               tested_point2 = mix(position1,position2,t);
-                              cube_coordinates_current = normalize(tested_point2 - cubemaps[i].position);
+                              cube_coordinates_current = normalize(tested_point2 - cubemap_positions[i].xyz);
 
                               // ==== ACCELERATION CODE HERE:
                               skipped = false;
@@ -420,7 +422,7 @@ void main()
                                       get_acc_cell_info(
                                         cube_coordinates_current,
                                         j,
-                                        cubemaps[i].position,
+                                        cubemap_positions[i].xyz,
                                         position1,
                                         position2,
                                         min_max,
@@ -451,7 +453,7 @@ void main()
                               // intersection decision:
                   
                               #ifndef ANALYTICAL_INTERSECTION
-                                distance = abs(sample_distance(i,cube_coordinates_current) - length(cubemaps[i].position - tested_point2));
+                                distance = abs(sample_distance(i,cube_coordinates_current) - length(cubemap_positions[i].xyz - tested_point2));
                
                                 if (distance < final_intersection_distance)
                                   {
@@ -468,7 +470,7 @@ void main()
                                       }
                                   }
                               #else
-                                distance = sample_distance(i,cube_coordinates_current) - length(cubemaps[i].position - tested_point2);
+                                distance = sample_distance(i,cube_coordinates_current) - length(cubemap_positions[i].xyz - tested_point2);
                
                                 if (first_iteration)
                                   {
@@ -201,11 +201,11 @@ int main(int argc, char** argv)
     geometry_sky->flip_triangles();
     geometry_sky->update_gpu();
     
-    texture_sky = new Texture2D(16,16,TEXEL_TYPE_COLOR);
+    texture_sky = new Texture2D(16,16,TEXEL_TYPE_COLOR,true);
     texture_sky->load_ppm("../resources/sky.ppm");
     texture_sky->update_gpu();
     
-    texture_scene = new Texture2D(16,16,TEXEL_TYPE_COLOR);
+    texture_scene = new Texture2D(16,16,TEXEL_TYPE_COLOR,true);
     texture_scene->load_ppm("../resources/scene.ppm");
     texture_scene->update_gpu();
     
@@ -19,6 +19,26 @@
 #define TEXEL_TYPE_DEPTH 1
 #define TEXEL_TYPE_STENCIL 2
 
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+#define PROGRAM_CACHE_FILE_VERSION 1
+
+#define PREPROCESS_MAX_INCLUDE_DEPTH 32
+
+#define GL_STATE_TEXTURE_UNITS 32          ///< texture units tracked by GLState, higher ones are just passed to GL
+#define GL_STATE_UNKNOWN 0xffffffff
+
+#define TRACE_PROFILER_MAX_EVENTS 65536    ///< scopes beyond this number are not recorded
+#define TRACE_PROFILER_NO_EVENT 0xffffffff
+
+#define PROFILER_QUERY_RING_SIZE 4         ///< queries per measured value, results are read this many measurements later at the latest
+
+#define PROFILER_HISTOGRAM_MIN 0.001       ///< smaller samples fall into the first (zero) bucket
+#define PROFILER_HISTOGRAM_OCTAVES 40      ///< range of the histogram is PROFILER_HISTOGRAM_MIN * 2^40
+#define PROFILER_HISTOGRAM_BUCKETS_PER_OCTAVE 16   ///< gives about 4 % relative error of the percentiles
+#define PROFILER_FRAME_WINDOW 128          ///< number of recent frames kept for the frame timing
+
 #include <stdio.h>
 #include <GL/glew.h>
 #include <GL/freeglut.h>
@@ -36,7 +56,18 @@
 #include <streambuf>
 #include <cstdint>
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/packing.hpp>
 #include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <thread>
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <sys/inotify.h>
+#include <chrono>
 
 std::string __vs_quad_text =
   "#version 330\n"
@@ -58,7 +89,7 @@ using namespace std;
 // necessary forward declarations:
   
 void draw_fullscreen_quad(int,int);
-static string file_text(string, bool, string);
+static string file_text(string, bool, string, vector<string> *dependencies=0);
 
 // -------------------------------
 
@@ -156,6 +187,515 @@ class ErrorWriter
 
 bool ErrorWriter::enabled = true;
 
+/**
+ * Cache of the most often changed GL state (program, texture bindings,
+ * frame buffer, vertex array, viewport, enabled capabilities). All the
+ * classes of this library change this state through it, so that calls
+ * that wouldn't change anything are skipped. If the state is changed
+ * directly with GL calls, invalidate() has to be called. The number of
+ * avoided and made changes is counted.
+ */
+
+class GLState
+  {
+    protected:
+      static GLuint program;
+      static GLuint active_unit;
+      static GLuint textures_2d[GL_STATE_TEXTURE_UNITS];
+      static GLuint textures_cube[GL_STATE_TEXTURE_UNITS];
+      static GLuint framebuffer;
+      static GLuint vertex_array;
+      static GLint viewport[4];
+      static bool viewport_known;
+      static map<GLenum,bool> capabilities;
+      static bool dsa;
+      static unsigned int changes_avoided;
+      static unsigned int changes_made;
+      
+      /**
+       * Counts the change and says whether it's redundant.
+       */
+      
+      static bool redundant(bool is_redundant)
+        {
+          if (is_redundant)
+            GLState::changes_avoided++;
+          else
+            GLState::changes_made++;
+            
+          return is_redundant;
+        }
+        
+      /**
+       * Gets the tracked binding of given target in given unit, 0 if it's
+       * not tracked.
+       */
+        
+      static GLuint *texture_binding(GLenum target, GLuint unit)
+        {
+          if (unit >= GL_STATE_TEXTURE_UNITS)
+            return 0;
+            
+          switch (target)
+            {
+              case GL_TEXTURE_2D: return &(GLState::textures_2d[unit]); break;
+              case GL_TEXTURE_CUBE_MAP: return &(GLState::textures_cube[unit]); break;
+              default: return 0; break;
+            }
+        }
+        
+    public:
+      /**
+       * Forgets all the cached state, the next changes will all be made.
+       */
+      
+      static void invalidate()
+        {
+          GLState::program = GL_STATE_UNKNOWN;
+          GLState::active_unit = GL_STATE_UNKNOWN;
+          GLState::framebuffer = GL_STATE_UNKNOWN;
+          GLState::vertex_array = GL_STATE_UNKNOWN;
+          GLState::viewport_known = false;
+          GLState::capabilities.clear();
+          
+          for (int i = 0; i < GL_STATE_TEXTURE_UNITS; i++)
+            {
+              GLState::textures_2d[i] = GL_STATE_UNKNOWN;
+              GLState::textures_cube[i] = GL_STATE_UNKNOWN;
+            }
+        }
+        
+      /**
+       * Turns the direct state access calls (glBindTextureUnit) on or off,
+       * they're only used if ARB_direct_state_access is supported.
+       */
+        
+      static void set_dsa(bool enabled)
+        {
+          GLState::dsa = enabled && GLEW_ARB_direct_state_access;
+        }
+        
+      static bool is_dsa()
+        {
+          return GLState::dsa;
+        }
+        
+      static void use_program(GLuint program)
+        {
+          if (redundant(GLState::program == program))
+            return;
+            
+          glUseProgram(program);
+          GLState::program = program;
+        }
+        
+      static void active_texture(GLuint unit)
+        {
+          if (redundant(GLState::active_unit == unit))
+            return;
+            
+          glActiveTexture(GL_TEXTURE0 + unit);
+          GLState::active_unit = unit;
+        }
+        
+      /**
+       * Binds the texture to the active texture unit (e.g. to modify it).
+       */
+        
+      static void bind_texture(GLenum target, GLuint texture)
+        {
+          if (GLState::active_unit == GL_STATE_UNKNOWN)   // e.g. after invalidate() with DSA, the binding has to be tracked
+            GLState::active_texture(0);
+            
+          GLuint *binding = texture_binding(target,GLState::active_unit);
+          
+          if (binding != 0 && redundant(*binding == texture))
+            return;
+            
+          glBindTexture(target,texture);
+          
+          if (binding != 0)
+            *binding = texture;
+        }
+        
+      /**
+       * Binds the texture to given texture unit for sampling, with DSA
+       * without changing the active unit.
+       */
+        
+      static void bind_texture_unit(GLuint unit, GLenum target, GLuint texture)
+        {
+          GLuint *binding = texture_binding(target,unit);
+          
+          if (binding != 0 && redundant(*binding == texture))
+            return;
+          
+          if (GLState::dsa && texture != 0)
+            {
+              glBindTextureUnit(unit,texture);
+              
+              if (binding != 0)
+                *binding = texture;
+            }
+          else
+            {
+              GLState::active_texture(unit);
+              GLState::bind_texture(target,texture);
+            }
+        }
+        
+      /**
+       * Has to be called when a texture is deleted, as GL unbinds it from
+       * all units.
+       */
+        
+      static void forget_texture(GLuint texture)
+        {
+          for (int i = 0; i < GL_STATE_TEXTURE_UNITS; i++)
+            {
+              if (GLState::textures_2d[i] == texture)
+                GLState::textures_2d[i] = 0;
+                
+              if (GLState::textures_cube[i] == texture)
+                GLState::textures_cube[i] = 0;
+            }
+        }
+        
+      static void bind_framebuffer(GLuint framebuffer)
+        {
+          if (redundant(GLState::framebuffer == framebuffer))
+            return;
+            
+          glBindFramebuffer(GL_FRAMEBUFFER,framebuffer);
+          GLState::framebuffer = framebuffer;
+        }
+        
+      /**
+       * Has to be called when a frame buffer is deleted.
+       */
+        
+      static void forget_framebuffer(GLuint framebuffer)
+        {
+          if (GLState::framebuffer == framebuffer)
+            GLState::framebuffer = 0;
+        }
+        
+      static void bind_vertex_array(GLuint vertex_array)
+        {
+          if (redundant(GLState::vertex_array == vertex_array))
+            return;
+            
+          glBindVertexArray(vertex_array);
+          GLState::vertex_array = vertex_array;
+        }
+        
+      static void set_viewport(GLint x, GLint y, GLsizei width, GLsizei height)
+        {
+          if (redundant(GLState::viewport_known && GLState::viewport[0] == x && GLState::viewport[1] == y &&
+            GLState::viewport[2] == width && GLState::viewport[3] == height))
+            return;
+            
+          glViewport(x,y,width,height);
+          GLState::viewport[0] = x;
+          GLState::viewport[1] = y;
+          GLState::viewport[2] = width;
+          GLState::viewport[3] = height;
+          GLState::viewport_known = true;
+        }
+        
+      /**
+       * Gets the viewport, only queries GL if it's not known.
+       */
+        
+      static void get_viewport(GLint result[4])
+        {
+          if (!GLState::viewport_known)
+            {
+              glGetIntegerv(GL_VIEWPORT,GLState::viewport);
+              GLState::viewport_known = true;
+            }
+            
+          memcpy(result,GLState::viewport,4 * sizeof(GLint));
+        }
+        
+      /**
+       * Enables or disables given capability (glEnable/glDisable).
+       */
+        
+      static void set_capability(GLenum capability, bool enabled)
+        {
+          map<GLenum,bool>::iterator current = GLState::capabilities.find(capability);
+          
+          if (redundant(current != GLState::capabilities.end() && current->second == enabled))
+            return;
+            
+          if (enabled)
+            glEnable(capability);
+          else
+            glDisable(capability);
+            
+          GLState::capabilities[capability] = enabled;
+        }
+        
+      /**
+       * Gets the number of skipped redundant state changes since the last
+       * reset_counters().
+       */
+        
+      static unsigned int get_changes_avoided()
+        {
+          return GLState::changes_avoided;
+        }
+        
+      static unsigned int get_changes_made()
+        {
+          return GLState::changes_made;
+        }
+        
+      static void reset_counters()
+        {
+          GLState::changes_avoided = 0;
+          GLState::changes_made = 0;
+        }
+  };
+  
+GLuint GLState::program = GL_STATE_UNKNOWN;
+GLuint GLState::active_unit = GL_STATE_UNKNOWN;
+GLuint GLState::textures_2d[GL_STATE_TEXTURE_UNITS];
+GLuint GLState::textures_cube[GL_STATE_TEXTURE_UNITS];
+GLuint GLState::framebuffer = GL_STATE_UNKNOWN;
+GLuint GLState::vertex_array = GL_STATE_UNKNOWN;
+GLint GLState::viewport[4];
+bool GLState::viewport_known = false;
+map<GLenum,bool> GLState::capabilities;
+bool GLState::dsa = false;
+unsigned int GLState::changes_avoided = 0;
+unsigned int GLState::changes_made = 0;
+
+/**
+ * Records nested named regions (scopes) of the work into a timeline that
+ * can be saved as a Chrome trace (chrome://tracing, ui.perfetto.dev). CPU
+ * times are taken when a scope begins and ends, GPU times with GL_TIMESTAMP
+ * queries, which (unlike GL_TIME_ELAPSED queries) can be nested. While
+ * capturing, each scope is also pushed as a KHR_debug group, so that it
+ * shows in GPU debuggers. Outside of a capture a scope only costs a push
+ * and a pop of a small record. Mark the scopes with ProfileScope.
+ */
+
+class TraceProfiler
+  {
+    protected:
+      typedef struct
+        {
+          string name;
+          double cpu_begin;              ///< microseconds since start_capture()
+          double cpu_end;
+          GLuint gpu_queries[2];         ///< GL_TIMESTAMP at the begin and end
+        } trace_event;
+        
+      typedef struct
+        {
+          unsigned int event;            ///< index to events, TRACE_PROFILER_NO_EVENT if not recorded
+          bool debug_group;              ///< whether a KHR_debug group was pushed
+        } open_scope;
+        
+      static bool capturing;
+      static bool debug_groups;
+      static vector<trace_event> events;
+      static vector<open_scope> open_scopes;     ///< scopes that haven't ended yet, also the ones outside of a capture
+      static std::chrono::steady_clock::time_point cpu_start;
+      static GLint64 gpu_start;                  ///< GL time at cpu_start, in nanoseconds
+      
+      static double cpu_time()
+        {
+          return std::chrono::duration<double,std::micro>(std::chrono::steady_clock::now() - TraceProfiler::cpu_start).count();
+        }
+        
+      static void clear()
+        {
+          for (unsigned int i = 0; i < TraceProfiler::events.size(); i++)
+            glDeleteQueries(2,TraceProfiler::events[i].gpu_queries);
+            
+          TraceProfiler::events.clear();
+          
+          for (unsigned int i = 0; i < TraceProfiler::open_scopes.size(); i++)   // their events are gone
+            TraceProfiler::open_scopes[i].event = TRACE_PROFILER_NO_EVENT;
+        }
+        
+      static string escape(string text)
+        {
+          string result;
+          
+          for (unsigned int i = 0; i < text.length(); i++)
+            {
+              if (text[i] == '"' || text[i] == '\\')
+                result += '\\';
+                
+              result += text[i];
+            }
+            
+          return result;
+        }
+        
+      static void write_event(std::ofstream &file, string name, string category, int thread, double begin, double end)
+        {
+          file << ",\n{\"name\":\"" << escape(name) << "\",\"cat\":\"" << category <<
+            "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread << ",\"ts\":" << begin << ",\"dur\":" << glm::max(end - begin,0.0) << "}";
+        }
+        
+    public:
+      /**
+       * Starts recording the scopes, the previously recorded ones are
+       * discarded.
+       */
+      
+      static void start_capture()
+        {
+          TraceProfiler::clear();
+          TraceProfiler::capturing = true;
+          TraceProfiler::debug_groups = GLEW_KHR_debug;
+          TraceProfiler::cpu_start = std::chrono::steady_clock::now();
+          glGetInteger64v(GL_TIMESTAMP,&TraceProfiler::gpu_start);
+        }
+        
+      /**
+       * Stops recording, the scopes that are open are still finished.
+       */
+        
+      static void stop_capture()
+        {
+          TraceProfiler::capturing = false;
+        }
+        
+      static bool is_capturing()
+        {
+          return TraceProfiler::capturing;
+        }
+        
+      static unsigned int get_number_of_events()
+        {
+          return TraceProfiler::events.size();
+        }
+        
+      /**
+       * Opens a scope, it has to be closed with end(), see ProfileScope.
+       */
+        
+      static void begin(const char *name)
+        {
+          open_scope scope;
+          
+          scope.event = TRACE_PROFILER_NO_EVENT;
+          scope.debug_group = TraceProfiler::capturing && TraceProfiler::debug_groups;
+          
+          if (scope.debug_group)
+            glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION,0,-1,name);
+          
+          if (TraceProfiler::capturing && TraceProfiler::events.size() < TRACE_PROFILER_MAX_EVENTS)
+            scope.event = TraceProfiler::events.size();
+          
+          TraceProfiler::open_scopes.push_back(scope);   // always, so that the ends pair even if the capture starts or stops inside
+          
+          if (scope.event == TRACE_PROFILER_NO_EVENT)
+            return;
+            
+          trace_event event;
+          
+          event.name = name;
+          glGenQueries(2,event.gpu_queries);
+          glQueryCounter(event.gpu_queries[0],GL_TIMESTAMP);
+          event.cpu_begin = TraceProfiler::cpu_time();
+          event.cpu_end = event.cpu_begin;
+          
+          TraceProfiler::events.push_back(event);
+        }
+        
+      static void end()
+        {
+          if (TraceProfiler::open_scopes.empty())
+            return;
+            
+          open_scope scope = TraceProfiler::open_scopes.back();
+          TraceProfiler::open_scopes.pop_back();
+          
+          if (scope.event != TRACE_PROFILER_NO_EVENT)
+            {
+              TraceProfiler::events[scope.event].cpu_end = TraceProfiler::cpu_time();
+              glQueryCounter(TraceProfiler::events[scope.event].gpu_queries[1],GL_TIMESTAMP);
+            }
+            
+          if (scope.debug_group)
+            glPopDebugGroup();
+        }
+        
+      /**
+       * Saves the recorded scopes as a Chrome trace JSON file, CPU and GPU
+       * times are in separate rows. Waits for the GPU results, so this should
+       * be called after the capture.
+       */
+        
+      static bool save_chrome_trace(string filename)
+        {
+          std::ofstream file(filename);
+          
+          if (!file.is_open())
+            {
+              ErrorWriter::write_error("Could not write file '" + filename + "'.");
+              return false;
+            }
+            
+          file << std::fixed;
+          file.precision(3);
+          file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+          file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"CPU\"}},\n";
+          file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"GPU\"}}";
+          
+          for (unsigned int i = 0; i < TraceProfiler::events.size(); i++)
+            {
+              trace_event &event = TraceProfiler::events[i];
+              GLuint64 gpu_times[2];
+              
+              glGetQueryObjectui64v(event.gpu_queries[0],GL_QUERY_RESULT,&gpu_times[0]);
+              glGetQueryObjectui64v(event.gpu_queries[1],GL_QUERY_RESULT,&gpu_times[1]);
+              
+              write_event(file,event.name,"cpu",1,event.cpu_begin,event.cpu_end);
+              write_event(file,event.name,"gpu",2,
+                ((GLint64) gpu_times[0] - TraceProfiler::gpu_start) / 1000.0,
+                ((GLint64) gpu_times[1] - TraceProfiler::gpu_start) / 1000.0);
+            }
+            
+          file << "\n]}\n";
+          
+          return true;
+        }
+  };
+  
+bool TraceProfiler::capturing = false;
+bool TraceProfiler::debug_groups = false;
+vector<TraceProfiler::trace_event> TraceProfiler::events;
+vector<TraceProfiler::open_scope> TraceProfiler::open_scopes;
+std::chrono::steady_clock::time_point TraceProfiler::cpu_start;
+GLint64 TraceProfiler::gpu_start = 0;
+
+/**
+ * Marks a TraceProfiler scope that lasts until the object is destroyed
+ * (the end of the C++ block).
+ */
+
+class ProfileScope
+  {
+    public:
+      ProfileScope(const char *name)
+        {
+          TraceProfiler::begin(name);
+        }
+        
+      ~ProfileScope()
+        {
+          TraceProfiler::end();
+        }
+  };
+
 /**
  * Writes out mat4 data type.
  */
@@ -198,33 +738,276 @@ void print_vec3(glm::vec3 vector)
     cout << vector.x << " " << vector.y << " " << vector.z << endl;
   }
 
-static string preprocess_text(string text)
+/**
+ * Computes the 64 bit FNV-1a hash of given string.
+ *
+ * @param hash initial value, can be the result of previous call to
+ *   hash multiple strings
+ */
+
+static uint64_t hash_fnv1a(const string &text, uint64_t hash=FNV_OFFSET_BASIS)
   {
-    int include_limit = 255;
-    bool include_found;
-    size_t position, position2,position3;
-    string include_string = "#include ";
-    string filename2;
-    
-    while (include_limit >= 0) // each iteration replaces one #include
+    for (size_t i = 0; i < text.length(); i++)
       {
-        position = text.find(include_string);
-        include_found = position != string::npos;
-            
-        if (!include_found)
-          break;
+        hash ^= (unsigned char) text[i];
+        hash *= FNV_PRIME;
+      }
+      
+    return hash;
+  }
+
+static map<string,string> shader_include_cache;      ///< included file name -> text
+static map<int,string> shader_source_names;          ///< #line source string number -> file name
+
+/**
+ * Gets the source string number used in #line directives for given file
+ * name. It is derived from the name (not from the order of inclusion), so
+ * the same sources always preprocess to the same text, which matters for
+ * the program binary cache.
+ */
+
+static int shader_source_number(const string &name)
+  {
+    if (name.length() == 0)
+      return 0;
+      
+    int number = 1 + hash_fnv1a(name) % 65535;
+    shader_source_names[number] = name;
+    return number;
+  }
+  
+/**
+ * Replaces the source string numbers in a shader compile log with the file
+ * names they were assigned to by shader_source_number(). Drivers write
+ * them as e.g. "0:12(3)" or "0(12)", the first number followed by ':' or
+ * '(' on each line is considered.
+ */
+  
+static string remap_shader_log(string log)
+  {
+    string result;
+    size_t line_start = 0;
+    
+    while (line_start < log.length())
+      {
+        size_t line_end = log.find("\n",line_start);
+        
+        if (line_end == string::npos)
+          line_end = log.length();
+          
+        string line = log.substr(line_start,line_end - line_start);
+        size_t digits_start = line.find_first_of("0123456789");
+        
+        if (digits_start != string::npos)
+          {
+            size_t digits_end = line.find_first_not_of("0123456789",digits_start);
             
-        position3 = position + include_string.length();
-        position2 = text.find("\n",position3);
-        filename2 = text.substr(position3,position2 - position3);
-        text = text.replace(position,position2 - position,file_text(filename2,false,""));
-        include_limit--;
+            if (digits_end != string::npos && (line[digits_end] == ':' || line[digits_end] == '('))
+              {
+                map<int,string>::iterator name = shader_source_names.find(atoi(line.substr(digits_start,digits_end - digits_start).c_str()));
+                
+                if (name != shader_source_names.end())
+                  line.replace(digits_start,digits_end - digits_start,name->second);
+              }
+          }
+          
+        result += line + (line_end < log.length() ? "\n" : "");
+        line_start = line_end + 1;
+      }
+      
+    return result;
+  }
+  
+/**
+ * Forgets the cached texts of included files, so that they're read from
+ * disk again the next time, e.g. after they've been edited.
+ */
+  
+static void clear_include_cache()
+  {
+    shader_include_cache.clear();
+  }
+  
+/**
+ * Gets the text of an included file, from disk only the first time.
+ */
+  
+static bool include_file_text(const string &filename, const string **text)
+  {
+    map<string,string>::iterator cached = shader_include_cache.find(filename);
+    
+    if (cached == shader_include_cache.end())
+      {
+        std::ifstream stream(filename);
+    
+        if (!stream.is_open())
+          {
+            ErrorWriter::write_error("Could not open included file '" + filename + "'.");
+            return false;
+          }
+        
+        cached = shader_include_cache.insert(make_pair(filename,string((std::istreambuf_iterator<char>(stream)),std::istreambuf_iterator<char>()))).first;
       }
+      
+    *text = &(cached->second);
+    return true;
+  }
+  
+/**
+ * Helper for preprocess_text(), appends the preprocessed text to output,
+ * going through it only once.
+ *
+ * @param first_line line number of the first line of the text
+ * @param once files that have already been included and contain #pragma once
+ * @param dependencies if not 0, the names of included files are added here
+ */
+  
+static void preprocess_lines(const string &text, const string &name, unsigned int first_line, string &output, vector<string> &once, unsigned int depth, vector<string> *dependencies)
+  {
+    int source_number = shader_source_number(name);
+    unsigned int line_number = first_line;
+    size_t line_start = 0;
+    
+    while (line_start < text.length())
+      {
+        size_t line_end = text.find('\n',line_start);
+        
+        if (line_end == string::npos)
+          line_end = text.length();
+          
+        size_t directive_start = text.find_first_not_of(" \t",line_start);
+        
+        if (directive_start < line_end && text.compare(directive_start,9,"#include ") == 0)
+          {
+            size_t name_start = text.find_first_not_of(" \t\"<",directive_start + 9);
+            size_t name_end = text.find_last_not_of(" \t\r\">",line_end - 1);
+            string filename = name_start <= name_end && name_end < line_end ? text.substr(name_start,name_end - name_start + 1) : "";
+            const string *included_text;
+            
+            if (depth >= PREPROCESS_MAX_INCLUDE_DEPTH)
+              {
+                ErrorWriter::write_error("Include depth limit reached in '" + filename + "', are the includes recursive?");
+                output += "\n";
+              }
+            else if (std::find(once.begin(),once.end(),filename) != once.end() || !include_file_text(filename,&included_text))
+              output += "\n";
+            else
+              {
+                if (dependencies != 0 && std::find(dependencies->begin(),dependencies->end(),filename) == dependencies->end())
+                  dependencies->push_back(filename);
+                
+                output += "#line 1 " + to_string(shader_source_number(filename)) + "\n";
+                preprocess_lines(*included_text,filename,1,output,once,depth + 1,dependencies);
+                output += "#line " + to_string(line_number + 1) + " " + to_string(source_number) + "\n";
+              }
+          }
+        else if (directive_start < line_end && text.compare(directive_start,12,"#pragma once") == 0)
+          {
+            once.push_back(name);
+            output += "\n";
+          }
+        else
+          {
+            output.append(text,line_start,line_end - line_start);
+            output += "\n";
+          }
           
-    if (include_limit < 0)
-      ErrorWriter::write_error("Include limit reached."); 
+        line_start = line_end + 1;
+        line_number++;
+      }
+  }
+
+/**
+ * Preprocesses a shader text in one pass: expands #include directives
+ * (from an in-memory cache of the files), handles #pragma once and emits
+ * #line directives so that the compile errors refer to the original files
+ * and lines, see remap_shader_log().
+ *
+ * @param name file name of the text, for the #line directives
+ * @param defines define strings that will be put after the first line
+ *   (the #version line)
+ * @param dependencies if not 0, the names of all included files are added
+ *   here, e.g. to watch them with ShaderFileWatcher
+ */
 
-    return text;    
+static string preprocess_text(string text, string name="", string defines="", vector<string> *dependencies=0)
+  {
+    size_t first_line_end = text.find('\n');
+    
+    if (first_line_end == string::npos)
+      return text + "\n" + defines;
+    
+    string output;
+    vector<string> once;
+    
+    output.reserve(text.length() * 2);
+    output.append(text,0,first_line_end + 1);
+    output += defines;
+    output += "#line 2 " + to_string(shader_source_number(name)) + "\n";
+    
+    preprocess_lines(text.substr(first_line_end + 1),name,2,output,once,0,dependencies);
+    
+    return output;
+  }
+  
+/**
+ * Bakes given uniforms into a shader text as compile time constants, i.e.
+ * replaces each line "uniform type name;" with "const type name = value;",
+ * so that the compiler can fold the branches depending on them and unroll
+ * the loops. The number of lines stays the same. Only simple declarations
+ * (one uniform per line, no layout qualifier, no arrays) are replaced.
+ *
+ * @param constants maps uniform names to GLSL values (e.g. "2", "0.5")
+ */
+  
+static string specialize_uniforms(string text, const map<string,string> &constants)
+  {
+    if (constants.empty())
+      return text;
+      
+    string output;
+    size_t position = 0;
+    
+    output.reserve(text.length());
+    
+    while (position < text.length())
+      {
+        size_t line_end = text.find('\n',position);
+        
+        if (line_end == string::npos)
+          line_end = text.length();
+        
+        string line = text.substr(position,line_end - position);
+        size_t start = line.find_first_not_of(" \t");
+        size_t name_end = line.find(';');
+        
+        if (start != string::npos && name_end != string::npos && line.compare(start,8,"uniform ") == 0)
+          {
+            size_t type_start = line.find_first_not_of(" \t",start + 8);
+            size_t type_end = line.find_first_of(" \t",type_start);
+            size_t name_start = type_end == string::npos ? string::npos : line.find_first_not_of(" \t",type_end);
+            
+            if (name_start != string::npos && name_start < name_end)
+              {
+                string name = line.substr(name_start,name_end - name_start);
+                name = name.substr(0,name.find_last_not_of(" \t") + 1);
+                map<string,string>::const_iterator constant = constants.find(name);
+                
+                if (constant != constants.end())
+                  line = line.substr(0,start) + "const " + line.substr(type_start,type_end - type_start) + " " + name +
+                    " = " + constant->second + line.substr(name_end);
+              }
+          }
+        
+        output += line;
+        
+        if (line_end < text.length())
+          output += '\n';
+        
+        position = line_end + 1;
+      }
+      
+    return output;
   }
   
 /**
@@ -233,9 +1016,11 @@ static string preprocess_text(string text)
   * @param preprocess if true, directives such as #include will be
   *   preprocessed, otherwise not
   * @param defines define strings that will be put after the first line
+  * @param dependencies if not 0 and preprocess is true, the included files
+  *   are added here
   */
       
-static string file_text(string filename, bool preprocess, string defines)
+static string file_text(string filename, bool preprocess, string defines, vector<string> *dependencies)
   {
     std::ifstream stream(filename);
     
@@ -245,11 +1030,11 @@ static string file_text(string filename, bool preprocess, string defines)
       }
     
     std::string result((std::istreambuf_iterator<char>(stream)),std::istreambuf_iterator<char>());
-       
-    result.insert(result.find("\n") + 1,defines);
     
     if (preprocess)
-      result = preprocess_text(result);
+      return preprocess_text(result,filename,defines,dependencies);
+       
+    result.insert(result.find("\n") + 1,defines);
           
     return result;
   }
@@ -432,14 +1217,30 @@ class GLSession
           if (this->special_up_callback != 0)
             glutSpecialUpFunc(this->special_up_callback);
           
+          glutReshapeFunc(GLSession::reshape);
+          
           glewInit();
 
-          glEnable(GL_DEPTH_TEST);
-          glEnable(GL_CULL_FACE);
+          GLState::invalidate();
+          GLState::set_capability(GL_DEPTH_TEST,true);
+          GLState::set_capability(GL_CULL_FACE,true);
           
           GLSession::initialised = true;
         }
         
+      /**
+       * Window reshape handler, sets the viewport through GLState and calls
+       * reshape_callback if it is set.
+       */
+        
+      static void reshape(int width, int height)
+        {
+          GLState::set_viewport(0,0,width,height);
+          
+          if (GLSession::instance != 0 && GLSession::instance->reshape_callback != 0)
+            GLSession::instance->reshape_callback(width,height);
+        }
+        
       /**
        * Starts the rendering loop.
        */
@@ -724,130 +1525,497 @@ class TransformationTRSCamera: public TransformationTRS
   };
   
 /**
- * Represents an OpenGL shader.
+ * Watches shader source files for changes with inotify. The directories of
+ * the files are watched (not the files themselves) so that editors saving
+ * by renaming a new file over the old one are handled too. Each detected
+ * change gets a number from an increasing counter, a user remembers the
+ * counter value at its last check and asks whether any of its files has a
+ * higher one.
  */
-  
-class Shader
+
+class ShaderFileWatcher
   {
     protected:
-      GLuint shader_program;
-      bool is_ok;
+      static int inotify_descriptor;                 ///< -1 = not initialised
+      static map<int,string> directories;            ///< watch descriptor -> directory
+      static map<string,unsigned int> changes;       ///< file path -> number of its last change
+      static unsigned int change_counter;
       
       /**
-       * Helper function.
+       * Makes the path in the form "directory/name" that the events are
+       * matched against.
        */
       
-      bool add_shader(const char* shader_text, GLenum shader_type)
+      static string normalize(const string &filename)
         {
-          GLuint shader_object = glCreateShader(shader_type);
-
-          const GLchar* p[1];
-          p[0] = shader_text;
-
-          if (shader_object == 0)
+          size_t slash = filename.rfind('/');
+          return slash == string::npos ? "./" + filename : filename;
+        }
+      
+    public:
+      /**
+       * Starts watching given file, does nothing if it's already watched.
+       */
+      
+      static bool watch(const string &filename)
+        {
+          if (ShaderFileWatcher::inotify_descriptor < 0)
             {
-              ErrorWriter::write_error("Could not create shader object.");
-              ErrorWriter::checkGlErrors("rendering loop");
-              return false;
+              ShaderFileWatcher::inotify_descriptor = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+              
+              if (ShaderFileWatcher::inotify_descriptor < 0)
+                {
+                  ErrorWriter::write_error("Could not initialise inotify, shader files won't be watched.");
+                  return false;
+                }
             }
+            
+          string path = normalize(filename);
           
-          GLint lengths[1];
-          lengths[0]= strlen(shader_text);
-
-          glShaderSource(shader_object,1,p,lengths);
-          glCompileShader(shader_object);
-
-          GLint success;
-
-          glGetShaderiv(shader_object,GL_COMPILE_STATUS,&success);
-
-          if (success == GL_FALSE)
+          if (ShaderFileWatcher::changes.find(path) != ShaderFileWatcher::changes.end())
+            return true;
+            
+          string directory = path.substr(0,path.rfind('/'));
+          int watch_descriptor = inotify_add_watch(ShaderFileWatcher::inotify_descriptor,directory.c_str(),IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+          
+          if (watch_descriptor < 0)
             {
-              GLchar log[1024];
-              glGetShaderInfoLog(shader_object,sizeof(log),NULL,log);
-              cerr << "Shader compile log: " << log << endl;
+              ErrorWriter::write_error("Could not watch directory '" + directory + "'.");
               return false;
             }
-
-          glAttachShader(this->shader_program,shader_object);
-
+            
+          ShaderFileWatcher::directories[watch_descriptor] = directory;
+          ShaderFileWatcher::changes[path] = 0;
           return true;
         }
-      
-    public:
+        
       /**
-       * Sets the shader for usage.
+       * Reads the pending inotify events without blocking and records the
+       * changes of the watched files. The include cache is cleared if
+       * anything has changed.
        */
-      
-      void use()
+        
+      static void poll()
         {
-          glUseProgram(this->shader_program);
+          if (ShaderFileWatcher::inotify_descriptor < 0)
+            return;
+            
+          char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+          bool changed = false;
+          ssize_t length;
+          
+          while ((length = read(ShaderFileWatcher::inotify_descriptor,buffer,sizeof(buffer))) > 0)
+            for (char *position = buffer; position < buffer + length; position += sizeof(struct inotify_event) + ((struct inotify_event *) position)->len)
+              {
+                struct inotify_event *event = (struct inotify_event *) position;
+                
+                if (event->len == 0)
+                  continue;
+                  
+                map<string,unsigned int>::iterator file = ShaderFileWatcher::changes.find(ShaderFileWatcher::directories[event->wd] + "/" + event->name);
+                
+                if (file != ShaderFileWatcher::changes.end())
+                  {
+                    ShaderFileWatcher::change_counter++;
+                    file->second = ShaderFileWatcher::change_counter;
+                    changed = true;
+                  }
+              }
+            
+          if (changed)
+            clear_include_cache();
         }
         
-      GLuint get_shader_program_number()
+      /**
+       * Gets the current value of the change counter.
+       */
+        
+      static unsigned int get_change_counter()
         {
-          return this->shader_program;
+          return ShaderFileWatcher::change_counter;
         }
         
       /**
-       * Gets the location of uniform variable by its name.
+       * Says whether any of given files has changed after the change counter
+       * had given value.
        */
         
-      GLint get_uniform_location(string name)
+      static bool changed_since(const vector<string> &filenames, unsigned int counter)
         {
-          GLint result;
-          result = glGetUniformLocation(this->shader_program,name.c_str());
+          ShaderFileWatcher::poll();
           
-          return result;
+          for (unsigned int i = 0; i < filenames.size(); i++)
+            {
+              map<string,unsigned int>::iterator file = ShaderFileWatcher::changes.find(normalize(filenames[i]));
+              
+              if (file != ShaderFileWatcher::changes.end() && file->second > counter)
+                return true;
+            }
+            
+          return false;
         }
+  };
+  
+int ShaderFileWatcher::inotify_descriptor = -1;
+map<int,string> ShaderFileWatcher::directories;
+map<string,unsigned int> ShaderFileWatcher::changes;
+unsigned int ShaderFileWatcher::change_counter = 0;
 
-      void validate()
-        {
-          GLint success = 0;
-          char log[256];
+/**
+ * Header of a program binary cache file, see Shader. The binary data
+ * returned by glGetProgramBinary follow.
+ */
 
-          glValidateProgram(this->shader_program);
+typedef struct
+  {
+    char magic[4];                  ///< "PRGB"
+    uint32_t version;               ///< PROGRAM_CACHE_FILE_VERSION
+    uint64_t key;                   ///< hash of the sources and the GL implementation
+    uint32_t binary_format;         ///< format returned by glGetProgramBinary
+    uint32_t length;                ///< binary data length in bytes
+  } program_cache_file_header;
+
+/**
+ * Represents an OpenGL shader.
+ */
+  
+class Shader
+  {
+    protected:
+      GLuint shader_program;
+      bool is_ok;
+      bool from_cache;
+      bool pending;                         ///< compiled asynchronously and not yet checked
+      bool use_cache;
+      bool validate_when_ready;
+      uint64_t cache_key;
+      vector<GLuint> pending_shaders;
+      vector<string> feedback_variables;
+      vector<string> watched_files;
+      unsigned int checked_change;          ///< ShaderFileWatcher counter at the last check
+      
+      static string binary_cache_directory;
+      
+      /**
+       * Computes the program binary cache key from everything the
+       * linked program depends on. The defines are a part of the texts.
+       */
+      
+      static uint64_t compute_cache_key(string vertex_shader_text, string fragment_shader_text, string compute_shader_text, vector<string> *transform_feedback_variables)
+        {
+          string separator(1,'\0');
+          uint64_t key = FNV_OFFSET_BASIS;
           
-          glGetProgramiv(shader_program,GL_VALIDATE_STATUS,&success);
+          key = hash_fnv1a(vertex_shader_text + separator,key);
+          key = hash_fnv1a(fragment_shader_text + separator,key);
+          key = hash_fnv1a(compute_shader_text + separator,key);
           
-          if (!success)
+          if (transform_feedback_variables != 0)
+            for (unsigned int i = 0; i < transform_feedback_variables->size(); i++)
+              key = hash_fnv1a(transform_feedback_variables->at(i) + separator,key);
+            
+          GLenum strings[] = {GL_VENDOR,GL_RENDERER,GL_VERSION};
+          
+          for (int i = 0; i < 3; i++)
             {
-              glGetProgramInfoLog(this->shader_program,sizeof(log),NULL,log);
-              cerr << log << endl;
-
-              ErrorWriter::write_error("The shader program is invalid.");
-              this->is_ok = false;
+              const char *value = (const char *) glGetString(strings[i]);
+              key = hash_fnv1a(string(value != 0 ? value : "") + separator,key);
             }
+          
+          return key;
+        }
+        
+      static string cache_filename(uint64_t key)
+        {
+          char name[32];
+          snprintf(name,sizeof(name),"%016llx.program",(unsigned long long) key);
+          return Shader::binary_cache_directory + "/" + name;
         }
       
       /**
-       * Initialises a new instance.
-       * 
-       * @param vertex_shader_text vertex shader source code
-       * @param fragment_shader_text fragment shader source code
-       * @param compute_shader_text compute shader source code
-       * @param transform_feedback_variables list of output vertex shader variable names
-       *   to be recorded in transform feedback, leave empty if you don't want to use
-       *   transform feedback
-       * @param do_validate allows to delay the validation of the shader program, because
-       *   it may be needed (for example on AMD GPUs) to set the uniforms before validation,
-       *   the validation can be later done manually with validate() method
+       * Tries to load the linked program from the binary cache. Returns
+       * false without any error message if the binary is not present or
+       * the driver rejects it, the program then has to be compiled.
        */
       
-      Shader(string vertex_shader_text, string fragment_shader_text, string compute_shader_text, vector<string> *transform_feedback_variables = 0, bool do_validate = true)
-        {    
-          char log[256];
-         
-          this->is_ok = true;
+      bool load_binary(uint64_t key)
+        {
+          FILE *file_handle = fopen(cache_filename(key).c_str(),"rb");
+          
+          if (!file_handle)
+            return false;
+            
+          program_cache_file_header header;
+          vector<unsigned char> data;
+          bool result = fread(&header,sizeof(header),1,file_handle) == 1 &&
+            memcmp(header.magic,"PRGB",4) == 0 &&
+            header.version == PROGRAM_CACHE_FILE_VERSION &&
+            header.key == key && header.length != 0;
+            
+          if (result)
+            {
+              data.resize(header.length);
+              result = fread(&(data[0]),1,header.length,file_handle) == header.length;
+            }
+            
+          fclose(file_handle);
+          
+          GLint number_of_formats = 0;
+          
+          glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS,&number_of_formats);
+          
+          if (!result || number_of_formats <= 0)
+            return false;
+            
+          vector<GLint> formats(number_of_formats);
+          glGetIntegerv(GL_PROGRAM_BINARY_FORMATS,&(formats[0]));
+          
+          if (std::find(formats.begin(),formats.end(),(GLint) header.binary_format) == formats.end())
+            return false;   // e.g. the driver changed, glProgramBinary would raise an error
+            
+          GLint success = 0;
+          
+          glProgramBinary(this->shader_program,header.binary_format,&(data[0]),header.length);
+          glGetProgramiv(this->shader_program,GL_LINK_STATUS,&success);
+          
+          return success != 0;
+        }
+        
+      /**
+       * Saves the linked program to the binary cache.
+       */
+        
+      void save_binary(uint64_t key)
+        {
+          GLint length = 0;
+          GLenum binary_format;
+          
+          glGetProgramiv(this->shader_program,GL_PROGRAM_BINARY_LENGTH,&length);
+          
+          if (length <= 0)
+            return;
+          
+          vector<unsigned char> data(length);
+          glGetProgramBinary(this->shader_program,length,&length,&binary_format,&(data[0]));
+          
+          mkdir(Shader::binary_cache_directory.c_str(),0755);
+          
+          string filename = cache_filename(key);
+          FILE *file_handle = fopen(filename.c_str(),"wb");
+          
+          if (!file_handle)
+            {
+              ErrorWriter::write_error("Could not write program cache file '" + filename + "'.");
+              return;
+            }
+            
+          program_cache_file_header header;
+          
+          memcpy(header.magic,"PRGB",4);
+          header.version = PROGRAM_CACHE_FILE_VERSION;
+          header.key = key;
+          header.binary_format = binary_format;
+          header.length = length;
+          
+          fwrite(&header,sizeof(header),1,file_handle);
+          fwrite(&(data[0]),1,length,file_handle);
+          fclose(file_handle);
+        }
+      
+      /**
+       * Checks the compile status of given shader object and prints its log
+       * if it failed.
+       */
+      
+      static bool check_compile_status(GLuint shader_object)
+        {
+          GLint success;
+
+          glGetShaderiv(shader_object,GL_COMPILE_STATUS,&success);
+
+          if (success == GL_FALSE)
+            {
+              GLchar log[1024];
+              glGetShaderInfoLog(shader_object,sizeof(log),NULL,log);
+              cerr << "Shader compile log: " << remap_shader_log(log) << endl;
+              return false;
+            }
+            
+          return true;
+        }
+        
+      /**
+       * Checks the link status, stores the program to the binary cache and
+       * validates it, i.e. everything that has to wait for the compilation.
+       */
+        
+      void check_link_status(bool do_validate)
+        {
+          GLint success = 0;
+          char log[256];
+          
+          glGetProgramiv(this->shader_program,GL_LINK_STATUS,&success);
+       
+          if (success == 0)
+            {
+              glGetProgramInfoLog(this->shader_program,sizeof(log),NULL,log);
+              cerr << log << endl;
+              ErrorWriter::write_error("Could not link the shader program.");
+              this->is_ok = false;
+            }
+          else if (this->use_cache && this->is_ok)
+            this->save_binary(this->cache_key);
+
+          if (do_validate)
+            this->validate();
+        }
+      
+      /**
+       * Helper function.
+       *
+       * @param check_status if false, the compile status is not queried
+       *   (which would wait for the compilation), the shader is attached
+       *   anyway and checked later in finish()
+       */
+      
+      bool add_shader(const char* shader_text, GLenum shader_type, bool check_status=true)
+        {
+          GLuint shader_object = glCreateShader(shader_type);
+
+          const GLchar* p[1];
+          p[0] = shader_text;
+
+          if (shader_object == 0)
+            {
+              ErrorWriter::write_error("Could not create shader object.");
+              ErrorWriter::checkGlErrors("rendering loop");
+              return false;
+            }
+          
+          GLint lengths[1];
+          lengths[0]= strlen(shader_text);
+
+          glShaderSource(shader_object,1,p,lengths);
+          glCompileShader(shader_object);
+
+          if (check_status)
+            {
+              if (!check_compile_status(shader_object))
+                return false;
+            }
+          else
+            this->pending_shaders.push_back(shader_object);
+
+          glAttachShader(this->shader_program,shader_object);
+
+          return true;
+        }
+      
+    public:
+      /**
+       * Sets the shader for usage.
+       */
+      
+      void use()
+        {
+          this->finish();
+          GLState::use_program(this->shader_program);
+        }
+        
+      GLuint get_shader_program_number()
+        {
+          return this->shader_program;
+        }
+        
+      /**
+       * Gets the location of uniform variable by its name.
+       */
+        
+      GLint get_uniform_location(string name)
+        {
+          GLint result;
+          result = glGetUniformLocation(this->shader_program,name.c_str());
+          
+          return result;
+        }
+
+      void validate()
+        {
+          GLint success = 0;
+          char log[256];
+
+          glValidateProgram(this->shader_program);
+          
+          glGetProgramiv(shader_program,GL_VALIDATE_STATUS,&success);
+          
+          if (!success)
+            {
+              glGetProgramInfoLog(this->shader_program,sizeof(log),NULL,log);
+              cerr << log << endl;
+
+              ErrorWriter::write_error("The shader program is invalid.");
+              this->is_ok = false;
+            }
+        }
+      
+      /**
+       * Initialises a new instance.
+       * 
+       * @param vertex_shader_text vertex shader source code
+       * @param fragment_shader_text fragment shader source code
+       * @param compute_shader_text compute shader source code
+       * @param transform_feedback_variables list of output vertex shader variable names
+       *   to be recorded in transform feedback, leave empty if you don't want to use
+       *   transform feedback
+       * @param do_validate allows to delay the validation of the shader program, because
+       *   it may be needed (for example on AMD GPUs) to set the uniforms before validation,
+       *   the validation can be later done manually with validate() method
+       * @param asynchronous if true and the driver supports parallel shader
+       *   compilation, the constructor only starts the compilation and returns,
+       *   is_ready() then tells when it's done and all the status checks are
+       *   postponed to finish() (called automatically by use() and
+       *   loaded_succesfully())
+       */
+      
+      Shader(string vertex_shader_text, string fragment_shader_text, string compute_shader_text, vector<string> *transform_feedback_variables = 0, bool do_validate = true, bool asynchronous = false)
+        {    
+          this->is_ok = true;
+          this->from_cache = false;
+          this->pending = false;
+          this->validate_when_ready = do_validate;
+          this->checked_change = ShaderFileWatcher::get_change_counter();
+          
+          if (transform_feedback_variables != 0)
+            this->feedback_variables = *transform_feedback_variables;
           
           this->shader_program = glCreateProgram();
           
           if (this->shader_program == 0)
             ErrorWriter::write_error("Could not create a shader program.");
+          
+          this->use_cache = Shader::binary_cache_directory.length() != 0 && GLEW_ARB_get_program_binary;
+          this->cache_key = 0;
+          
+          if (this->use_cache)
+            {
+              this->cache_key = compute_cache_key(vertex_shader_text,fragment_shader_text,compute_shader_text,transform_feedback_variables);
+              
+              if (this->load_binary(this->cache_key))
+                {
+                  this->from_cache = true;
+                  
+                  if (do_validate)
+                    this->validate();
+                  
+                  return;
+                }
+            }
+         
+          bool check_status = !(asynchronous && Shader::start_parallel_compilation());
          
           if (compute_shader_text.length() != 0)
             {
-              if (!this->add_shader(compute_shader_text.c_str(),GL_COMPUTE_SHADER))
+              if (!this->add_shader(compute_shader_text.c_str(),GL_COMPUTE_SHADER,check_status))
                 {
                   ErrorWriter::write_error("Could not add a compute shader program. (you need OpenGL 4.5 for compute shaders.)");
                   this->is_ok = false;
@@ -856,22 +2024,20 @@ class Shader
           else  // can either have compute shader or pipeline shaders
             {
               if (vertex_shader_text.length() != 0)
-                if (!this->add_shader(vertex_shader_text.c_str(),GL_VERTEX_SHADER))
+                if (!this->add_shader(vertex_shader_text.c_str(),GL_VERTEX_SHADER,check_status))
                   {
                     ErrorWriter::write_error("Could not add a vertex shader program.");
                     this->is_ok = false;
                   }
                     
               if (fragment_shader_text.length() != 0)
-                if (!this->add_shader(fragment_shader_text.c_str(),GL_FRAGMENT_SHADER))
+                if (!this->add_shader(fragment_shader_text.c_str(),GL_FRAGMENT_SHADER,check_status))
                   {
                     ErrorWriter::write_error("Could not add a fragment shader program.");
                     this->is_ok = false;
                   }
             }
             
-          GLint success = 0;
-          
           // init transform feedback:
           
           if (transform_feedback_variables != 0 && transform_feedback_variables->size() > 0)
@@ -886,65 +2052,547 @@ class Shader
               glTransformFeedbackVaryings(this->shader_program,transform_feedback_variables->size(),(const GLchar **) variable_names,GL_INTERLEAVED_ATTRIBS);
             }
           
+          if (this->use_cache)
+            glProgramParameteri(this->shader_program,GL_PROGRAM_BINARY_RETRIEVABLE_HINT,GL_TRUE);
+          
           glLinkProgram(this->shader_program);
-          glGetProgramiv(this->shader_program,GL_LINK_STATUS,&success);
-       
-          if (success == 0)
-            {
-              glGetProgramInfoLog(this->shader_program,sizeof(log),NULL,log);
-              cerr << log << endl;
-              ErrorWriter::write_error("Could not link the shader program.");
-              this->is_ok = false;
-            }
-
-          if (do_validate)
-            this->validate();
+          
+          if (check_status)
+            this->check_link_status(do_validate);
+          else
+            this->pending = true;
         }
         
-      bool loaded_succesfully()
+      /**
+       * Asks the driver to compile shaders on background threads, returns
+       * false if it can't (KHR/ARB_parallel_shader_compile is missing).
+       */
+        
+      static bool start_parallel_compilation()
         {
-          return this->is_ok;
+          static bool started = false;
+          
+          if (started)
+            return true;
+          
+          if (GLEW_ARB_parallel_shader_compile)
+            glMaxShaderCompilerThreadsARB(0xffffffff);    // implementation specific number of threads
+          else if (GLEW_KHR_parallel_shader_compile)
+            glMaxShaderCompilerThreadsKHR(0xffffffff);
+          else
+            return false;
+            
+          started = true;
+          return true;
         }
         
       /**
-       * Runs the compute shader, use() must have been called before this.
+       * Says whether the asynchronous compilation has finished, without
+       * waiting for it.
        */
-      
-      void run_compute(unsigned int groups_x, unsigned int groups_y, unsigned int groups_z)
+        
+      bool is_ready()
         {
-          if (groups_x * groups_y * groups_z == 0)
-            ErrorWriter::write_error("Running compute dispatch with zero groups - nothing will happen (all x,y,z have to be non-zero).");
+          if (!this->pending)
+            return true;
             
-          glDispatchCompute(groups_x,groups_y,groups_z);
+          GLint done = 0;
+          glGetProgramiv(this->shader_program,GL_COMPLETION_STATUS_ARB,&done);
+          return done != 0;
         }
-  };
-  
-/**
- * Represnts a uniform shader variable.
- */
-
-class UniformVariable
-  {
-    protected:
-      GLint location;
-      bool location_retrieved;
-      string name;
-      
-      bool pre_update_check()
+        
+      /**
+       * Waits for the asynchronous compilation and checks its results, does
+       * nothing for programs that are already checked.
+       */
+        
+      void finish()
         {
-          #ifndef NO_UNIFORM_UPDATE_ERRORS
-            if (!this->location_retrieved)
-              ErrorWriter::write_error("Trying to update uniform variable '" + this->name + "' without its location retrieved.");
-          #endif
+          if (!this->pending)
+            return;
             
-          return this->location_retrieved;
+          this->pending = false;
+          
+          for (unsigned int i = 0; i < this->pending_shaders.size(); i++)
+            if (!check_compile_status(this->pending_shaders[i]))
+              {
+                ErrorWriter::write_error("Could not compile a shader of the program.");
+                this->is_ok = false;
+              }
+              
+          this->pending_shaders.clear();
+          this->check_link_status(this->validate_when_ready);
         }
-      
-    public:
-      UniformVariable(string name)
+        
+      bool loaded_succesfully()
+        {
+          this->finish();
+          return this->is_ok;
+        }
+        
+      /**
+       * Watches given source files (including the included ones, see
+       * file_text()) for changes, has_changed() then tells when to reload
+       * the program with replace_program().
+       */
+        
+      void watch_files(const vector<string> &filenames)
+        {
+          for (unsigned int i = 0; i < filenames.size(); i++)
+            if (ShaderFileWatcher::watch(filenames[i]))
+              this->watched_files.push_back(filenames[i]);
+        }
+        
+      /**
+       * Says whether any of the watched files has changed since the last
+       * call (or since the program was created).
+       */
+        
+      bool has_changed()
+        {
+          bool result = ShaderFileWatcher::changed_since(this->watched_files,this->checked_change);
+          this->checked_change = ShaderFileWatcher::get_change_counter();
+          return result;
+        }
+        
+      /**
+       * Compiles a new program from given sources and, only if that
+       * succeeds, replaces the current one with it, so a broken edit keeps
+       * the old program running. The uniform locations have to be
+       * retrieved again after a successful replacement.
+       */
+        
+      bool replace_program(string vertex_shader_text, string fragment_shader_text, string compute_shader_text)
+        {
+          Shader *replacement = new Shader(vertex_shader_text,fragment_shader_text,compute_shader_text,&(this->feedback_variables),this->validate_when_ready);
+          bool result = replacement->loaded_succesfully();
+          
+          if (result)
+            {
+              this->finish();
+              glDeleteProgram(this->shader_program);
+              this->shader_program = replacement->shader_program;
+              this->from_cache = replacement->from_cache;
+              this->is_ok = true;
+            }
+          else
+            {
+              glDeleteProgram(replacement->shader_program);
+              ErrorWriter::write_error("Could not reload the shader program, keeping the old one.");
+            }
+            
+          delete replacement;
+          return result;
+        }
+        
+      /**
+       * Says whether the program was loaded from the binary cache instead
+       * of being compiled.
+       */
+        
+      bool loaded_from_cache()
+        {
+          return this->from_cache;
+        }
+        
+      /**
+       * Enables the program binary cache for all shaders created after this
+       * call. Linked programs are stored in given directory under a hash of
+       * their sources (including the defines), transform feedback variables
+       * and the GL vendor, renderer and version, so any change of these
+       * simply misses the cache and compiles the program again.
+       *
+       * @param directory cache directory, empty string disables the cache
+       */
+        
+      static void set_binary_cache_directory(string directory)
+        {
+          Shader::binary_cache_directory = directory;
+        }
+        
+      /**
+       * Runs the compute shader, use() must have been called before this.
+       */
+      
+      void run_compute(unsigned int groups_x, unsigned int groups_y, unsigned int groups_z)
+        {
+          if (groups_x * groups_y * groups_z == 0)
+            ErrorWriter::write_error("Running compute dispatch with zero groups - nothing will happen (all x,y,z have to be non-zero).");
+            
+          glDispatchCompute(groups_x,groups_y,groups_z);
+        }
+  };
+  
+string Shader::binary_cache_directory = "";
+
+/**
+ * Manages the variants of a shader that differ by a set of feature
+ * defines which can be switched on and off independently, and by the
+ * values of specialized uniforms that are baked into the code as
+ * constants (see specialize()). Variant (permutation) number has one bit
+ * per feature. Variants are compiled on request, asynchronously if the
+ * driver allows it, and kept, so switching between them at runtime is
+ * instant once they're compiled.
+ */
+
+class ShaderPermutations
+  {
+    protected:
+      typedef struct
+        {
+          Shader *shader;
+          unsigned int permutation;
+          map<string,string> constants;     ///< specialized uniforms it was compiled with
+        } shader_variant;
+    
+      string vertex_shader_text;
+      string fragment_shader_text;
+      string base_defines;
+      vector<string> feature_defines;
+      map<string,string> constants;         ///< current values of the specialized uniforms
+      map<string,shader_variant> shaders;   ///< compiled variants by get_key()
+      bool do_validate;
+      string vertex_shader_file;            ///< for reloading, empty if not from a file
+      string fragment_shader_file;
+      vector<string> watched_files;         ///< the source files and their includes
+      bool watching;
+      unsigned int checked_change;          ///< ShaderFileWatcher counter at the last check
+      
+      /**
+       * Does what file_text() does with the defines and #includes and bakes
+       * in the constants, the included files get watched if watch_files()
+       * has been called.
+       */
+      
+      string insert_defines(string text, string name, string defines, const map<string,string> &constants)
+        {
+          if (text.length() == 0)
+            return text;
+            
+          vector<string> dependencies;
+          string result = specialize_uniforms(preprocess_text(text,name,defines,&dependencies),constants);
+          
+          if (this->watching)
+            for (unsigned int i = 0; i < dependencies.size(); i++)
+              if (std::find(this->watched_files.begin(),this->watched_files.end(),dependencies[i]) == this->watched_files.end() &&
+                ShaderFileWatcher::watch(dependencies[i]))
+                this->watched_files.push_back(dependencies[i]);
+            
+          return result;
+        }
+        
+      /**
+       * Gets the cache key of given permutation with the current values of
+       * the specialized uniforms.
+       */
+        
+      string get_key(unsigned int permutation)
+        {
+          string result = to_string(permutation);
+          
+          for (map<string,string>::iterator it = this->constants.begin(); it != this->constants.end(); ++it)
+            result += ";" + it->first + "=" + it->second;
+            
+          return result;
+        }
+        
+      /**
+       * Gets the variant of given permutation with the current constants,
+       * 0 if it hasn't been requested.
+       */
+        
+      shader_variant *find(unsigned int permutation)
+        {
+          map<string,shader_variant>::iterator it = this->shaders.find(this->get_key(permutation));
+          return it == this->shaders.end() ? 0 : &(it->second);
+        }
+      
+    public:
+      /**
+       * Initialises a new instance, doesn't compile anything yet.
+       *
+       * @param vertex_shader_text vertex shader source code, not
+       *   preprocessed, i.e. as returned by file_text(filename,false,"")
+       * @param fragment_shader_text fragment shader source code, also not
+       *   preprocessed
+       * @param feature_defines define lines for each feature, bit i of the
+       *   permutation number turns on feature_defines[i]
+       * @param base_defines define lines common for all permutations
+       * @param do_validate same as in Shader constructor
+       */
+      
+      ShaderPermutations(string vertex_shader_text, string fragment_shader_text, vector<string> feature_defines, string base_defines="", bool do_validate=true)
+        {
+          this->vertex_shader_text = vertex_shader_text;
+          this->fragment_shader_text = fragment_shader_text;
+          this->feature_defines = feature_defines;
+          this->base_defines = base_defines;
+          this->do_validate = do_validate;
+          this->watching = false;
+          this->checked_change = 0;
+        }
+        
+      virtual ~ShaderPermutations()
+        {
+          for (map<string,shader_variant>::iterator it = this->shaders.begin(); it != this->shaders.end(); ++it)
+            {
+              glDeleteProgram(it->second.shader->get_shader_program_number());
+              delete it->second.shader;
+            }
+        }
+        
+      unsigned int get_number_of_permutations()
+        {
+          return 1 << this->feature_defines.size();
+        }
+        
+      /**
+       * Gets the defines used for given permutation.
+       */
+        
+      string get_defines(unsigned int permutation)
+        {
+          string result = this->base_defines;
+          
+          for (unsigned int i = 0; i < this->feature_defines.size(); i++)
+            if (permutation & (1 << i))
+              result += this->feature_defines[i];
+              
+          return result;
+        }
+        
+      /**
+       * Makes given uniform a compile time constant with given value in the
+       * permutations requested from now on, the ones compiled with other
+       * values are kept. The uniform has to be declared on its own line,
+       * see specialize_uniforms(). Its location can't be retrieved from the
+       * specialized shaders.
+       *
+       * @param value GLSL value, e.g. "1" or "0.5"
+       */
+        
+      void specialize(string uniform_name, string value)
+        {
+          this->constants[uniform_name] = value;
+        }
+        
+      void specialize(string uniform_name, int value)
+        {
+          this->specialize(uniform_name,to_string(value));
+        }
+        
+      /**
+       * Makes given uniform a normal uniform again in the permutations
+       * requested from now on.
+       */
+        
+      void unspecialize(string uniform_name)
+        {
+          this->constants.erase(uniform_name);
+        }
+        
+      bool is_specialized(string uniform_name)
+        {
+          return this->constants.find(uniform_name) != this->constants.end();
+        }
+        
+      /**
+       * Starts the compilation of given permutation (with the current
+       * constants) if it hasn't been started yet and returns immediately (if
+       * parallel compilation is supported).
+       */
+        
+      void request(unsigned int permutation)
+        {
+          if (permutation >= this->get_number_of_permutations() || this->find(permutation) != 0)
+            return;
+            
+          string defines = this->get_defines(permutation);
+          shader_variant variant;
+          
+          variant.permutation = permutation;
+          variant.constants = this->constants;
+          variant.shader = new Shader(
+            insert_defines(this->vertex_shader_text,this->vertex_shader_file,defines,this->constants),
+            insert_defines(this->fragment_shader_text,this->fragment_shader_file,defines,this->constants),
+            "",0,this->do_validate,true);
+            
+          this->shaders[this->get_key(permutation)] = variant;
+        }
+        
+      /**
+       * Says which files the sources were loaded from and starts watching
+       * them and their includes, call this before requesting permutations.
+       * The names are also used in the #line directives.
+       *
+       * @param vertex_shader_file vertex shader file, empty string if the
+       *   text doesn't come from a file
+       * @param fragment_shader_file fragment shader file, empty string if
+       *   the text doesn't come from a file
+       */
+        
+      void watch_files(string vertex_shader_file, string fragment_shader_file)
+        {
+          this->vertex_shader_file = vertex_shader_file;
+          this->fragment_shader_file = fragment_shader_file;
+          this->watching = true;
+          this->checked_change = ShaderFileWatcher::get_change_counter();
+          
+          string files[2] = {vertex_shader_file,fragment_shader_file};
+          
+          for (int i = 0; i < 2; i++)
+            if (files[i].length() != 0 && ShaderFileWatcher::watch(files[i]))
+              this->watched_files.push_back(files[i]);
+        }
+        
+      /**
+       * If any of the watched files has changed, reads the sources again and
+       * recompiles the variant in use. It's replaced only if it compiles, so
+       * its Shader pointer stays valid, but the uniform locations have to be
+       * retrieved again if true is returned. The other variants are deleted
+       * and get compiled again when they're requested, so don't keep
+       * pointers to them.
+       *
+       * @param active the variant in use, as returned by get()
+       */
+        
+      bool reload_if_changed(Shader *active)
+        {
+          if (!this->watching || !ShaderFileWatcher::changed_since(this->watched_files,this->checked_change))
+            return false;
+            
+          this->checked_change = ShaderFileWatcher::get_change_counter();
+          
+          if (this->vertex_shader_file.length() != 0)
+            this->vertex_shader_text = file_text(this->vertex_shader_file,false,"");
+            
+          if (this->fragment_shader_file.length() != 0)
+            this->fragment_shader_text = file_text(this->fragment_shader_file,false,"");
+            
+          bool result = false;
+          map<string,shader_variant>::iterator it = this->shaders.begin();
+          
+          while (it != this->shaders.end())
+            {
+              if (it->second.shader == active)
+                {
+                  string defines = this->get_defines(it->second.permutation);
+              
+                  result = active->replace_program(
+                    insert_defines(this->vertex_shader_text,this->vertex_shader_file,defines,it->second.constants),
+                    insert_defines(this->fragment_shader_text,this->fragment_shader_file,defines,it->second.constants),
+                    "");
+                    
+                  ++it;
+                }
+              else
+                {
+                  glDeleteProgram(it->second.shader->get_shader_program_number());
+                  delete it->second.shader;
+                  this->shaders.erase(it++);
+                }
+            }
+              
+          return result;
+        }
+        
+      /**
+       * Requests all the permutations (with the current constants), so that
+       * they compile in the background.
+       */
+        
+      void request_all()
+        {
+          for (unsigned int i = 0; i < this->get_number_of_permutations(); i++)
+            this->request(i);
+        }
+        
+      /**
+       * Says whether given permutation (with the current constants) can be
+       * used without waiting.
+       */
+        
+      bool is_ready(unsigned int permutation)
+        {
+          shader_variant *variant = this->find(permutation);
+          return variant != 0 && variant->shader->is_ready();
+        }
+        
+      /**
+       * Gets the shader of given permutation with the current constants,
+       * requesting it if needed.
+       *
+       * @param wait if false and the permutation is still compiling, 0 is
+       *   returned instead of waiting
+       * @return the shader or 0 (also if the permutation number is out of
+       *   range)
+       */
+        
+      Shader *get(unsigned int permutation, bool wait=true)
+        {
+          if (permutation >= this->get_number_of_permutations())
+            {
+              ErrorWriter::write_error("Shader permutation " + to_string(permutation) + " doesn't exist.");
+              return 0;
+            }
+          
+          this->request(permutation);
+          
+          Shader *shader = this->find(permutation)->shader;
+          
+          if (!wait && !shader->is_ready())
+            return 0;
+            
+          shader->finish();
+          return shader;
+        }
+  };
+
+/**
+ * Represnts a uniform shader variable.
+ */
+
+class UniformVariable
+  {
+    protected:
+      GLint location;
+      bool location_retrieved;
+      string name;
+      unsigned char cached_value[64];      ///< last value submitted to the program
+      unsigned int cached_size;            ///< 0 = nothing submitted yet
+      
+      /**
+       * Compares the value with the last submitted one and remembers it,
+       * the uniform values are per program state, so an unchanged value
+       * doesn't have to be submitted again.
+       */
+      
+      bool value_changed(const void *value, unsigned int size)
+        {
+          if (this->cached_size == size && memcmp(this->cached_value,value,size) == 0)
+            return false;
+            
+          memcpy(this->cached_value,value,size);
+          this->cached_size = size;
+          return true;
+        }
+      
+      bool pre_update_check()
+        {
+          #ifndef NO_UNIFORM_UPDATE_ERRORS
+            if (!this->location_retrieved)
+              ErrorWriter::write_error("Trying to update uniform variable '" + this->name + "' without its location retrieved.");
+          #endif
+            
+          return this->location_retrieved;
+        }
+      
+    public:
+      UniformVariable(string name)
         {
           this->name = name;
           this->location = 0;
+          this->cached_size = 0;
           location_retrieved = false;
         }
         
@@ -960,6 +2608,7 @@ class UniformVariable
       bool retrieve_location(Shader *shader)
         {
           this->location = shader->get_uniform_location(this->name.c_str());
+          this->invalidate_cache();
         
           if (this->location < 0)
             {
@@ -971,39 +2620,53 @@ class UniformVariable
           return true;
         }
         
+      /**
+       * Makes the next update submit its value even if it's the same as the
+       * last one, call this if the uniform was set by other means than this
+       * object. The updates expect the program the location was retrieved
+       * from to be in use.
+       */
+        
+      void invalidate_cache()
+        {
+          this->cached_size = 0;
+        }
+        
       void update_uint(unsigned int value)
         {
-          if (this->pre_update_check())
+          if (this->pre_update_check() && this->value_changed(&value,sizeof(value)))
             glUniform1ui(this->location,value);
         }
         
       void update_int(int value)
         {
-          if (this->pre_update_check())
+          if (this->pre_update_check() && this->value_changed(&value,sizeof(value)))
             glUniform1i(this->location,value);
         }
 
       void update_mat3(glm::mat3 value)
         {
-          if (this->pre_update_check())
+          if (this->pre_update_check() && this->value_changed(glm::value_ptr(value),9 * sizeof(float)))
             glUniformMatrix3fv(this->location,1,GL_TRUE,glm::value_ptr(value));
         }
         
       void update_mat4(glm::mat4 value)
         {
-          if (this->pre_update_check())
+          if (this->pre_update_check() && this->value_changed(glm::value_ptr(value),16 * sizeof(float)))
             glUniformMatrix4fv(this->location,1,GL_TRUE,glm::value_ptr(value));
         }
         
       void update_vec3(glm::vec3 value)
         {
-          if (this->pre_update_check())
+          if (this->pre_update_check() && this->value_changed(glm::value_ptr(value),3 * sizeof(float)))
             glUniform3fv(this->location,1,glm::value_ptr(value));
         }
         
       void update_float_3(float value1, float value2, float value3)
         {
-          if (this->pre_update_check())
+          float values[3] = {value1,value2,value3};
+          
+          if (this->pre_update_check() && this->value_changed(values,sizeof(values)))
             glUniform3f(this->location,value1,value2,value3);
         }
   };
@@ -1538,7 +3201,7 @@ class Image2D: public Printable
                 break;
                     
               case TEXEL_TYPE_STENCIL:
-                return GL_LUMINANCE;
+                return GL_R32I;            // immutable storage needs a sized format
                 break;
                 
               default:
@@ -1567,7 +3230,7 @@ class Image2D: public Printable
                 break;
                     
               case TEXEL_TYPE_STENCIL:
-                return GL_LUMINANCE;
+                return GL_RED_INTEGER;
                 break;
                 
               default:
@@ -1686,22 +3349,304 @@ class Image2D: public Printable
   };
   
 /**
- * Abstract texture class.
+ * Block compressed (BC1, BC3 or BC7) image data with a precomputed
+ * mipmap chain, which can be loaded from and saved to KTX (version 1.1)
+ * file format. The data are uploaded as they are, without any
+ * decompression on CPU. Cubemap faces are kept in KTX order, i.e.
+ * +X, -X, +Y, -Y, +Z, -Z.
  */
-  
-class Texture: public Printable, public GPUObject
+
+class CompressedImage
   {
     protected:
-      GLuint to;                     // texture object id
-      unsigned int mipmap_level;     // which level of mipmap is being operated on on CPU
+      GLuint internal_format;
+      unsigned int width;
+      unsigned int height;
+      unsigned int number_of_faces;
+      vector<vector<unsigned char> > data;   ///< compressed blocks, index = level * number_of_faces + face
+
+    public:
+      CompressedImage(GLuint internal_format=GL_COMPRESSED_RGB_S3TC_DXT1_EXT, unsigned int width=0, unsigned int height=0, unsigned int number_of_faces=1)
+        {
+          this->internal_format = internal_format;
+          this->width = width;
+          this->height = height;
+          this->number_of_faces = number_of_faces;
+        }
 
       /**
-       * Return texture size based on currently set this->mipmap_level value.
+       * Checks if given internal format is one of the supported block
+       * compressed formats.
        */
-      
-      unsigned int get_current_mipmap_size(unsigned int base_size)
+
+      static bool is_supported_format(GLuint internal_format)
         {
-          return glm::max((unsigned int) 1,base_size / int(pow(2,this->mipmap_level)));
+          switch (internal_format)
+            {
+              case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+              case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+              case GL_COMPRESSED_SRGB_S3TC_DXT1_EXT:
+              case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+              case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT:
+              case GL_COMPRESSED_RGBA_BPTC_UNORM:
+              case GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM:
+                return true;
+                break;
+
+              default:
+                return false;
+                break;
+            }
+        }
+
+      /**
+       * Returns the size of one 4x4 block in bytes for given format.
+       */
+
+      static unsigned int get_block_size(GLuint internal_format)
+        {
+          switch (internal_format)
+            {
+              case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+              case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+              case GL_COMPRESSED_SRGB_S3TC_DXT1_EXT:
+                return 8;
+                break;
+
+              default:
+                return 16;
+                break;
+            }
+        }
+
+      /**
+       * Returns the size in bytes of one face of given mipmap level.
+       */
+
+      unsigned int get_level_size(unsigned int level)
+        {
+          unsigned int blocks_x = (this->get_level_width(level) + 3) / 4;
+          unsigned int blocks_y = (this->get_level_height(level) + 3) / 4;
+          return blocks_x * blocks_y * CompressedImage::get_block_size(this->internal_format);
+        }
+
+      unsigned int get_level_width(unsigned int level)
+        {
+          return glm::max((unsigned int) 1,this->width >> level);
+        }
+
+      unsigned int get_level_height(unsigned int level)
+        {
+          return glm::max((unsigned int) 1,this->height >> level);
+        }
+
+      GLuint get_internal_format()
+        {
+          return this->internal_format;
+        }
+
+      unsigned int get_width()
+        {
+          return this->width;
+        }
+
+      unsigned int get_height()
+        {
+          return this->height;
+        }
+
+      unsigned int get_number_of_faces()
+        {
+          return this->number_of_faces;
+        }
+
+      unsigned int get_number_of_levels()
+        {
+          return this->data.size() / glm::max((unsigned int) 1,this->number_of_faces);
+        }
+
+      /**
+       * Gets a pointer to compressed data of given mipmap level and face.
+       */
+
+      unsigned char *get_data_pointer(unsigned int level, unsigned int face=0)
+        {
+          return &(this->data[level * this->number_of_faces + face][0]);
+        }
+
+      /**
+       * Appends compressed data of the next mipmap level of given face. Levels
+       * have to be added in order, for each level all faces have to be added
+       * in order.
+       */
+
+      void add_level_data(vector<unsigned char> &level_data)
+        {
+          this->data.push_back(level_data);
+        }
+
+      /**
+       * Loads the data from KTX file. Only block compressed 2D textures and
+       * cubemaps are supported.
+       */
+
+      bool load_ktx(string filename)
+        {
+          string error_string = "Could not load KTX file '" + filename + "'";
+          const unsigned char identifier[12] = {0xAB,0x4B,0x54,0x58,0x20,0x31,0x31,0xBB,0x0D,0x0A,0x1A,0x0A};
+          unsigned char file_identifier[12];
+          uint32_t header[13];       // endianness, glType, glTypeSize, glFormat, glInternalFormat, glBaseInternalFormat, width, height, depth, array elements, faces, mip levels, key-value bytes
+          FILE *file_handle;
+
+          file_handle = fopen(filename.c_str(),"rb");
+
+          if (!file_handle)
+            {
+              ErrorWriter::write_error(error_string + " (File could not be opened.)");
+              return false;
+            }
+
+          if (fread(file_identifier,1,12,file_handle) != 12 || memcmp(file_identifier,identifier,12) != 0 ||
+              fread(header,sizeof(uint32_t),13,file_handle) != 13)
+            {
+              ErrorWriter::write_error(error_string + " (Not a KTX file.)");
+              fclose(file_handle);
+              return false;
+            }
+
+          if (header[0] != 0x04030201)
+            {
+              ErrorWriter::write_error(error_string + " (Unsupported endianness.)");
+              fclose(file_handle);
+              return false;
+            }
+
+          if (header[1] != 0 || !CompressedImage::is_supported_format(header[4]) || header[8] > 1 || header[9] != 0 ||
+              (header[10] != 1 && header[10] != 6))
+            {
+              ErrorWriter::write_error(error_string + " (Only BC1, BC3 and BC7 compressed 2D textures and cubemaps are supported.)");
+              fclose(file_handle);
+              return false;
+            }
+
+          this->internal_format = header[4];
+          this->width = header[6];
+          this->height = header[7];
+          this->number_of_faces = header[10];
+          this->data.clear();
+
+          unsigned int number_of_levels = glm::max((uint32_t) 1,header[11]);
+
+          fseek(file_handle,header[12],SEEK_CUR);     // skip key-value data
+
+          for (unsigned int level = 0; level < number_of_levels; level++)
+            {
+              uint32_t image_size;
+
+              if (fread(&image_size,sizeof(uint32_t),1,file_handle) != 1 || image_size != this->get_level_size(level))
+                {
+                  ErrorWriter::write_error(error_string + " (Wrong mipmap level size.)");
+                  fclose(file_handle);
+                  return false;
+                }
+
+              for (unsigned int face = 0; face < this->number_of_faces; face++)
+                {
+                  vector<unsigned char> level_data(image_size);
+
+                  if (fread(&(level_data[0]),1,image_size,file_handle) != image_size)
+                    {
+                      ErrorWriter::write_error(error_string + " (Error reading the block data.)");
+                      fclose(file_handle);
+                      return false;
+                    }
+
+                  fseek(file_handle,(4 - image_size % 4) % 4,SEEK_CUR);   // cube padding
+
+                  this->add_level_data(level_data);
+                }
+            }
+
+          fclose(file_handle);
+          return true;
+        }
+
+      /**
+       * Saves the data to KTX file.
+       */
+
+      bool save_ktx(string filename)
+        {
+          const unsigned char identifier[12] = {0xAB,0x4B,0x54,0x58,0x20,0x31,0x31,0xBB,0x0D,0x0A,0x1A,0x0A};
+          const unsigned char padding[4] = {0,0,0,0};
+          uint32_t header[13];
+          FILE *file_handle;
+
+          file_handle = fopen(filename.c_str(),"wb");
+
+          if (!file_handle)
+            return false;
+
+          bool has_alpha = this->internal_format != GL_COMPRESSED_RGB_S3TC_DXT1_EXT && this->internal_format != GL_COMPRESSED_SRGB_S3TC_DXT1_EXT;
+
+          header[0] = 0x04030201;
+          header[1] = 0;                                // compressed => glType = 0
+          header[2] = 1;
+          header[3] = 0;                                // compressed => glFormat = 0
+          header[4] = this->internal_format;
+          header[5] = has_alpha ? GL_RGBA : GL_RGB;
+          header[6] = this->width;
+          header[7] = this->height;
+          header[8] = 0;
+          header[9] = 0;
+          header[10] = this->number_of_faces;
+          header[11] = this->get_number_of_levels();
+          header[12] = 0;
+
+          fwrite(identifier,1,12,file_handle);
+          fwrite(header,sizeof(uint32_t),13,file_handle);
+
+          for (unsigned int level = 0; level < this->get_number_of_levels(); level++)
+            {
+              uint32_t image_size = this->get_level_size(level);
+              fwrite(&image_size,sizeof(uint32_t),1,file_handle);
+
+              for (unsigned int face = 0; face < this->number_of_faces; face++)
+                {
+                  fwrite(this->get_data_pointer(level,face),1,image_size,file_handle);
+                  fwrite(padding,1,(4 - image_size % 4) % 4,file_handle);
+                }
+            }
+
+          fclose(file_handle);
+          return true;
+        }
+  };
+
+/**
+ * Abstract texture class.
+ */
+  
+class Texture: public Printable, public GPUObject
+  {
+    protected:
+      GLuint to;                     // texture object id
+      unsigned int mipmap_level;     // which level of mipmap is being operated on on CPU
+      bool mipmaps;                  // whether the texture has a mipmap chain
+
+      // parameters of the allocated immutable storage, storage_levels == 0 means none yet
+      unsigned int storage_levels;
+      unsigned int storage_width;
+      unsigned int storage_height;
+      GLuint storage_internal_format;
+
+      /**
+       * Return texture size based on currently set this->mipmap_level value.
+       */
+      
+      unsigned int get_current_mipmap_size(unsigned int base_size)
+        {
+          return glm::max((unsigned int) 1,base_size / int(pow(2,this->mipmap_level)));
         }
       
       unsigned int compute_mipmap_levels(unsigned int width, unsigned int height)
@@ -1709,6 +3654,50 @@ class Texture: public Printable, public GPUObject
           unsigned int maximum = width > height ? width : height;
           return floor(log2(maximum));
         }
+
+      void init_storage(bool mipmaps)
+        {
+          this->mipmaps = mipmaps;
+          this->storage_levels = 0;
+          this->storage_width = 0;
+          this->storage_height = 0;
+          this->storage_internal_format = 0;
+        }
+
+      /**
+       * Makes sure immutable storage (glTexStorage2D) with given parameters
+       * exists for the texture, the texture has to be bound to the target.
+       * Immutable storage can't be respecified, so if the parameters change
+       * (e.g. an image of different size is loaded), the texture object is
+       * replaced with a new one and true is returned, so that the caller can
+       * restore texture parameters.
+       */
+
+      bool allocate_storage(GLenum target, unsigned int levels, GLuint internal_format, unsigned int width, unsigned int height)
+        {
+          if (this->storage_levels == levels && this->storage_internal_format == internal_format &&
+              this->storage_width == width && this->storage_height == height)
+            return false;
+
+          bool recreated = this->storage_levels != 0;
+
+          if (recreated)
+            {
+              glDeleteTextures(1,&(this->to));
+              GLState::forget_texture(this->to);
+              glGenTextures(1,&(this->to));
+              GLState::bind_texture(target,this->to);
+            }
+
+          glTexStorage2D(target,levels,internal_format,width,height);
+
+          this->storage_levels = levels;
+          this->storage_internal_format = internal_format;
+          this->storage_width = width;
+          this->storage_height = height;
+
+          return recreated;
+        }
       
     public:
       virtual void bind(unsigned int unit) = 0;  
@@ -1728,6 +3717,28 @@ class Texture: public Printable, public GPUObject
         {
           return this->to;
         }
+
+      bool has_mipmaps()
+        {
+          return this->mipmaps;
+        }
+
+      /**
+       * Recomputes the mipmap levels from the base level on GPU. Only has
+       * effect on textures created with mipmaps.
+       */
+
+      void generate_mipmaps()
+        {
+          if (this->mipmaps && this->storage_levels > 1)
+            glGenerateTextureMipmap(this->to);
+        }
+
+      virtual ~Texture()
+        {
+          glDeleteTextures(1,&(this->to));
+          GLState::forget_texture(this->to);
+        }
   };
   
 /**
@@ -1741,6 +3752,20 @@ class TextureCubeMap: public Texture
       unsigned int texel_type;
       Image2D *images[6];
       
+      /**
+       * Sets the texture parameters of the bound cube map, also when the
+       * texture object is replaced (see allocate_storage()).
+       */
+      
+      void restore_parameters()
+        {
+          glTexParameteri (GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+          glTexParameteri (GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+          glTexParameteri (GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+          glTexParameteri (GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+          glTexParameteri (GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        }
+      
     public:
       Image2D *image_front;
       Image2D *image_back;
@@ -1754,22 +3779,22 @@ class TextureCubeMap: public Texture
        * 
        * @size width and height resolution in pixels (cube map must
        *   have square size)
+       * @mipmaps whether to allocate the full mipmap chain, its levels are
+       *   not generated automatically (they can be written with
+       *   set_mipmap_level() and update_gpu() or generate_mipmaps())
        */
       
-      TextureCubeMap(unsigned int size, unsigned int texel_type = TEXEL_TYPE_COLOR)
+      TextureCubeMap(unsigned int size, unsigned int texel_type = TEXEL_TYPE_COLOR, bool mipmaps = false)
         {
           this->size = size;
           this->texel_type = texel_type;
+          this->init_storage(mipmaps);
           glGenTextures(1,&(this->to));
           this->mipmap_level = 0;
           
-          glBindTexture(GL_TEXTURE_CUBE_MAP,this->to);
-          glTexParameteri (GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-          glTexParameteri (GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-          glTexParameteri (GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-          glTexParameteri (GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-          glTexParameteri (GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);           
-          glBindTexture(GL_TEXTURE_CUBE_MAP,0);
+          GLState::bind_texture(GL_TEXTURE_CUBE_MAP,this->to);
+          this->restore_parameters();
+          GLState::bind_texture(GL_TEXTURE_CUBE_MAP,0);
 
           this->image_front = new Image2D(size,size,texel_type);
           this->image_back = new Image2D(size,size,texel_type);
@@ -1808,7 +3833,69 @@ class TextureCubeMap: public Texture
  
       virtual unsigned int get_number_of_mipmap_levels()
         {
-          return this->compute_mipmap_levels(this->size,this->size);
+          return this->mipmaps ? this->compute_mipmap_levels(this->size,this->size) : 0;
+        }
+ 
+      unsigned int get_size()
+        {
+          return this->size;
+        }
+ 
+      /**
+       * Returns the size in bytes of one texel as it is stored in the
+       * texture (given by get_internal_format()).
+       */
+ 
+      unsigned int get_texel_size()
+        {
+          return this->texel_type == TEXEL_TYPE_COLOR ? 4 * sizeof(float) : sizeof(float);
+        }
+ 
+      GLuint get_internal_format()
+        {
+          return this->image_front->get_internal_format();
+        }
+ 
+      GLuint get_format()
+        {
+          return this->image_front->get_format();
+        }
+ 
+      GLuint get_type()
+        {
+          return this->image_front->get_type();
+        }
+ 
+      /**
+       * Reads raw texel data of one side and mipmap level directly from GPU,
+       * without going through the CPU side images.
+       *
+       * @param side OpenGL cubemap side constant
+       * @param destination memory of at least get_texel_size() * (size >> level)^2 bytes
+       */
+ 
+      void get_level_data(GLuint side, unsigned int level, void *destination)
+        {
+          GLState::bind_texture(GL_TEXTURE_CUBE_MAP,this->to);
+          glGetTexImage(side,level,this->get_format(),this->get_type(),destination);
+          GLState::bind_texture(GL_TEXTURE_CUBE_MAP,0);
+        }
+ 
+      /**
+       * Uploads raw texel data of one side and mipmap level directly to GPU,
+       * without going through the CPU side images.
+       */
+ 
+      void set_level_data(GLuint side, unsigned int level, const void *data)
+        {
+          unsigned int level_size = glm::max((unsigned int) 1,this->size >> level);
+          GLState::bind_texture(GL_TEXTURE_CUBE_MAP,this->to);
+          
+          if (this->allocate_storage(GL_TEXTURE_CUBE_MAP,this->get_number_of_mipmap_levels() + 1,this->get_internal_format(),this->size,this->size))
+            this->restore_parameters();
+            
+          glTexSubImage2D(side,level,0,0,level_size,level_size,this->get_format(),this->get_type(),data);
+          GLState::bind_texture(GL_TEXTURE_CUBE_MAP,0);
         }
  
       virtual void set_mipmap_level(unsigned int level)
@@ -1866,6 +3953,7 @@ class TextureCubeMap: public Texture
       virtual void update_gpu()
         {
           int i;
+
           Image2D *images[] =
             {this->image_front,
              this->image_back,
@@ -1882,31 +3970,34 @@ class TextureCubeMap: public Texture
              GL_TEXTURE_CUBE_MAP_NEGATIVE_Y,
              GL_TEXTURE_CUBE_MAP_POSITIVE_Y};
           
-          glBindTexture(GL_TEXTURE_CUBE_MAP,this->to);
+          GLState::bind_texture(GL_TEXTURE_CUBE_MAP,this->to);
+          
+          if (this->allocate_storage(GL_TEXTURE_CUBE_MAP,this->get_number_of_mipmap_levels() + 1,this->image_front->get_internal_format(),this->size,this->size))
+            this->restore_parameters();
 
           for (i = 0; i < 6; i++)
             {
-              glTexImage2D(
+              glTexSubImage2D(
                 targets[i],
                 this->mipmap_level,
-                images[i]->get_internal_format(),
+                0,
+                0,
                 this->image_front->get_width(),
                 this->image_front->get_height(),
-                0,
                 images[i]->get_format(),
                 images[i]->get_type(),
                 images[i]->get_data_pointer()
                 );    
             }
                   
-          glBindTexture(GL_TEXTURE_CUBE_MAP,0);
+          GLState::bind_texture(GL_TEXTURE_CUBE_MAP,0);
         }
         
       virtual void load_from_gpu()
         {
           int i;
           
-          glBindTexture(GL_TEXTURE_CUBE_MAP,this->to);
+          GLState::bind_texture(GL_TEXTURE_CUBE_MAP,this->to);
           
           GLuint targets[] =
             {GL_TEXTURE_CUBE_MAP_NEGATIVE_Z,
@@ -1989,24 +4080,7 @@ class TextureCubeMap: public Texture
         
       virtual void bind(unsigned int unit)
         {
-          switch (unit)
-            {
-              case 0: glActiveTexture(GL_TEXTURE0); break;
-              case 1: glActiveTexture(GL_TEXTURE1); break;
-              case 2: glActiveTexture(GL_TEXTURE2); break;
-              case 3: glActiveTexture(GL_TEXTURE3); break;
-              case 4: glActiveTexture(GL_TEXTURE4); break;
-              case 5: glActiveTexture(GL_TEXTURE5); break;
-              case 6: glActiveTexture(GL_TEXTURE6); break;
-              case 7: glActiveTexture(GL_TEXTURE7); break;
-              case 8: glActiveTexture(GL_TEXTURE8); break;
-              case 9: glActiveTexture(GL_TEXTURE9); break;
-              
-              default:
-                break;
-            }
-          
-          glBindTexture(GL_TEXTURE_CUBE_MAP,this->to);
+          GLState::bind_texture_unit(unit,GL_TEXTURE_CUBE_MAP,this->to);
         }
   };
       
@@ -2018,8 +4092,16 @@ class Texture2D: public Texture
   {
     protected:
       Image2D *image_data;
+      CompressedImage *compressed_data;   ///< if not 0, these data are uploaded instead of image_data
       unsigned int base_width;
       unsigned int base_height;
+      vector<pair<GLuint,GLint> > parameters;   ///< set with set_parameter_int, to be restored when the texture object is replaced
+
+      void restore_parameters()
+        {
+          for (unsigned int i = 0; i < this->parameters.size(); i++)
+            glTexParameteri(GL_TEXTURE_2D,this->parameters[i].first,this->parameters[i].second);
+        }
       
     public:
       /**
@@ -2029,21 +4111,29 @@ class Texture2D: public Texture
        * @param height height int pixels
        * @param texel_type texel type for the texture, possible values are
        *        defined in this file (TEXEL_TYPE_COLOR, TEXEL_TYPE_DEPTH, ...)
+       * @param mipmaps whether to allocate a mipmap chain and regenerate it
+       *        with each update_gpu(), render targets should leave this
+       *        off
        */
       
-      Texture2D(unsigned int width, unsigned int height, unsigned int texel_type = TEXEL_TYPE_COLOR)
+      Texture2D(unsigned int width, unsigned int height, unsigned int texel_type = TEXEL_TYPE_COLOR, bool mipmaps = false)
         {
           this->image_data = new Image2D(width,height,texel_type);
+          this->compressed_data = 0;
           glGenTextures(1,&(this->to));
           
           this->mipmap_level = 0;
           this->base_width = width;
           this->base_height = height;
+          this->init_storage(mipmaps);
         }
 
       virtual unsigned int get_number_of_mipmap_levels()
         {
-          return this->compute_mipmap_levels(this->base_width,this->base_height);
+          if (this->compressed_data != 0)
+            return this->compressed_data->get_number_of_levels() - 1;
+
+          return this->mipmaps ? this->compute_mipmap_levels(this->base_width,this->base_height) : 0;
         }
         
       virtual void set_mipmap_level(unsigned int level)
@@ -2055,6 +4145,7 @@ class Texture2D: public Texture
       virtual ~Texture2D()
         {
           delete this->image_data;
+          delete this->compressed_data;
         }
         
       Image2D *get_image_data()
@@ -2107,42 +4198,100 @@ class Texture2D: public Texture
         
       bool load_ppm(string filename)
         {
-          return this->image_data->load_ppm(filename);
+          if (!this->image_data->load_ppm(filename))
+            return false;
+
+          this->mipmap_level = 0;
+          this->base_width = this->image_data->get_width();
+          this->base_height = this->image_data->get_height();
+          return true;
         }
-       
+
       /**
-       * Uploads the texture data to GPU.
+       * Loads block compressed texture data including the mipmap chain
+       * from KTX file. The data will be uploaded with update_gpu() as they
+       * are, without decompression.
        */
-        
+
+      bool load_ktx(string filename)
+        {
+          CompressedImage *image = new CompressedImage();
+
+          if (!image->load_ktx(filename) || image->get_number_of_faces() != 1)
+            {
+              ErrorWriter::write_error("KTX file '" + filename + "' doesn't contain a 2D texture.");
+              delete image;
+              return false;
+            }
+
+          delete this->compressed_data;
+          this->compressed_data = image;
+          this->base_width = image->get_width();
+          this->base_height = image->get_height();
+          return true;
+        }
+       
+      /**
+       * Uploads the texture data to GPU.
+       */
+        
       virtual void update_gpu()
         {
-          glBindTexture(GL_TEXTURE_2D,this->to);
+          GLState::bind_texture(GL_TEXTURE_2D,this->to);
+
+          if (this->compressed_data != 0)
+            {
+              unsigned int levels = this->compressed_data->get_number_of_levels();
+
+              if (this->allocate_storage(GL_TEXTURE_2D,levels,this->compressed_data->get_internal_format(),this->base_width,this->base_height))
+                this->restore_parameters();
+
+              for (unsigned int level = 0; level < levels; level++)
+                glCompressedTexSubImage2D(
+                  GL_TEXTURE_2D,
+                  level,
+                  0,
+                  0,
+                  this->compressed_data->get_level_width(level),
+                  this->compressed_data->get_level_height(level),
+                  this->compressed_data->get_internal_format(),
+                  this->compressed_data->get_level_size(level),
+                  this->compressed_data->get_data_pointer(level));
+
+              GLState::bind_texture(GL_TEXTURE_2D,0);
+              return;
+            }
+
+          if (this->allocate_storage(GL_TEXTURE_2D,this->get_number_of_mipmap_levels() + 1,this->image_data->get_internal_format(),this->base_width,this->base_height))
+            this->restore_parameters();
         
-          glTexImage2D(
+          glTexSubImage2D(
             GL_TEXTURE_2D,
+            this->mipmap_level,
+            0,
             0,
-            this->image_data->get_internal_format(),
             this->image_data->get_width(),
             this->image_data->get_height(),
-            0,
             this->image_data->get_format(),
             this->image_data->get_type(),
             this->image_data->get_data_pointer());
           
-          glGenerateMipmap(GL_TEXTURE_2D);
-          glBindTexture(GL_TEXTURE_2D,0);
+          if (this->mipmaps && this->mipmap_level == 0)
+            glGenerateMipmap(GL_TEXTURE_2D);
+
+          GLState::bind_texture(GL_TEXTURE_2D,0);
         }
         
       virtual void load_from_gpu()
         {
-          glBindTexture(GL_TEXTURE_2D,this->to);    
+          GLState::bind_texture(GL_TEXTURE_2D,this->to);    
           
           if (this->image_data->get_data_type() == TEXEL_TYPE_STENCIL)
             glGetTexImage(GL_TEXTURE_2D,this->mipmap_level,GL_RED_INTEGER,this->image_data->get_type(),this->image_data->get_data_pointer());
           else
             glGetTexImage(GL_TEXTURE_2D,this->mipmap_level,this->image_data->get_format(),this->image_data->get_type(),this->image_data->get_data_pointer());
           
-          glBindTexture(GL_TEXTURE_2D,0);
+          GLState::bind_texture(GL_TEXTURE_2D,0);
         }
         
       /**
@@ -2151,15 +4300,15 @@ class Texture2D: public Texture
         
       void set_parameter_int(unsigned int parameter, unsigned int value)
         {
-          glBindTexture(GL_TEXTURE_2D,this->to);
+          this->parameters.push_back(pair<GLuint,GLint>(parameter,value));
+          GLState::bind_texture(GL_TEXTURE_2D,this->to);
           glTexParameteri(GL_TEXTURE_2D,parameter,value);
-          glBindTexture(GL_TEXTURE_2D,0);
+          GLState::bind_texture(GL_TEXTURE_2D,0);
         }
       
       virtual void bind(unsigned int unit)
         {
-          glActiveTexture(GL_TEXTURE0 + unit);
-          glBindTexture(GL_TEXTURE_2D,this->to);
+          GLState::bind_texture_unit(unit,GL_TEXTURE_2D,this->to);
         }
       
       /**
@@ -2281,20 +4430,52 @@ class FrameBuffer
         
       void activate()
         {
-          glBindFramebuffer(GL_FRAMEBUFFER,this->fbo);
+          GLState::bind_framebuffer(this->fbo);
         }
         
       void deactivate()
         {
-          glBindFramebuffer(GL_FRAMEBUFFER,0);
+          GLState::bind_framebuffer(0);
         }
         
       ~FrameBuffer()
         {
           glDeleteFramebuffers(1,&(this->fbo));
+          GLState::forget_framebuffer(this->fbo);
         } 
   };
   
+#define PROBE_FILE_VERSION 1
+
+/**
+ * Header of a binary probe file, see ReflectionTraceCubeMap::save_probe().
+ */
+
+typedef struct
+  {
+    char magic[4];                  ///< "PROB"
+    uint32_t version;               ///< PROBE_FILE_VERSION
+    uint32_t size;                  ///< cubemap side resolution
+    float position[3];              ///< cubemap world position
+    uint32_t number_of_textures;
+  } probe_file_header;
+
+/**
+ * Describes one texture stored in a binary probe file. The texel data
+ * follow all texture headers, for each texture all levels, for each
+ * level all sides in the order of GL cubemap targets (+X, -X, +Y, -Y,
+ * +Z, -Z).
+ */
+
+typedef struct
+  {
+    uint32_t internal_format;       ///< GL internal format
+    uint32_t format;                ///< GL format of the stored data
+    uint32_t type;                  ///< GL type of the stored data
+    uint32_t texel_size;            ///< bytes per texel
+    uint32_t number_of_levels;      ///< stored mipmap levels
+  } probe_file_texture_header;
+
 /**
  * Represents a cube map that is used for capturing environment.
  */
@@ -2333,7 +4514,9 @@ class ReflectionTraceCubeMap: public GPUObject
        * @param uniform_texture_color_name name of the uniform variable (sampler cube) for color
        * @param uniform_texture_distance_name name of the uniform variable (sampler cube) for distance
        * @param uniform_texture_normal_name name of the uniform variable (sampler cube) for normal
-       * @param uniform_position_name name of the uniform variable (vec3) for cubemap position       
+       * @param uniform_position_name name of the uniform variable (vec3) for cubemap position,
+       *   empty string if the position is passed to the shader some other
+       *   way (e.g. in a UniformBuffer)
        * @param texture_color_sampler number of texture sampler to use for color texture
        * @param texture_normal_sampler number of texture sampler to use for normal texture
        * @param texture_distance_sampler number of texture sampler to use for position texture
@@ -2345,7 +4528,7 @@ class ReflectionTraceCubeMap: public GPUObject
           ReflectionTraceCubeMap::projection_matrix = glm::perspective((float) (M_PI / 2.0), 1.0f, 0.01f, 10000.0f);          
           
           this->texture_color = new TextureCubeMap(size,TEXEL_TYPE_COLOR);
-          this->texture_distance = new TextureCubeMap(size,TEXEL_TYPE_COLOR);
+          this->texture_distance = new TextureCubeMap(size,TEXEL_TYPE_COLOR,true);   // mipmap levels hold the acceleration structure
           this->texture_depth = new TextureCubeMap(size,TEXEL_TYPE_DEPTH);
           this->texture_normal = new TextureCubeMap(size,TEXEL_TYPE_COLOR);
         
@@ -2358,7 +4541,7 @@ class ReflectionTraceCubeMap: public GPUObject
           this->uniform_texture_color = new UniformVariable(uniform_texture_color_name);
           this->uniform_texture_distance = new UniformVariable(uniform_texture_distance_name);
           this->uniform_texture_normal = new UniformVariable(uniform_texture_normal_name);
-          this->uniform_position = new UniformVariable(uniform_position_name);
+          this->uniform_position = uniform_position_name.length() != 0 ? new UniformVariable(uniform_position_name) : 0;
           
           this->texture_color_sampler = texture_color_sampler;
           this->texture_distance_sampler = texture_distance_sampler;
@@ -2376,7 +4559,9 @@ class ReflectionTraceCubeMap: public GPUObject
           result = result && this->uniform_texture_color->retrieve_location(shader);
           result = result && this->uniform_texture_distance->retrieve_location(shader);
           result = result && this->uniform_texture_normal->retrieve_location(shader);
-          result = result && this->uniform_position->retrieve_location(shader);
+          
+          if (this->uniform_position != 0)
+            result = result && this->uniform_position->retrieve_location(shader);
          
           return result;
         }
@@ -2390,7 +4575,9 @@ class ReflectionTraceCubeMap: public GPUObject
           this->uniform_texture_color->update_int((int) this->texture_color_sampler);
           this->uniform_texture_distance->update_int((int) this->texture_distance_sampler);
           this->uniform_texture_normal->update_int((int) this->texture_normal_sampler);
-          this->uniform_position->update_vec3(this->transformation.get_translation());
+          
+          if (this->uniform_position != 0)
+            this->uniform_position->update_vec3(this->transformation.get_translation());
         }
         
       /**
@@ -2445,6 +4632,18 @@ class ReflectionTraceCubeMap: public GPUObject
           return this->texture_normal;
         }
         
+      /**
+       * Gets the define lines with the number of acceleration levels
+       * (ACCELERATION_LEVELS, ACCELERATION_MIPMAP_LEVELS) for the tracing
+       * shader, derived from the cubemap size.
+       */
+        
+      string get_shader_defines()
+        {
+          string levels = to_string(this->texture_distance->get_number_of_mipmap_levels() + 1);
+          return "#define ACCELERATION_LEVELS " + levels + "\n#define ACCELERATION_MIPMAP_LEVELS " + levels + "\n";
+        }
+        
       TextureCubeMap *get_texture_distance()
         {
           return this->texture_distance;
@@ -2457,8 +4656,8 @@ class ReflectionTraceCubeMap: public GPUObject
   
       void set_viewport()
         {
-          glGetIntegerv(GL_VIEWPORT,this->initial_viewport);   // save the old viewport
-          glViewport(0,0,this->size,this->size);
+          GLState::get_viewport(this->initial_viewport);   // save the old viewport
+          GLState::set_viewport(0,0,this->size,this->size);
         }
 
       /**
@@ -2504,8 +4703,6 @@ class ReflectionTraceCubeMap: public GPUObject
           Shader helper_shader("","",helper_shader_cs_text);
           
           helper_shader.use();
-          
-          glGenerateTextureMipmap(this->texture_distance->get_texture_object());   // enable mipmaps
 
           int mip_levels[] = {0,2,5,7,10};
           int widths[] = {256,32,8,1};
@@ -2559,8 +4756,6 @@ class ReflectionTraceCubeMap: public GPUObject
           uniform_cubemap.retrieve_location(&helper_shader);
           uniform_coeffs.retrieve_location(&helper_shader);
           uniform_sample_mip.retrieve_location(&helper_shader);
-
-          glGenerateTextureMipmap(this->get_texture_distance()->get_texture_object());
           
           GLuint sides[] =
             {
@@ -2582,6 +4777,8 @@ class ReflectionTraceCubeMap: public GPUObject
                 
               mip_resolution /= 2;
               mip_level++;
+              
+              ProfileScope level_scope(("pyramid level " + to_string(mip_level)).c_str());
                 
               for (int i = 0; i < 6; i++) // for each side
                 {
@@ -2729,6 +4926,163 @@ class ReflectionTraceCubeMap: public GPUObject
           this->texture_distance->load_from_gpu();
         }
         
+      /**
+       Saves the captured probe into a single binary file: color and normal
+       textures and the distance texture with all levels of its min/max
+       acceleration pyramid, all in their native GL formats (so float
+       distances are kept exactly). The probe can later be restored with
+       load_probe(), skipping both the capture and the pyramid computation.
+       */
+
+      bool save_probe(string filename)
+        {
+          TextureCubeMap *textures[] = {this->texture_color,this->texture_normal,this->texture_distance};
+          unsigned int levels[] = {1,1,this->texture_distance->get_number_of_mipmap_levels() + 1};
+          probe_file_header header;
+          FILE *file_handle;
+          glm::vec3 position = this->transformation.get_translation();
+
+          file_handle = fopen(filename.c_str(),"wb");
+
+          if (!file_handle)
+            {
+              ErrorWriter::write_error("Could not write probe file '" + filename + "'.");
+              return false;
+            }
+
+          memcpy(header.magic,"PROB",4);
+          header.version = PROBE_FILE_VERSION;
+          header.size = this->size;
+          header.position[0] = position.x;
+          header.position[1] = position.y;
+          header.position[2] = position.z;
+          header.number_of_textures = 3;
+
+          fwrite(&header,sizeof(header),1,file_handle);
+
+          for (int i = 0; i < 3; i++)
+            {
+              probe_file_texture_header texture_header;
+
+              texture_header.internal_format = textures[i]->get_internal_format();
+              texture_header.format = textures[i]->get_format();
+              texture_header.type = textures[i]->get_type();
+              texture_header.texel_size = textures[i]->get_texel_size();
+              texture_header.number_of_levels = levels[i];
+
+              fwrite(&texture_header,sizeof(texture_header),1,file_handle);
+            }
+
+          vector<unsigned char> buffer(this->size * this->size * this->texture_color->get_texel_size());
+
+          for (int i = 0; i < 3; i++)
+            for (unsigned int level = 0; level < levels[i]; level++)
+              for (int side = 0; side < 6; side++)
+                {
+                  unsigned int level_size = glm::max((unsigned int) 1,this->size >> level);
+
+                  textures[i]->get_level_data(GL_TEXTURE_CUBE_MAP_POSITIVE_X + side,level,&(buffer[0]));
+                  fwrite(&(buffer[0]),1,level_size * level_size * textures[i]->get_texel_size(),file_handle);
+                }
+
+          fclose(file_handle);
+          return true;
+        }
+
+      /**
+       Loads the probe saved with save_probe(). The file is memory mapped and
+       uploaded to GPU directly from the mapping. The cubemap position is
+       restored from the file as well.
+       */
+
+      bool load_probe(string filename)
+        {
+          string error_string = "Could not load probe file '" + filename + "'";
+          TextureCubeMap *textures[] = {this->texture_color,this->texture_normal,this->texture_distance};
+          struct stat file_info;
+          int file_descriptor;
+
+          file_descriptor = open(filename.c_str(),O_RDONLY);
+
+          if (file_descriptor < 0)
+            {
+              ErrorWriter::write_error(error_string + " (File could not be opened.)");
+              return false;
+            }
+
+          if (fstat(file_descriptor,&file_info) != 0 || file_info.st_size < (off_t) (sizeof(probe_file_header) + 3 * sizeof(probe_file_texture_header)))
+            {
+              ErrorWriter::write_error(error_string + " (File too short.)");
+              close(file_descriptor);
+              return false;
+            }
+
+          size_t file_size = file_info.st_size;
+          unsigned char *file_data = (unsigned char *) mmap(0,file_size,PROT_READ,MAP_PRIVATE,file_descriptor,0);
+          close(file_descriptor);
+
+          if (file_data == MAP_FAILED)
+            {
+              ErrorWriter::write_error(error_string + " (File could not be mapped.)");
+              return false;
+            }
+
+          probe_file_header *header = (probe_file_header *) file_data;
+          probe_file_texture_header *texture_headers = (probe_file_texture_header *) (file_data + sizeof(probe_file_header));
+          bool result = true;
+
+          if (memcmp(header->magic,"PROB",4) != 0 || header->version != PROBE_FILE_VERSION ||
+              header->size != this->size || header->number_of_textures != 3)
+            {
+              ErrorWriter::write_error(error_string + " (Wrong format, version or cubemap size.)");
+              result = false;
+            }
+
+          size_t expected_size = sizeof(probe_file_header) + 3 * sizeof(probe_file_texture_header);
+
+          for (int i = 0; i < 3 && result; i++)
+            {
+              if (texture_headers[i].internal_format != textures[i]->get_internal_format() ||
+                  texture_headers[i].texel_size != textures[i]->get_texel_size() ||
+                  texture_headers[i].number_of_levels == 0)
+                {
+                  ErrorWriter::write_error(error_string + " (Texture formats don't match.)");
+                  result = false;
+                }
+
+              for (unsigned int level = 0; level < texture_headers[i].number_of_levels; level++)
+                {
+                  size_t level_size = glm::max((unsigned int) 1,this->size >> level);
+                  expected_size += 6 * level_size * level_size * texture_headers[i].texel_size;
+                }
+            }
+
+          if (result && expected_size != file_size)
+            {
+              ErrorWriter::write_error(error_string + " (Wrong file size.)");
+              result = false;
+            }
+
+          if (result)
+            {
+              unsigned char *data = file_data + sizeof(probe_file_header) + 3 * sizeof(probe_file_texture_header);
+
+              for (int i = 0; i < 3; i++)
+                for (unsigned int level = 0; level < texture_headers[i].number_of_levels; level++)
+                  for (int side = 0; side < 6; side++)
+                    {
+                      size_t level_size = glm::max((unsigned int) 1,this->size >> level);
+                      textures[i]->set_level_data(GL_TEXTURE_CUBE_MAP_POSITIVE_X + side,level,data);
+                      data += level_size * level_size * texture_headers[i].texel_size;
+                    }
+
+              this->transformation.set_translation(glm::vec3(header->position[0],header->position[1],header->position[2]));
+            }
+
+          munmap(file_data,file_size);
+          return result;
+        }
+
       /**
        Restores the original viewport settings (saved when setViewport
        was called).
@@ -2736,7 +5090,7 @@ class ReflectionTraceCubeMap: public GPUObject
       
       void unset_viewport()
         {
-          glViewport(this->initial_viewport[0],this->initial_viewport[1],this->initial_viewport[2],this->initial_viewport[3]);
+          GLState::set_viewport(this->initial_viewport[0],this->initial_viewport[1],this->initial_viewport[2],this->initial_viewport[3]);
         }
   
       /**
@@ -2791,233 +5145,2257 @@ class ReflectionTraceCubeMap: public GPUObject
 
 glm::mat4 ReflectionTraceCubeMap::projection_matrix; 
   
+#define MESH_FILE_VERSION 5
+#define MESH_FILE_FLIPPED 0x01     ///< flag: the geometry was loaded flipped vertically
+
 /**
- * Represents a 3D geometry consisting of vertices and triangles.
- * Each vertex has a position a normal and texture coordinates
- * (each one being vec3 of float, in that order).
+ * Header of a binary mesh cache file, see Geometry3D::save_mesh(). The
+ * header is followed by the vertices (array of Vertex3D), the triangle
+ * indices (array of uint32), the meshlets (array of geometry_meshlet), the
+ * LODs (array of geometry_lod) and the LOD indices (array of uint32).
  */
-  
-class Geometry3D: public Printable, public GPUObject
+
+typedef struct
+  {
+    char magic[4];                  ///< "MESH"
+    uint32_t version;               ///< MESH_FILE_VERSION
+    uint64_t source_size;           ///< size of the source file in bytes
+    int64_t source_mtime;           ///< modification time of the source file in ns
+    uint32_t flags;
+    uint32_t vertex_size;           ///< sizeof(Vertex3D)
+    uint32_t number_of_vertices;
+    uint32_t number_of_indices;
+    uint32_t number_of_meshlets;
+    uint32_t number_of_lods;
+    uint32_t number_of_lod_indices;
+    float aabb_min[3];
+    float aabb_max[3];
+  } mesh_file_header;
+
+/**
+ * Continuous range of triangles of a geometry that can be processed
+ * (e.g. culled) as a whole.
+ */
+
+typedef struct
+  {
+    uint32_t first_index;           ///< offset into the index buffer
+    uint32_t number_of_indices;
+    float aabb_min[3];
+    float aabb_max[3];
+    float cone_axis[3];             ///< average normal direction of the triangles
+    float cone_cutoff;              ///< sine of the normal cone half angle, > 1 means no cone
+  } geometry_meshlet;
+
+/**
+ * One level of detail of a geometry, a range of the common index buffer.
+ */
+
+typedef struct
+  {
+    uint32_t first_index;           ///< offset into the index buffer
+    uint32_t number_of_indices;
+    float error;                    ///< geometric error in model units, 0 for the full detail
+    uint32_t first_meshlet;         ///< the LOD's meshlets, see Geometry3D::build_meshlets()
+    uint32_t number_of_meshlets;
+  } geometry_lod;
+
+#define VERTEX_WELDER_EMPTY 0xffffffff
+
+/**
+ * Builds a list of unique vertices: vertices that are equal in all
+ * attributes (compared bitwise) are given the same index. Uses an open
+ * addressing hash table that only stores the vertex indices.
+ */
+
+class VertexWelder
   {
     protected:
-      GLuint vbo;
-      GLuint vao;
-      GLuint ibo;
-       
-    public:
-      vector<Vertex3D> vertices;
-      vector<unsigned int> triangles;
-      
-      Geometry3D()
-        {
-          if (!GLSession::is_initialised())
-            ErrorWriter::write_error("Geometry3D object created before GLSession was initialised.");
+      vector<Vertex3D> *vertices;
+      vector<unsigned int> table;       ///< vertex indices, VERTEX_WELDER_EMPTY for free slots
+      unsigned int mask;
 
-          glGenVertexArrays(1,&(this->vao));
-          glBindVertexArray(this->vao);
-          glGenBuffers(1,&(this->vbo));
-          glBindBuffer(GL_ARRAY_BUFFER,this->vbo);
-          glGenBuffers(1,&(this->ibo));
-          glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,this->ibo);
-          glBindBuffer(GL_ARRAY_BUFFER,this->vbo);
-          
-          glEnableVertexAttribArray(0);  // position
-          glVertexAttribPointer(0,3,GL_FLOAT,GL_FALSE,sizeof(Vertex3D),0);
-        
-          glEnableVertexAttribArray(1);  // texture coord
-          glVertexAttribPointer(1,3,GL_FLOAT,GL_FALSE,sizeof(Vertex3D),(const GLvoid*) sizeof(glm::vec3));
-          
-          glEnableVertexAttribArray(2);  // normal
-          glVertexAttribPointer(2,3,GL_FLOAT,GL_TRUE,sizeof(Vertex3D),(const GLvoid*) (sizeof(glm::vec3) * 2));
-          
-          glBindVertexArray(0);
-        };
-      
-      void draw_as_triangles()
-        {     
-          glBindVertexArray(this->vao);
-          glDrawElements(GL_TRIANGLES,this->triangles.size(),GL_UNSIGNED_INT,0);
-          glBindVertexArray(0);
-        };
-        
-      void draw_as_lines()
+      static void get_key(const Vertex3D &vertex, uint32_t key[9])
         {
-          glBindVertexArray(this->vao);
-          glDrawElements(GL_LINE_STRIP,this->triangles.size(),GL_UNSIGNED_INT,0);
-          glBindVertexArray(0);
-        };
-        
-      /**
-       * Flips the vertex order in all triangles.
-       */
-        
-      void flip_triangles()
+          float values[9] =
+            {vertex.position.x,vertex.position.y,vertex.position.z,
+             vertex.texture_coord.x,vertex.texture_coord.y,vertex.texture_coord.z,
+             vertex.normal.x,vertex.normal.y,vertex.normal.z};
+
+          for (int i = 0; i < 9; i++)
+            {
+              values[i] += 0.0f;       // turns -0 into +0
+              memcpy(&key[i],&values[i],sizeof(uint32_t));
+            }
+        }
+
+      static uint32_t hash(const uint32_t key[9])
         {
-          for (unsigned int i = 0; i < this->triangles.size(); i += 3)
+          uint32_t result = 2166136261u;
+
+          for (int i = 0; i < 9; i++)
             {
-              int helper = this->triangles[i];
-              this->triangles[i] = this->triangles[i + 1];
-              this->triangles[i + 1] = helper;
+              result ^= key[i];
+              result *= 16777619u;
+              result ^= result >> 15;
             }
+
+          return result;
         }
-        
+
+      void grow()
+        {
+          vector<unsigned int> old_table;
+          old_table.swap(this->table);
+
+          this->table.assign(old_table.size() * 2,VERTEX_WELDER_EMPTY);
+          this->mask = this->table.size() - 1;
+
+          for (unsigned int i = 0; i < old_table.size(); i++)
+            if (old_table[i] != VERTEX_WELDER_EMPTY)
+              {
+                uint32_t key[9];
+                get_key((*this->vertices)[old_table[i]],key);
+                unsigned int slot = hash(key) & this->mask;
+
+                while (this->table[slot] != VERTEX_WELDER_EMPTY)
+                  slot = (slot + 1) & this->mask;
+
+                this->table[slot] = old_table[i];
+              }
+        }
+
+    public:
       /**
-       * Sends the geometry data to GPU.
+       * @param vertices vector to which the unique vertices will be
+       *   appended, vertices already present in it are not welded
+       * @param expected_vertices expected number of added vertices, used to
+       *   size the table
        */
-        
-      virtual void update_gpu()
+
+      VertexWelder(vector<Vertex3D> *vertices, size_t expected_vertices = 1024)
         {
-          glBindVertexArray(this->vao);
-          glBindBuffer(GL_ARRAY_BUFFER,this->vbo);
-          glBufferData(GL_ARRAY_BUFFER,this->vertices.size() * sizeof(Vertex3D),&(this->vertices[0]),GL_STATIC_DRAW);
-          glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,this->ibo);
-          glBufferData(GL_ELEMENT_ARRAY_BUFFER,this->triangles.size() * sizeof(unsigned int),&this->triangles[0],GL_STATIC_DRAW);
-          glBindVertexArray(0);
-        };
-        
-      vector<Vertex3D> *get_vertices()
+          unsigned int size = 16;
+
+          while (size < expected_vertices * 2)
+            size *= 2;
+
+          this->vertices = vertices;
+          this->table.assign(size,VERTEX_WELDER_EMPTY);
+          this->mask = size - 1;
+        }
+
+      /**
+       * Returns the index of a vertex equal to the given one, adding the
+       * vertex if there is no such vertex yet.
+       */
+
+      unsigned int add(const Vertex3D &vertex)
         {
-          return &(this->vertices);
+          uint32_t key[9], other_key[9];
+          get_key(vertex,key);
+          unsigned int slot = hash(key) & this->mask;
+
+          while (this->table[slot] != VERTEX_WELDER_EMPTY)
+            {
+              get_key((*this->vertices)[this->table[slot]],other_key);
+
+              if (memcmp(key,other_key,sizeof(key)) == 0)
+                return this->table[slot];
+
+              slot = (slot + 1) & this->mask;
+            }
+
+          unsigned int index = this->vertices->size();
+          this->table[slot] = index;
+          this->vertices->push_back(vertex);
+
+          if (this->vertices->size() * 2 > this->table.size())   // keep the load factor under 1/2
+            this->grow();
+
+          return index;
         }
-        
-      vector<unsigned int> *get_triangles()
+  };
+
+/**
+ * Simplifies triangle meshes with half edge collapses ordered by quadric
+ * error (Garland, Heckbert: Surface Simplification Using Quadric Error
+ * Metrics, 1997). Vertices are only ever collapsed into other existing
+ * vertices, so all the simplified index buffers can share the original
+ * vertex buffer.
+ *
+ * Vertices with the same position (split on UV seams or hard edges) are
+ * handled as one: a position can only be collapsed if each of its vertices
+ * has a counterpart in the target position, so seams are kept. Open borders
+ * can only be collapsed along themselves. The quadrics are kept between
+ * calls, so a LOD chain can be built by simplifying the previous LOD.
+ */
+
+#define MESH_SIMPLIFIER_BORDER_WEIGHT 1.0
+
+class MeshSimplifier
+  {
+    protected:
+      vector<glm::vec3> positions;          ///< unique positions
+      vector<unsigned int> position_ids;    ///< vertex -> unique position
+      vector<double> quadrics;              ///< 11 values per position: symmetric 4x4 matrix and the sum of plane weights
+
+      static void add_plane_quadric(double *quadric, glm::dvec3 normal, double distance, double weight)
         {
-          return &(this->triangles);
+          double plane[4] = {normal.x,normal.y,normal.z,distance};
+          int k = 0;
+
+          for (int i = 0; i < 4; i++)
+            for (int j = i; j < 4; j++)
+              {
+                quadric[k] += plane[i] * plane[j] * weight;
+                k++;
+              }
+
+          quadric[10] += weight;
         }
-        
-      void add_vertex(double x, double y, double z, double u=0, double v=0, double w=0, double normal_x=0, double normal_y=0, double normal_z=-1)
+
+      double evaluate_quadric(unsigned int position_id, glm::vec3 point)
         {
-          Vertex3D new_vertex;
-          new_vertex.position = glm::vec3(x,y,z);
-          new_vertex.texture_coord = glm::vec3(u,v,w);
-          new_vertex.normal = glm::vec3(normal_x,normal_y,normal_z);
-          this->vertices.push_back(new_vertex);
+          const double *q = &(this->quadrics[position_id * 11]);
+          double x = point.x, y = point.y, z = point.z;
+
+          return
+            q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x +
+            q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y +
+            q[7] * z * z + 2 * q[8] * z +
+            q[9];
         }
-      void add_triangle(unsigned int i1, unsigned int i2, unsigned int i3)
+
+      glm::vec3 triangle_normal(glm::vec3 a, glm::vec3 b, glm::vec3 c)
         {
-          this->triangles.push_back(i1);
-          this->triangles.push_back(i2);
-          this->triangles.push_back(i3);
+          return glm::cross(b - a,c - a);
         }
-        
-      virtual void print()
+
+    public:
+      MeshSimplifier(const vector<Vertex3D> &vertices, const vector<unsigned int> &triangles)
         {
-          int i;
-          
-          cout << "vertices:" << endl;
-          
-          for (i = 0; i < (int) this->vertices.size(); i++)
-            this->vertices[i].print();
-            
-          cout << "triangles:" << endl;
-          
-          for (i = 0; i < (int) this->triangles.size(); i++)
+          unsigned int i;
+          vector<Vertex3D> unique_positions;
+          VertexWelder welder(&unique_positions,vertices.size());
+
+          this->position_ids.resize(vertices.size());
+
+          for (i = 0; i < vertices.size(); i++)   // weld by position only
             {
-              if (i % 3 == 0)
-                cout << "  ";
-              
-              cout << triangles[i] << " ";
-              
-              if (i % 3 == 2)
-                cout << endl;
+              Vertex3D vertex;
+              vertex.position = vertices[i].position;
+              this->position_ids[i] = welder.add(vertex);
+            }
+
+          for (i = 0; i < unique_positions.size(); i++)
+            this->positions.push_back(unique_positions[i].position);
+
+          this->quadrics.assign(this->positions.size() * 11,0.0);
+
+          for (i = 0; i + 2 < triangles.size(); i += 3)
+            {
+              unsigned int ids[3];
+
+              for (int j = 0; j < 3; j++)
+                ids[j] = this->position_ids[triangles[i + j]];
+
+              glm::dvec3 a = glm::dvec3(this->positions[ids[0]]);
+              glm::dvec3 normal = glm::cross(glm::dvec3(this->positions[ids[1]]) - a,glm::dvec3(this->positions[ids[2]]) - a);
+              double area = glm::length(normal);
+
+              if (area <= 0)
+                continue;
+
+              normal /= area;
+
+              for (int j = 0; j < 3; j++)
+                add_plane_quadric(&(this->quadrics[ids[j] * 11]),normal,-glm::dot(normal,a),1.0);
+            }
+
+          // border edges get planes perpendicular to their triangle, so that
+          // borders don't shrink when they are collapsed along themselves:
+
+          vector<pair<uint64_t,unsigned int> > edges;   // (edge, triangle)
+
+          for (i = 0; i + 2 < triangles.size(); i += 3)
+            for (int j = 0; j < 3; j++)
+              {
+                uint64_t a = this->position_ids[triangles[i + j]];
+                uint64_t b = this->position_ids[triangles[i + (j + 1) % 3]];
+                edges.push_back(pair<uint64_t,unsigned int>(a < b ? (a << 32) | b : (b << 32) | a,i));
+              }
+
+          sort(edges.begin(),edges.end());
+
+          for (i = 0; i < edges.size(); i++)
+            {
+              if ((i > 0 && edges[i - 1].first == edges[i].first) || (i + 1 < edges.size() && edges[i + 1].first == edges[i].first))
+                continue;   // not a border edge
+
+              unsigned int ends[2] = {(unsigned int) (edges[i].first >> 32),(unsigned int) (edges[i].first & 0xffffffff)};
+              unsigned int triangle = edges[i].second;
+              glm::dvec3 a = glm::dvec3(this->positions[this->position_ids[triangles[triangle]]]);
+              glm::dvec3 triangle_normal = glm::cross(
+                glm::dvec3(this->positions[this->position_ids[triangles[triangle + 1]]]) - a,
+                glm::dvec3(this->positions[this->position_ids[triangles[triangle + 2]]]) - a);
+              glm::dvec3 edge_start = glm::dvec3(this->positions[ends[0]]);
+              glm::dvec3 normal = glm::cross(glm::dvec3(this->positions[ends[1]]) - edge_start,triangle_normal);
+              double normal_length = glm::length(normal);
+
+              if (normal_length <= 0)
+                continue;
+
+              normal /= normal_length;
+
+              for (int j = 0; j < 2; j++)
+                add_plane_quadric(&(this->quadrics[ends[j] * 11]),normal,-glm::dot(normal,edge_start),MESH_SIMPLIFIER_BORDER_WEIGHT);
+            }
+        }
+
+      /**
+       * Simplifies given triangles.
+       *
+       * @param triangles triangle indices, will be replaced by the simplified ones
+       * @param target_indices number of indices to reduce the triangles to
+       * @param max_error maximum quadric error of a collapse (squared distance)
+       * @return largest RMS distance of a collapsed position to the planes
+       *   of its original triangles, i.e. an estimate of the geometric error
+       *   in model units
+       */
+
+      float simplify(vector<unsigned int> &triangles, unsigned int target_indices, double max_error=1e30)
+        {
+          unsigned int number_of_positions = this->positions.size();
+          unsigned int number_of_vertices = this->position_ids.size();
+          double result_error = 0;
+          unsigned int i, j;
+
+          vector<unsigned int> vertex_remap(number_of_vertices);
+          bool unlimited_pass = false;
+
+          while (triangles.size() > target_indices)
+            {
+              unsigned int number_of_triangles = triangles.size() / 3;
+
+              // position -> triangle adjacency:
+
+              vector<unsigned int> adjacency_offsets(number_of_positions + 1,0);
+              vector<unsigned int> adjacency(triangles.size());
+
+              for (i = 0; i < triangles.size(); i++)
+                adjacency_offsets[this->position_ids[triangles[i]] + 1]++;
+
+              for (i = 0; i < number_of_positions; i++)
+                adjacency_offsets[i + 1] += adjacency_offsets[i];
+
+              vector<unsigned int> fill(adjacency_offsets.begin(),adjacency_offsets.end() - 1);
+
+              for (i = 0; i < triangles.size(); i++)
+                adjacency[fill[this->position_ids[triangles[i]]]++] = i / 3;
+
+              // edges, each edge (in both directions) is recorded once per triangle:
+
+              vector<pair<uint64_t,unsigned int> > edges;    // (min id << 32 | max id, count)
+              edges.reserve(triangles.size());
+
+              for (i = 0; i < number_of_triangles; i++)
+                for (j = 0; j < 3; j++)
+                  {
+                    uint64_t a = this->position_ids[triangles[i * 3 + j]];
+                    uint64_t b = this->position_ids[triangles[i * 3 + (j + 1) % 3]];
+
+                    if (a != b)
+                      edges.push_back(pair<uint64_t,unsigned int>(a < b ? (a << 32) | b : (b << 32) | a,1));
+                  }
+
+              sort(edges.begin(),edges.end());
+
+              vector<pair<uint64_t,unsigned int> > unique_edges;
+
+              for (i = 0; i < edges.size(); i++)
+                if (unique_edges.size() != 0 && unique_edges.back().first == edges[i].first)
+                  unique_edges.back().second++;
+                else
+                  unique_edges.push_back(edges[i]);
+
+              vector<bool> border(number_of_positions,false);   // on an edge with other than two triangles
+
+              for (i = 0; i < unique_edges.size(); i++)
+                if (unique_edges[i].second != 2)
+                  {
+                    border[unique_edges[i].first >> 32] = true;
+                    border[unique_edges[i].first & 0xffffffff] = true;
+                  }
+
+              // collapse candidates, sorted by error:
+
+              vector<pair<double,uint64_t> > collapses;   // (error, from << 32 | to)
+
+              for (i = 0; i < unique_edges.size(); i++)
+                {
+                  unsigned int ends[2] = {(unsigned int) (unique_edges[i].first >> 32),(unsigned int) (unique_edges[i].first & 0xffffffff)};
+                  bool border_edge = unique_edges[i].second != 2;
+
+                  for (j = 0; j < 2; j++)
+                    {
+                      unsigned int from = ends[j], to = ends[1 - j];
+
+                      if (border[from] && !border_edge)    // borders can only move along themselves
+                        continue;
+
+                      double error = this->evaluate_quadric(from,this->positions[to]) + this->evaluate_quadric(to,this->positions[to]);
+
+                      if (error <= max_error)
+                        collapses.push_back(pair<double,uint64_t>(error,(((uint64_t) from) << 32) | to));
+                    }
+                }
+
+              sort(collapses.begin(),collapses.end());
+
+              // perform independent collapses (no two in the same neighbourhood):
+
+              vector<bool> touched(number_of_positions,false);
+              vector<unsigned int> wedge_from, wedge_to;
+              unsigned int triangles_to_remove = (triangles.size() - target_indices) / 3 + 1;
+              unsigned int removed = 0;
+              bool collapsed = false;
+
+              if (collapses.size() == 0)
+                break;
+
+              // a collapse removes about two triangles, don't go much over the
+              // error of the collapse that would reach the goal in this pass,
+              // cheaper collapses may become available in the next pass:
+              double pass_error_limit = unlimited_pass ? collapses.back().first :
+                collapses[glm::min((size_t) triangles_to_remove / 2,collapses.size() - 1)].first * 1.5;
+
+              for (i = 0; i < number_of_vertices; i++)
+                vertex_remap[i] = i;
+
+              for (i = 0; i < collapses.size() && removed < triangles_to_remove; i++)
+                {
+                  unsigned int from = collapses[i].second >> 32;
+                  unsigned int to = collapses[i].second & 0xffffffff;
+
+                  if (collapses[i].first > pass_error_limit)
+                    break;
+
+                  if (touched[from] || touched[to])
+                    continue;
+
+                  bool valid = true;
+                  unsigned int removed_here = 0;
+
+                  wedge_from.clear();
+                  wedge_to.clear();
+
+                  for (j = adjacency_offsets[from]; j < adjacency_offsets[from + 1] && valid; j++)  // map vertices of the collapsed position
+                    {
+                      unsigned int *triangle = &(triangles[adjacency[j] * 3]);
+                      int corner_from = -1, corner_to = -1;
+
+                      for (int k = 0; k < 3; k++)
+                        if (this->position_ids[triangle[k]] == from)
+                          corner_from = k;
+                        else if (this->position_ids[triangle[k]] == to)
+                          corner_to = k;
+
+                      if (corner_to < 0)
+                        continue;
+
+                      removed_here++;
+
+                      unsigned int k;
+
+                      for (k = 0; k < wedge_from.size(); k++)
+                        if (wedge_from[k] == triangle[corner_from])
+                          break;
+
+                      if (k == wedge_from.size())
+                        {
+                          wedge_from.push_back(triangle[corner_from]);
+                          wedge_to.push_back(triangle[corner_to]);
+                        }
+                      else if (wedge_to[k] != triangle[corner_to])
+                        valid = false;     // ambiguous attributes
+                    }
+
+                  for (j = adjacency_offsets[from]; j < adjacency_offsets[from + 1] && valid; j++)  // check the remaining triangles
+                    {
+                      unsigned int *triangle = &(triangles[adjacency[j] * 3]);
+                      glm::vec3 corners[3], moved[3];
+                      bool contains_to = false;
+
+                      for (int k = 0; k < 3; k++)
+                        {
+                          unsigned int id = this->position_ids[triangle[k]];
+                          contains_to = contains_to || id == to;
+                          corners[k] = this->positions[id];
+                          moved[k] = id == from ? this->positions[to] : corners[k];
+
+                          if (id == from && find(wedge_from.begin(),wedge_from.end(),triangle[k]) == wedge_from.end())
+                            valid = false;   // vertex without a counterpart (a seam would be torn)
+                        }
+
+                      if (contains_to || !valid)
+                        continue;
+
+                      if (glm::dot(this->triangle_normal(corners[0],corners[1],corners[2]),this->triangle_normal(moved[0],moved[1],moved[2])) <= 0)
+                        valid = false;   // triangle would flip
+                    }
+
+                  if (!valid || removed_here == 0)
+                    continue;
+
+                  for (j = 0; j < wedge_from.size(); j++)
+                    vertex_remap[wedge_from[j]] = wedge_to[j];
+
+                  double weight = this->quadrics[from * 11 + 10] + this->quadrics[to * 11 + 10];
+
+                  if (weight > 0)    // the error is reported as RMS distance to the planes
+                    result_error = glm::max(result_error,collapses[i].first / weight);
+
+                  for (j = 0; j < 11; j++)
+                    this->quadrics[to * 11 + j] += this->quadrics[from * 11 + j];
+
+                  for (j = adjacency_offsets[from]; j < adjacency_offsets[from + 1]; j++)  // lock the neighbourhood
+                    for (int k = 0; k < 3; k++)
+                      touched[this->position_ids[triangles[adjacency[j] * 3 + k]]] = true;
+
+                  removed += removed_here;
+                  collapsed = true;
+                }
+
+              if (!collapsed)
+                {
+                  if (unlimited_pass)
+                    break;
+
+                  unlimited_pass = true;    // all the cheap collapses were invalid, try the rest
+                  continue;
+                }
+
+              unlimited_pass = false;
+
+              // apply the collapses and remove degenerate triangles:
+
+              unsigned int write = 0;
+
+              for (i = 0; i < number_of_triangles; i++)
+                {
+                  unsigned int a = vertex_remap[triangles[i * 3]];
+                  unsigned int b = vertex_remap[triangles[i * 3 + 1]];
+                  unsigned int c = vertex_remap[triangles[i * 3 + 2]];
+
+                  if (this->position_ids[a] == this->position_ids[b] ||
+                      this->position_ids[b] == this->position_ids[c] ||
+                      this->position_ids[a] == this->position_ids[c])
+                    continue;
+
+                  triangles[write] = a;
+                  triangles[write + 1] = b;
+                  triangles[write + 2] = c;
+                  write += 3;
+                }
+
+              triangles.resize(write);
             }
+
+          return sqrt(glm::max(result_error,0.0));
         }
   };
 
-Geometry3D make_triangle(float side_length)
-  {
-    Geometry3D result;
-    float helper1, helper2, helper3;
-    
-    helper1 = (side_length / 2.0) / sin(M_PI / 3.0);
-    helper2 = side_length * sin(M_PI / 6.0);
-    helper3 = helper1 - side_length * cos(M_PI / 6.0);
-    
-    result.add_vertex(0.0,helper1,0.0,      0.0,0.0,0.0,  0.0,0.0,1.0); 
-    result.add_vertex(-helper2,helper3,0.0,  0.0,0.0,0.0,  0.0,0.0,1.0); 
-    result.add_vertex(helper2,helper3,0.0,  0.0,0.0,0.0,  0.0,0.0,1.0); 
-  
-    result.add_triangle(0,1,2);
-    
-    return result;
-  }
-  
-Geometry3D make_quad(float width, float height, float shift_z)
-  {
-    Geometry3D result;
-    
-    float half_width = width / 2.0;
-    float half_height = height / 2.0;
-    
-    result.add_vertex(-half_width,-half_height,shift_z,0.0,0.0,0.0,0.0,1.0,0.0); 
-    result.add_vertex(half_width,-half_height,shift_z,1.0,0.0,0.0,0.0,1.0,0.0);   
-    result.add_vertex(-half_width,half_height,shift_z,0.0,1.0,0.0,0.0,1.0,0.0);  
-    result.add_vertex(half_width,half_height,shift_z,1.0,1.0,0.0,0.0,1.0,0.0);    
-  
-    result.add_triangle(1,0,2);
-    result.add_triangle(1,2,3); 
-    
-    return result;
-  }
+// vertex formats for Geometry3D::set_vertex_format(), UV and normal flags are mutually exclusive:
 
-Geometry3D make_box(float width, float height, float depth)
+#define GEOMETRY_DYNAMIC_SECTIONS 3     ///< ring sections of dynamic geometry, frames the CPU can be ahead
+#define GEOMETRY_INSTANCE_MATRIX_LOCATION 4   ///< mat4 instance attribute, takes locations 4 to 7
+#define GEOMETRY_INSTANCE_FLAGS_LOCATION 8    ///< uint instance attribute
+
+/**
+ * Per-instance data of Geometry3D::draw_instanced() as stored in the
+ * instance vertex buffer.
+ */
+
+typedef struct
   {
-    Geometry3D result;
-    
-    float half_width = width / 2.0;
-    float half_height = height / 2.0;
-    float half_depth = depth / 2.0;
-    
-    result.add_vertex(-half_width,-half_height,-half_depth,0.25,0.25,0.0,-1.0,-1.0,-1.0); // 0
-    result.add_vertex(half_width,-half_height,-half_depth,0.75,0.25,0.0,1.0,-1.0,-1.0);   // 1
-    result.add_vertex(-half_width,half_height,-half_depth,0.25,0.75,0.0,-1.0,1.0,-1.0);   // 2
-    result.add_vertex(half_width,half_height,-half_depth,0.75,0.75,0.0,1.0,1.0,-1.0);     // 3
+    float model_matrix[16];         ///< transposed, like the uniform matrices
+    uint32_t flags;                 ///< user flags
+  } geometry_instance;
 
-    result.add_vertex(-half_width,-half_height,half_depth,0.0,0.0,0.0,-1.0,-1.0,1.0);     // 4
-    result.add_vertex(half_width,-half_height,half_depth,1.0,0.0,0.0,1.0,-1.0,1.0);       // 5
-    result.add_vertex(-half_width,half_height,half_depth,0.0,1.0,0.0,-1.0,1.0,1.0);       // 6
-    result.add_vertex(half_width,half_height,half_depth,1.0,1.0,0.0,1.0,1.0,1.0);         // 7
-    
-    result.add_triangle(1,0,2); // front
-    result.add_triangle(1,2,3); 
-    
-    result.add_triangle(4,5,6); // back
-    result.add_triangle(6,5,7);
-    
-    result.add_triangle(2,0,4); // left
-    result.add_triangle(2,4,6);
-    
-    result.add_triangle(1,3,5); // right
-    result.add_triangle(5,3,7);
-    
-    result.add_triangle(3,2,6); // top
-    result.add_triangle(7,3,6);
-    
-    result.add_triangle(0,1,4); // bottom
-    result.add_triangle(4,1,5);
-    
-    return result;
-  }
+#define VERTEX_FORMAT_FLOAT              0x00   ///< 3 x float for each attribute (Vertex3D as is)
+#define VERTEX_FORMAT_POSITION_UNORM16   0x01   ///< positions quantized in the AABB, see Geometry3D::get_dequantization_matrix()
+#define VERTEX_FORMAT_UV_HALF            0x02   ///< 2 x half float texture coordinates
+#define VERTEX_FORMAT_UV_UNORM16         0x04   ///< 2 x unorm16 texture coordinates, clamped to [0,1]
+#define VERTEX_FORMAT_NORMAL_1010102     0x08   ///< GL_INT_2_10_10_10_REV normals
+#define VERTEX_FORMAT_NORMAL_OCTAHEDRAL  0x10   ///< 2 x snorm16 octahedral normals, decode with decode_octahedral() from GLSL_OCTAHEDRAL_DECODE
+#define VERTEX_FORMAT_COMPACT (VERTEX_FORMAT_POSITION_UNORM16 | VERTEX_FORMAT_UV_HALF | VERTEX_FORMAT_NORMAL_1010102)
 
 /**
- * Makes a box with separate sides and sharp edges.
+ * GLSL function to be included in shaders that use VERTEX_FORMAT_NORMAL_OCTAHEDRAL,
+ * the normal attribute then has to be declared as vec2.
+ */
+
+#define GLSL_OCTAHEDRAL_DECODE \
+  "vec3 decode_octahedral(vec2 e) {\n" \
+  "  vec3 n = vec3(e,1.0 - abs(e.x) - abs(e.y));\n" \
+  "  if (n.z < 0.0) n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0,n.y >= 0.0 ? 1.0 : -1.0);\n" \
+  "  return normalize(n);\n" \
+  "}\n"
+
+/**
+ * Represents a 3D geometry consisting of vertices and triangles.
+ * Each vertex has a position a normal and texture coordinates
+ * (each one being vec3 of float, in that order).
  */
   
-Geometry3D make_box_sharp(float width, float height, float depth)
+class Geometry3D: public Printable, public GPUObject
   {
-    Geometry3D result;
-    
-    float half_width = width / 2.0;
-    float half_height = height / 2.0;
-    float half_depth = depth / 2.0;
-    
-    // front:
-    result.add_vertex(-half_width,-half_height,half_depth,0.501,0.665,0.0,0.0,0.0,1.0);  // 0
-    result.add_vertex(half_width,-half_height,half_depth,0.999,0.665,0.0,0.0,0.0,1.0);   // 1
-    result.add_vertex(-half_width,half_height,half_depth,0.501,0.334,0.0,0.0,0.0,1.0);   // 2
-    result.add_vertex(half_width,half_height,half_depth,0.999,0.334,0.0,0.0,0.0,1.0);    // 3
-
-    result.add_triangle(1,2,0);
+    protected:
+      GLuint vbo;
+      GLuint vao;
+      GLuint ibo;
+      glm::vec3 aabb_min;
+      glm::vec3 aabb_max;
+      unsigned int vertex_format;       ///< VERTEX_FORMAT_* flags used on GPU
+      unsigned int vertex_size;         ///< size of one vertex on GPU in bytes
+      GLenum index_type;                ///< GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+      glm::mat4 dequantization_matrix;
+      vector<GLsizei> draw_counts;      ///< multi-draw buffers reused by draw_culled()
+      vector<const GLvoid *> draw_offsets;
+      vector<GLint> draw_base_vertices;
+      bool dynamic;                     ///< vertices streamed through a ring, see set_dynamic()
+      unsigned char *dynamic_data;      ///< persistently mapped vertex buffer with all the sections
+      unsigned int dynamic_capacity;    ///< vertices in one section
+      unsigned int dynamic_section;     ///< section with the latest vertices
+      GLsync dynamic_fences[GEOMETRY_DYNAMIC_SECTIONS];   ///< signalled when GPU is done with the section
+      GLuint instance_vbo;              ///< 0 until set_instances() is called
+      unsigned int instance_capacity;
+      vector<geometry_instance> instances;
+
+      /**
+       * Returns the base vertex of the current vertex data (i.e. the ring
+       * section in dynamic mode).
+       */
+
+      GLint get_base_vertex()
+        {
+          return this->dynamic ? this->dynamic_section * this->dynamic_capacity : 0;
+        }
+
+      /**
+       * Recursively splits given range of triangles (indices into
+       * centroids) at the median of the longest axis until the parts have at
+       * most max_triangles triangles, the parts are left in order.
+       */
+
+      static void split_triangles(vector<unsigned int>::iterator begin, vector<unsigned int>::iterator end, vector<glm::vec3> &centroids, unsigned int max_triangles)
+        {
+          if ((unsigned int) (end - begin) <= max_triangles)
+            return;
+
+          glm::vec3 centroid_min = centroids[*begin];
+          glm::vec3 centroid_max = centroid_min;
+
+          for (vector<unsigned int>::iterator it = begin; it != end; it++)
+            {
+              centroid_min = glm::min(centroid_min,centroids[*it]);
+              centroid_max = glm::max(centroid_max,centroids[*it]);
+            }
+
+          glm::vec3 extent = centroid_max - centroid_min;
+          int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+
+          // split at a multiple of max_triangles so that the parts are full:
+
+          unsigned int half = ((end - begin) / max_triangles + 1) / 2 * max_triangles;
+          vector<unsigned int>::iterator middle = begin + half;
+
+          nth_element(begin,middle,end,[&centroids,axis](unsigned int a, unsigned int b) { return centroids[a][axis] < centroids[b][axis]; });
+
+          split_triangles(begin,middle,centroids,max_triangles);
+          split_triangles(middle,end,centroids,max_triangles);
+        }
+
+      static uint32_t pack_normal_1010102(glm::vec3 normal)
+        {
+          uint32_t result = 0;
+
+          for (int i = 0; i < 3; i++)
+            {
+              int value = floor(glm::clamp(normal[i],-1.0f,1.0f) * 511.0f + 0.5f);
+              result |= (((uint32_t) value) & 0x3ff) << (10 * i);
+            }
+
+          return result;
+        }
+
+      static uint32_t pack_normal_octahedral(glm::vec3 normal)
+        {
+          float sum = fabs(normal.x) + fabs(normal.y) + fabs(normal.z);
+          glm::vec2 result = sum > 0 ? glm::vec2(normal.x / sum,normal.y / sum) : glm::vec2(0,0);
+
+          if (normal.z < 0)
+            result = glm::vec2(
+              (1.0f - fabs(result.y)) * (result.x >= 0 ? 1.0f : -1.0f),
+              (1.0f - fabs(result.x)) * (result.y >= 0 ? 1.0f : -1.0f));
+
+          return glm::packSnorm2x16(result);
+        }
+
+      static uint16_t pack_unorm16(float value)
+        {
+          return floor(glm::clamp(value,0.0f,1.0f) * 65535.0f + 0.5f);
+        }
+
+      /**
+       * Computes the attribute offsets and the vertex size for the current
+       * vertex format.
+       */
+
+      void compute_vertex_layout(GLuint offsets[3])
+        {
+          if (this->vertex_format == VERTEX_FORMAT_FLOAT)
+            {
+              offsets[0] = 0;
+              offsets[1] = sizeof(glm::vec3);
+              offsets[2] = sizeof(glm::vec3) * 2;
+              this->vertex_size = sizeof(Vertex3D);
+              return;
+            }
+
+          offsets[0] = 0;
+          offsets[1] = (this->vertex_format & VERTEX_FORMAT_POSITION_UNORM16) ? 4 * sizeof(uint16_t) : 3 * sizeof(float);
+          offsets[2] = offsets[1] + ((this->vertex_format & (VERTEX_FORMAT_UV_HALF | VERTEX_FORMAT_UV_UNORM16)) ? 4 : 2 * sizeof(float));
+          this->vertex_size = offsets[2] + ((this->vertex_format & (VERTEX_FORMAT_NORMAL_1010102 | VERTEX_FORMAT_NORMAL_OCTAHEDRAL)) ? 4 : 3 * sizeof(float));
+        }
+
+      /**
+       * Writes the vertices in the current vertex format to given memory
+       * (of vertices.size() * vertex size bytes).
+       */
+
+      void pack_vertices(unsigned char *buffer)
+        {
+          GLuint offsets[3];
+          unsigned int i;
+
+          this->compute_vertex_layout(offsets);
+
+          if (this->vertex_format == VERTEX_FORMAT_FLOAT)
+            {
+              memcpy(buffer,this->vertices.data(),this->vertices.size() * sizeof(Vertex3D));
+              return;
+            }
+
+          glm::vec3 extent = this->aabb_max - this->aabb_min;
+          float scale = glm::max(extent.x,glm::max(extent.y,extent.z));
+
+          if (scale <= 0)
+            scale = 1;
+
+          // uniform scale, so that normals transformed with the model matrix stay correct
+          this->dequantization_matrix = glm::translate(glm::mat4(1.0f),this->aabb_min) * glm::scale(glm::mat4(1.0f),glm::vec3(scale,scale,scale));
+
+          for (i = 0; i < this->vertices.size(); i++)
+            {
+              Vertex3D *vertex = &(this->vertices[i]);
+              unsigned char *destination = buffer + i * this->vertex_size;
+
+              if (this->vertex_format & VERTEX_FORMAT_POSITION_UNORM16)
+                {
+                  uint16_t position[4];
+
+                  for (int j = 0; j < 3; j++)
+                    position[j] = pack_unorm16((vertex->position[j] - this->aabb_min[j]) / scale);
+
+                  position[3] = 0;
+                  memcpy(destination,position,sizeof(position));
+                }
+              else
+                memcpy(destination,&(vertex->position),3 * sizeof(float));
+
+              if (this->vertex_format & VERTEX_FORMAT_UV_HALF)
+                {
+                  uint32_t uv = glm::packHalf2x16(glm::vec2(vertex->texture_coord.x,vertex->texture_coord.y));
+                  memcpy(destination + offsets[1],&uv,4);
+                }
+              else if (this->vertex_format & VERTEX_FORMAT_UV_UNORM16)
+                {
+                  uint16_t uv[2] = {pack_unorm16(vertex->texture_coord.x),pack_unorm16(vertex->texture_coord.y)};
+                  memcpy(destination + offsets[1],uv,4);
+                }
+              else
+                memcpy(destination + offsets[1],&(vertex->texture_coord),2 * sizeof(float));
+
+              if (this->vertex_format & (VERTEX_FORMAT_NORMAL_1010102 | VERTEX_FORMAT_NORMAL_OCTAHEDRAL))
+                {
+                  uint32_t normal = (this->vertex_format & VERTEX_FORMAT_NORMAL_1010102) ?
+                    pack_normal_1010102(vertex->normal) : pack_normal_octahedral(vertex->normal);
+                  memcpy(destination + offsets[2],&normal,4);
+                }
+              else
+                memcpy(destination + offsets[2],&(vertex->normal),3 * sizeof(float));
+            }
+        }
+
+      /**
+       * Sets the vertex attribute pointers of the bound VAO and VBO for the
+       * current vertex format.
+       */
+
+      void set_attribute_pointers()
+        {
+          GLuint offsets[3];
+
+          this->compute_vertex_layout(offsets);
+
+          if (this->vertex_format == VERTEX_FORMAT_FLOAT)
+            {
+              glVertexAttribPointer(0,3,GL_FLOAT,GL_FALSE,sizeof(Vertex3D),0);
+              glVertexAttribPointer(1,3,GL_FLOAT,GL_FALSE,sizeof(Vertex3D),(const GLvoid*) (size_t) offsets[1]);
+              glVertexAttribPointer(2,3,GL_FLOAT,GL_TRUE,sizeof(Vertex3D),(const GLvoid*) (size_t) offsets[2]);
+              return;
+            }
+
+          if (this->vertex_format & VERTEX_FORMAT_POSITION_UNORM16)
+            glVertexAttribPointer(0,3,GL_UNSIGNED_SHORT,GL_TRUE,this->vertex_size,0);
+          else
+            glVertexAttribPointer(0,3,GL_FLOAT,GL_FALSE,this->vertex_size,0);
+
+          if (this->vertex_format & VERTEX_FORMAT_UV_HALF)
+            glVertexAttribPointer(1,2,GL_HALF_FLOAT,GL_FALSE,this->vertex_size,(const GLvoid*) (size_t) offsets[1]);
+          else if (this->vertex_format & VERTEX_FORMAT_UV_UNORM16)
+            glVertexAttribPointer(1,2,GL_UNSIGNED_SHORT,GL_TRUE,this->vertex_size,(const GLvoid*) (size_t) offsets[1]);
+          else
+            glVertexAttribPointer(1,2,GL_FLOAT,GL_FALSE,this->vertex_size,(const GLvoid*) (size_t) offsets[1]);
+
+          if (this->vertex_format & VERTEX_FORMAT_NORMAL_1010102)
+            glVertexAttribPointer(2,4,GL_INT_2_10_10_10_REV,GL_TRUE,this->vertex_size,(const GLvoid*) (size_t) offsets[2]);
+          else if (this->vertex_format & VERTEX_FORMAT_NORMAL_OCTAHEDRAL)
+            glVertexAttribPointer(2,2,GL_SHORT,GL_TRUE,this->vertex_size,(const GLvoid*) (size_t) offsets[2]);
+          else
+            glVertexAttribPointer(2,3,GL_FLOAT,GL_TRUE,this->vertex_size,(const GLvoid*) (size_t) offsets[2]);
+        }
+       
+    public:
+      vector<Vertex3D> vertices;
+      vector<unsigned int> triangles;
+      vector<geometry_meshlet> meshlets;
+      vector<geometry_lod> lods;            ///< LOD 0 is the full geometry (triangles), if empty there are no LODs
+      vector<unsigned int> lod_triangles;   ///< indices of LODs 1 and higher, stored after the triangles on GPU
+      
+      Geometry3D()
+        {
+          if (!GLSession::is_initialised())
+            ErrorWriter::write_error("Geometry3D object created before GLSession was initialised.");
+
+          this->aabb_min = glm::vec3(0,0,0);
+          this->aabb_max = glm::vec3(0,0,0);
+          this->vertex_format = VERTEX_FORMAT_FLOAT;
+          this->vertex_size = sizeof(Vertex3D);
+          this->index_type = GL_UNSIGNED_INT;
+          this->dequantization_matrix = glm::mat4(1.0f);
+          this->dynamic = false;
+          this->dynamic_data = 0;
+          this->dynamic_capacity = 0;
+          this->dynamic_section = 0;
+
+          for (unsigned int i = 0; i < GEOMETRY_DYNAMIC_SECTIONS; i++)
+            this->dynamic_fences[i] = 0;
+
+          this->instance_vbo = 0;
+          this->instance_capacity = 0;
+
+          glGenVertexArrays(1,&(this->vao));
+          GLState::bind_vertex_array(this->vao);
+          glGenBuffers(1,&(this->vbo));
+          glBindBuffer(GL_ARRAY_BUFFER,this->vbo);
+          glGenBuffers(1,&(this->ibo));
+          glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,this->ibo);
+          glBindBuffer(GL_ARRAY_BUFFER,this->vbo);
+          
+          glEnableVertexAttribArray(0);  // position
+          glVertexAttribPointer(0,3,GL_FLOAT,GL_FALSE,sizeof(Vertex3D),0);
+        
+          glEnableVertexAttribArray(1);  // texture coord
+          glVertexAttribPointer(1,3,GL_FLOAT,GL_FALSE,sizeof(Vertex3D),(const GLvoid*) sizeof(glm::vec3));
+          
+          glEnableVertexAttribArray(2);  // normal
+          glVertexAttribPointer(2,3,GL_FLOAT,GL_TRUE,sizeof(Vertex3D),(const GLvoid*) (sizeof(glm::vec3) * 2));
+          
+          GLState::bind_vertex_array(0);
+        };
+      
+      void draw_as_triangles()
+        {     
+          GLState::bind_vertex_array(this->vao);
+          glDrawElementsBaseVertex(GL_TRIANGLES,this->triangles.size(),this->index_type,0,this->get_base_vertex());
+        };
+        
+      void draw_as_lines()
+        {
+          GLState::bind_vertex_array(this->vao);
+          glDrawElementsBaseVertex(GL_LINE_STRIP,this->triangles.size(),this->index_type,0,this->get_base_vertex());
+        };
+        
+      /**
+       * Sets the instances drawn by draw_instanced(). The instance data are
+       * given to the vertex shader as a mat4 attribute at
+       * GEOMETRY_INSTANCE_MATRIX_LOCATION (locations 4 to 7, transposed like
+       * the uniform matrices, i.e. use vec * matrix) and an uint attribute
+       * at GEOMETRY_INSTANCE_FLAGS_LOCATION. The data are only uploaded if
+       * they change.
+       *
+       * @param model_matrices model matrix of each instance
+       * @param flags if not 0, user flags of each instance, otherwise 0s
+       */
+
+      void set_instances(const vector<glm::mat4> &model_matrices, const vector<unsigned int> *flags=0)
+        {
+          vector<geometry_instance> new_instances(model_matrices.size());
+
+          for (unsigned int i = 0; i < model_matrices.size(); i++)
+            {
+              glm::mat4 matrix = glm::transpose(model_matrices[i]);
+              memcpy(new_instances[i].model_matrix,glm::value_ptr(matrix),sizeof(new_instances[i].model_matrix));
+              new_instances[i].flags = flags != 0 ? (*flags)[i] : 0;
+            }
+
+          if (this->instance_vbo != 0 && new_instances.size() == this->instances.size() &&
+            memcmp(new_instances.data(),this->instances.data(),new_instances.size() * sizeof(geometry_instance)) == 0)
+            return;
+
+          this->instances.swap(new_instances);
+
+          GLState::bind_vertex_array(this->vao);
+
+          if (this->instance_vbo == 0)
+            {
+              glGenBuffers(1,&(this->instance_vbo));
+              glBindBuffer(GL_ARRAY_BUFFER,this->instance_vbo);
+
+              for (int i = 0; i < 4; i++)
+                {
+                  glEnableVertexAttribArray(GEOMETRY_INSTANCE_MATRIX_LOCATION + i);
+                  glVertexAttribPointer(GEOMETRY_INSTANCE_MATRIX_LOCATION + i,4,GL_FLOAT,GL_FALSE,sizeof(geometry_instance),(const GLvoid *) (i * 4 * sizeof(float)));
+                  glVertexAttribDivisor(GEOMETRY_INSTANCE_MATRIX_LOCATION + i,1);
+                }
+
+              glEnableVertexAttribArray(GEOMETRY_INSTANCE_FLAGS_LOCATION);
+              glVertexAttribIPointer(GEOMETRY_INSTANCE_FLAGS_LOCATION,1,GL_UNSIGNED_INT,sizeof(geometry_instance),(const GLvoid *) (16 * sizeof(float)));
+              glVertexAttribDivisor(GEOMETRY_INSTANCE_FLAGS_LOCATION,1);
+            }
+          else
+            glBindBuffer(GL_ARRAY_BUFFER,this->instance_vbo);
+
+          if (this->instances.size() > this->instance_capacity)
+            {
+              this->instance_capacity = this->instances.size();
+              glBufferData(GL_ARRAY_BUFFER,this->instance_capacity * sizeof(geometry_instance),this->instances.data(),GL_DYNAMIC_DRAW);
+            }
+          else
+            glBufferSubData(GL_ARRAY_BUFFER,0,this->instances.size() * sizeof(geometry_instance),this->instances.data());
+
+          GLState::bind_vertex_array(0);
+        }
+
+      unsigned int get_number_of_instances()
+        {
+          return this->instances.size();
+        }
+
+      /**
+       * Draws all the instances set with set_instances() with one call.
+       *
+       * @param lod LOD to draw (see build_lods())
+       */
+
+      void draw_instanced(unsigned int lod=0)
+        {
+          if (this->instances.size() == 0)
+            return;
+
+          unsigned int index_size = this->index_type == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(unsigned int);
+          unsigned int first_index = 0;
+          unsigned int number_of_indices = this->triangles.size();
+
+          if (lod != 0 && lod < this->lods.size())
+            {
+              first_index = this->lods[lod].first_index;
+              number_of_indices = this->lods[lod].number_of_indices;
+            }
+
+          GLState::bind_vertex_array(this->vao);
+          glDrawElementsInstancedBaseVertex(GL_TRIANGLES,number_of_indices,this->index_type,(const GLvoid *) (size_t) (first_index * index_size),this->instances.size(),this->get_base_vertex());
+        }
+
+      /**
+       * Flips the vertex order in all triangles (including the LODs and the
+       * meshlet normal cones).
+       */
+        
+      void flip_triangles()
+        {
+          for (unsigned int i = 0; i < this->triangles.size(); i += 3)
+            {
+              int helper = this->triangles[i];
+              this->triangles[i] = this->triangles[i + 1];
+              this->triangles[i + 1] = helper;
+            }
+
+          for (unsigned int i = 0; i < this->lod_triangles.size(); i += 3)
+            {
+              int helper = this->lod_triangles[i];
+              this->lod_triangles[i] = this->lod_triangles[i + 1];
+              this->lod_triangles[i + 1] = helper;
+            }
+
+          for (unsigned int i = 0; i < this->meshlets.size(); i++)
+            for (unsigned int j = 0; j < 3; j++)
+              this->meshlets[i].cone_axis[j] *= -1;
+        }
+        
+      /**
+       * Sets the vertex format that will be used on GPU (with the next
+       * update_gpu()), the CPU side vertices are always kept as Vertex3D.
+       * Packed formats only keep the first two texture coordinates. Positions
+       * quantized with VERTEX_FORMAT_POSITION_UNORM16 have to be transformed
+       * with get_dequantization_matrix() (i.e. the model matrix has to be
+       * multiplied by it).
+       *
+       * @param format VERTEX_FORMAT_* flags
+       */
+
+      void set_vertex_format(unsigned int format)
+        {
+          this->vertex_format = format;
+        }
+
+      unsigned int get_vertex_format()
+        {
+          return this->vertex_format;
+        }
+
+      /**
+       * Returns the size of one vertex on GPU in bytes.
+       */
+
+      unsigned int get_vertex_size()
+        {
+          return this->vertex_size;
+        }
+
+      GLenum get_index_type()
+        {
+          return this->index_type;
+        }
+
+      GLuint get_vao()
+        {
+          return this->vao;
+        }
+
+      /**
+       * Returns the matrix that transforms quantized positions back to the
+       * model space, identity if the positions are not quantized. Valid
+       * after update_gpu().
+       */
+
+      glm::mat4 get_dequantization_matrix()
+        {
+          return (this->vertex_format & VERTEX_FORMAT_POSITION_UNORM16) ? this->dequantization_matrix : glm::mat4(1.0f);
+        }
+
+      /**
+       * Sets the dynamic mode (takes effect with the next update_gpu()), for
+       * geometry whose vertices change every frame. The vertex buffer then
+       * has immutable storage, persistently mapped, split into
+       * GEOMETRY_DYNAMIC_SECTIONS sections used as a ring: update_vertices_gpu()
+       * only writes the vertices into the next section, guarded by a fence,
+       * so there is no reallocation or implicit synchronization. The indices
+       * stay static.
+       */
+
+      void set_dynamic(bool dynamic)
+        {
+          this->dynamic = dynamic;
+        }
+
+      bool is_dynamic()
+        {
+          return this->dynamic;
+        }
+
+      /**
+       * Sends the changed vertices to GPU. In dynamic mode they're written
+       * to the next ring section, waiting only if GPU still reads it (i.e.
+       * the CPU is GEOMETRY_DYNAMIC_SECTIONS frames ahead). The draws issued
+       * after this call use the new vertices. Otherwise (or if the number of
+       * vertices grew) it is the same as update_gpu().
+       */
+
+      void update_vertices_gpu()
+        {
+          if (!this->dynamic || this->dynamic_data == 0 || this->vertices.size() > this->dynamic_capacity)
+            {
+              this->update_gpu();
+              return;
+            }
+
+          // the draws issued so far use the current section:
+
+          if (this->dynamic_fences[this->dynamic_section] != 0)
+            glDeleteSync(this->dynamic_fences[this->dynamic_section]);
+
+          this->dynamic_fences[this->dynamic_section] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE,0);
+          this->dynamic_section = (this->dynamic_section + 1) % GEOMETRY_DYNAMIC_SECTIONS;
+
+          GLsync fence = this->dynamic_fences[this->dynamic_section];
+
+          if (fence != 0)
+            {
+              while (glClientWaitSync(fence,GL_SYNC_FLUSH_COMMANDS_BIT,1000000000) == GL_TIMEOUT_EXPIRED);
+
+              glDeleteSync(fence);
+              this->dynamic_fences[this->dynamic_section] = 0;
+            }
+
+          if (this->vertex_format & VERTEX_FORMAT_POSITION_UNORM16)
+            this->compute_aabb();
+
+          this->pack_vertices(this->dynamic_data + this->dynamic_section * this->dynamic_capacity * this->vertex_size);
+        }
+
+      /**
+       * Sends the geometry data to GPU. Indices are stored as 16 bit if the
+       * number of vertices allows it.
+       */
+        
+      virtual void update_gpu()
+        {
+          GLuint offsets[3];
+
+          GLState::bind_vertex_array(this->vao);
+
+          if (this->vertex_format & VERTEX_FORMAT_POSITION_UNORM16)
+            this->compute_aabb();
+
+          this->compute_vertex_layout(offsets);
+
+          if (this->dynamic_data != 0)   // the immutable storage of the last dynamic upload can't be reallocated
+            {
+              glBindBuffer(GL_ARRAY_BUFFER,this->vbo);
+              glUnmapBuffer(GL_ARRAY_BUFFER);
+              glDeleteBuffers(1,&(this->vbo));
+              glGenBuffers(1,&(this->vbo));
+              this->dynamic_data = 0;
+            }
+
+          for (unsigned int i = 0; i < GEOMETRY_DYNAMIC_SECTIONS; i++)
+            if (this->dynamic_fences[i] != 0)
+              {
+                glDeleteSync(this->dynamic_fences[i]);
+                this->dynamic_fences[i] = 0;
+              }
+
+          if (this->dynamic)
+            {
+              // immutable storage for all the ring sections, mapped for good:
+
+              GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+              this->dynamic_capacity = glm::max((unsigned int) this->vertices.size(),(unsigned int) 1);
+              this->dynamic_section = 0;
+
+              glBindBuffer(GL_ARRAY_BUFFER,this->vbo);
+              glBufferStorage(GL_ARRAY_BUFFER,GEOMETRY_DYNAMIC_SECTIONS * this->dynamic_capacity * this->vertex_size,0,flags);
+              this->dynamic_data = (unsigned char *) glMapBufferRange(GL_ARRAY_BUFFER,0,GEOMETRY_DYNAMIC_SECTIONS * this->dynamic_capacity * this->vertex_size,flags);
+
+              if (this->dynamic_data == 0)
+                ErrorWriter::write_error("Could not map the dynamic vertex buffer.");
+              else
+                this->pack_vertices(this->dynamic_data);
+            }
+          else
+            {
+              vector<unsigned char> packed_vertices(this->vertices.size() * this->vertex_size);
+
+              this->pack_vertices(packed_vertices.data());
+              glBindBuffer(GL_ARRAY_BUFFER,this->vbo);
+              glBufferData(GL_ARRAY_BUFFER,packed_vertices.size(),packed_vertices.data(),GL_STATIC_DRAW);
+            }
+
+          this->set_attribute_pointers();
+
+          glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,this->ibo);
+
+          if (this->vertices.size() <= 65536)
+            {
+              vector<uint16_t> short_triangles(this->triangles.begin(),this->triangles.end());
+              short_triangles.insert(short_triangles.end(),this->lod_triangles.begin(),this->lod_triangles.end());
+              this->index_type = GL_UNSIGNED_SHORT;
+              glBufferData(GL_ELEMENT_ARRAY_BUFFER,short_triangles.size() * sizeof(uint16_t),short_triangles.data(),GL_STATIC_DRAW);
+            }
+          else
+            {
+              this->index_type = GL_UNSIGNED_INT;
+              glBufferData(GL_ELEMENT_ARRAY_BUFFER,(this->triangles.size() + this->lod_triangles.size()) * sizeof(unsigned int),0,GL_STATIC_DRAW);
+              glBufferSubData(GL_ELEMENT_ARRAY_BUFFER,0,this->triangles.size() * sizeof(unsigned int),this->triangles.data());
+              glBufferSubData(GL_ELEMENT_ARRAY_BUFFER,this->triangles.size() * sizeof(unsigned int),this->lod_triangles.size() * sizeof(unsigned int),this->lod_triangles.data());
+            }
+
+          GLState::bind_vertex_array(0);
+        };
+        
+      /**
+       * Simulates a FIFO post-transform vertex cache of given size and
+       * returns the average cache miss ratio (ACMR), i.e. the number of
+       * transformed vertices per triangle (0.5 is ideal, 3 is the worst).
+       */
+
+      float compute_acmr(unsigned int cache_size=16)
+        {
+          if (this->triangles.size() < 3)
+            return 0.0;
+
+          vector<unsigned int> cache_time(this->vertices.size(),0);  // time the vertex entered the cache
+          unsigned int time = cache_size + 1;
+          unsigned int misses = 0;
+
+          for (unsigned int i = 0; i < this->triangles.size(); i++)
+            {
+              unsigned int index = this->triangles[i];
+
+              if (index < cache_time.size() && time - cache_time[index] > cache_size)
+                {
+                  cache_time[index] = time;
+                  time++;
+                  misses++;
+                }
+            }
+
+          return misses / ((float) this->triangles.size() / 3);
+        }
+
+      /**
+       * Reorders the triangles for the post-transform vertex cache with the
+       * Tipsify algorithm (Sander, Nehab, Barczak: Fast Triangle Reordering
+       * for Vertex Locality and Reduced Overdraw, 2007).
+       *
+       * @param triangles triangle indices to reorder
+       * @param number_of_vertices number of vertices the indices refer to
+       * @param cache_size size of the vertex cache to optimize for
+       * @param cluster_starts if not 0, indices of the first triangles of the
+       *   clusters that start at cache flushes (dead ends) will be returned
+       *   here, these can be reordered without hurting the cache use
+       */
+
+      static void reorder_for_vertex_cache(vector<unsigned int> &triangles, unsigned int number_of_vertices, unsigned int cache_size=16, vector<unsigned int> *cluster_starts=0)
+        {
+          unsigned int number_of_triangles = triangles.size() / 3;
+          unsigned int i;
+
+          // vertex -> triangle adjacency in compressed form:
+
+          vector<unsigned int> adjacency_offsets(number_of_vertices + 1,0);
+          vector<unsigned int> adjacency(number_of_triangles * 3);
+          vector<unsigned int> live_triangles(number_of_vertices,0);
+
+          for (i = 0; i < number_of_triangles * 3; i++)
+            live_triangles[triangles[i]]++;
+
+          for (i = 0; i < number_of_vertices; i++)
+            adjacency_offsets[i + 1] = adjacency_offsets[i] + live_triangles[i];
+
+          vector<unsigned int> fill(adjacency_offsets.begin(),adjacency_offsets.end() - 1);
+
+          for (i = 0; i < number_of_triangles * 3; i++)
+            adjacency[fill[triangles[i]]++] = i / 3;
+
+          vector<unsigned int> cache_time(number_of_vertices,0);
+          vector<bool> emitted(number_of_triangles,false);
+          vector<unsigned int> dead_end_stack;
+          vector<unsigned int> candidates;
+          vector<unsigned int> result;
+          unsigned int time = cache_size + 1;
+          unsigned int cursor = 0;
+          int fanning_vertex = 0;
+
+          result.reserve(number_of_triangles * 3);
+
+          if (cluster_starts != 0)
+            cluster_starts->clear();
+
+          if (number_of_triangles == 0)
+            return;
+
+          if (cluster_starts != 0)
+            cluster_starts->push_back(0);
+
+          while (fanning_vertex >= 0)
+            {
+              candidates.clear();
+
+              for (i = adjacency_offsets[fanning_vertex]; i < adjacency_offsets[fanning_vertex + 1]; i++)
+                {
+                  unsigned int triangle = adjacency[i];
+
+                  if (emitted[triangle])
+                    continue;
+
+                  for (int j = 0; j < 3; j++)
+                    {
+                      unsigned int vertex = triangles[triangle * 3 + j];
+
+                      result.push_back(vertex);
+                      dead_end_stack.push_back(vertex);
+                      candidates.push_back(vertex);
+                      live_triangles[vertex]--;
+
+                      if (time - cache_time[vertex] > cache_size)
+                        {
+                          cache_time[vertex] = time;
+                          time++;
+                        }
+                    }
+
+                  emitted[triangle] = true;
+                }
+
+              // choose the next fanning vertex among the candidates, prefer
+              // vertices that will still be in the cache after their fan:
+
+              int best_priority = -1;
+              fanning_vertex = -1;
+
+              for (i = 0; i < candidates.size(); i++)
+                {
+                  unsigned int vertex = candidates[i];
+
+                  if (live_triangles[vertex] == 0)
+                    continue;
+
+                  int priority = 0;
+
+                  if (time - cache_time[vertex] + 2 * live_triangles[vertex] <= cache_size)
+                    priority = time - cache_time[vertex];
+
+                  if (priority > best_priority)
+                    {
+                      best_priority = priority;
+                      fanning_vertex = vertex;
+                    }
+                }
+
+              if (fanning_vertex >= 0)
+                continue;
+
+              // dead end, the cache will be cold:
+
+              if (result.size() < number_of_triangles * 3 && cluster_starts != 0)
+                cluster_starts->push_back(result.size() / 3);
+
+              while (dead_end_stack.size() != 0 && fanning_vertex < 0)
+                {
+                  unsigned int vertex = dead_end_stack.back();
+                  dead_end_stack.pop_back();
+
+                  if (live_triangles[vertex] > 0)
+                    fanning_vertex = vertex;
+                }
+
+              while (fanning_vertex < 0 && cursor < number_of_vertices)
+                {
+                  if (live_triangles[cursor] > 0)
+                    fanning_vertex = cursor;
+
+                  cursor++;
+                }
+            }
+
+          triangles.swap(result);
+        }
+
+      /**
+       * Reorders the triangles for the vertex cache, see
+       * reorder_for_vertex_cache().
+       */
+
+      void optimize_vertex_cache(unsigned int cache_size=16, vector<unsigned int> *cluster_starts=0)
+        {
+          reorder_for_vertex_cache(this->triangles,this->vertices.size(),cache_size,cluster_starts);
+        }
+
+      /**
+       * Reorders clusters of triangles so that the ones facing out of the
+       * object are drawn first, which makes them occlude the rest and reduces
+       * overdraw from most viewpoints. The clusters are taken from
+       * optimize_vertex_cache() so the vertex cache use is kept.
+       *
+       * @param cluster_starts triangle indices at which the clusters start
+       * @param minimum_cluster_size clusters smaller than this (in triangles)
+       *   are merged with the following ones
+       */
+
+      void optimize_overdraw(vector<unsigned int> &cluster_starts, unsigned int minimum_cluster_size=64)
+        {
+          unsigned int number_of_triangles = this->triangles.size() / 3;
+          vector<unsigned int> starts;
+          unsigned int i, j;
+
+          for (i = 0; i < cluster_starts.size(); i++)
+            if (starts.size() == 0 || cluster_starts[i] - starts.back() >= minimum_cluster_size)
+              starts.push_back(cluster_starts[i]);
+
+          if (starts.size() < 2)
+            return;
+
+          starts.push_back(number_of_triangles);
+
+          vector<glm::vec3> centroids(starts.size() - 1,glm::vec3(0,0,0));
+          vector<glm::vec3> normals(starts.size() - 1,glm::vec3(0,0,0));
+          glm::vec3 mesh_centroid = glm::vec3(0,0,0);
+          float mesh_area = 0;
+
+          for (i = 0; i + 1 < starts.size(); i++)
+            {
+              float cluster_area = 0;
+
+              for (j = starts[i]; j < starts[i + 1]; j++)
+                {
+                  glm::vec3 a = this->vertices[this->triangles[j * 3]].position;
+                  glm::vec3 b = this->vertices[this->triangles[j * 3 + 1]].position;
+                  glm::vec3 c = this->vertices[this->triangles[j * 3 + 2]].position;
+                  glm::vec3 normal = glm::cross(b - a,c - a);     // length is twice the area
+                  float area = glm::length(normal);
+
+                  centroids[i] += (a + b + c) * (area / 3.0f);
+                  normals[i] += normal;
+                  cluster_area += area;
+                }
+
+              mesh_centroid += centroids[i];
+              mesh_area += cluster_area;
+
+              if (cluster_area > 0)
+                centroids[i] /= cluster_area;
+            }
+
+          if (mesh_area > 0)
+            mesh_centroid /= mesh_area;
+
+          vector<pair<float,unsigned int> > sort_keys;
+
+          for (i = 0; i + 1 < starts.size(); i++)
+            {
+              float normal_length = glm::length(normals[i]);
+              float key = normal_length > 0 ? glm::dot(centroids[i] - mesh_centroid,normals[i] / normal_length) : 0;
+              sort_keys.push_back(pair<float,unsigned int>(-key,i));
+            }
+
+          stable_sort(sort_keys.begin(),sort_keys.end());
+
+          vector<unsigned int> result;
+          result.reserve(this->triangles.size());
+
+          for (i = 0; i < sort_keys.size(); i++)
+            {
+              unsigned int cluster = sort_keys[i].second;
+              result.insert(result.end(),this->triangles.begin() + starts[cluster] * 3,this->triangles.begin() + starts[cluster + 1] * 3);
+            }
+
+          this->triangles.swap(result);
+        }
+
+      /**
+       * Reorders the vertices in the order of their first use by the
+       * triangles, so that vertex fetches are as sequential as possible.
+       * Vertices not used by any triangle are removed.
+       */
+
+      void optimize_vertex_fetch()
+        {
+          vector<unsigned int> remap(this->vertices.size(),0xffffffff);
+          vector<Vertex3D> result;
+
+          result.reserve(this->vertices.size());
+
+          for (unsigned int i = 0; i < this->triangles.size(); i++)
+            {
+              unsigned int index = this->triangles[i];
+
+              if (remap[index] == 0xffffffff)
+                {
+                  remap[index] = result.size();
+                  result.push_back(this->vertices[index]);
+                }
+
+              this->triangles[i] = remap[index];
+            }
+            
+          for (unsigned int i = 0; i < this->lod_triangles.size(); i++)
+            {
+              unsigned int index = this->lod_triangles[i];
+              
+              if (remap[index] == 0xffffffff)
+                {
+                  remap[index] = result.size();
+                  result.push_back(this->vertices[index]);
+                }
+                
+              this->lod_triangles[i] = remap[index];
+            }
+
+          this->vertices.swap(result);
+        }
+
+      /**
+       * Runs all the optimizations (vertex cache, overdraw, vertex fetch) in
+       * the right order. Meshlets and LODs are cleared as they'd no longer
+       * match.
+       *
+       * @param verbose if true, ACMR before and after is printed
+       */
+
+      void optimize(bool verbose=false, unsigned int cache_size=16)
+        {
+          float acmr_before = this->compute_acmr(cache_size);
+          vector<unsigned int> cluster_starts;
+
+          this->optimize_vertex_cache(cache_size,&cluster_starts);
+          this->optimize_overdraw(cluster_starts);
+          this->optimize_vertex_fetch();
+          this->meshlets.clear();
+          this->lods.clear();
+          this->lod_triangles.clear();
+
+          if (verbose)
+            cout << "mesh optimized, ACMR (cache size " << cache_size << "): " << acmr_before << " -> " << this->compute_acmr(cache_size) << endl;
+        }
+
+      /**
+       * Builds a chain of simplified versions of the geometry (see
+       * MeshSimplifier), each one with about reduction times the triangles of
+       * the previous one. All LODs share the vertices and are stored in one
+       * index buffer on GPU. Stops early when the geometry can't be simplified
+       * any further. Meshlets are cleared, build_meshlets() has to be called
+       * after this.
+       */
+
+      void build_lods(unsigned int max_lods=4, float reduction=0.5, bool verbose=false, unsigned int cache_size=16)
+        {
+          geometry_lod lod;
+          vector<unsigned int> current = this->triangles;
+          MeshSimplifier simplifier(this->vertices,this->triangles);
+
+          this->lods.clear();
+          this->lod_triangles.clear();
+          this->meshlets.clear();
+
+          lod.first_index = 0;
+          lod.number_of_indices = this->triangles.size();
+          lod.error = 0;
+          lod.first_meshlet = 0;
+          lod.number_of_meshlets = 0;
+          this->lods.push_back(lod);
+
+          for (unsigned int i = 1; i < max_lods; i++)
+            {
+              unsigned int previous_size = current.size();
+              float error = simplifier.simplify(current,((unsigned int) (previous_size * reduction)) / 3 * 3);
+
+              if (current.size() == 0 || current.size() > previous_size * 0.9)
+                break;
+
+              reorder_for_vertex_cache(current,this->vertices.size(),cache_size);   // reorder the LOD for the vertex cache too
+
+              lod.first_index = this->triangles.size() + this->lod_triangles.size();
+              lod.number_of_indices = current.size();
+              lod.error = glm::max(error,this->lods.back().error);
+              this->lods.push_back(lod);
+              this->lod_triangles.insert(this->lod_triangles.end(),current.begin(),current.end());
+            }
+
+          if (verbose)
+            {
+              cout << "LODs (triangles/error):";
+
+              for (unsigned int i = 0; i < this->lods.size(); i++)
+                cout << " " << this->lods[i].number_of_indices / 3 << "/" << this->lods[i].error;
+
+              cout << endl;
+            }
+        }
+
+      unsigned int get_number_of_lods()
+        {
+          return glm::max((unsigned int) 1,(unsigned int) this->lods.size());
+        }
+
+      /**
+       * Chooses the coarsest LOD whose geometric error projects to at most
+       * given number of pixels. The projection is estimated from the
+       * distance to the bounding sphere center. If the camera is inside the
+       * sphere, some geometry may be arbitrarily close, so LOD 0 is chosen.
+       *
+       * @param model_matrix model matrix the geometry is drawn with
+       * @param camera_position camera position in world space
+       * @param viewport_height viewport height in pixels
+       * @param fov_y vertical field of view in radians
+       * @param max_pixel_error allowed error in pixels, use higher values for
+       *   passes where the detail is less visible (e.g. cubemap captures)
+       */
+
+      unsigned int select_lod(glm::mat4 model_matrix, glm::vec3 camera_position, float viewport_height, float fov_y, float max_pixel_error)
+        {
+          if (this->lods.size() < 2)
+            return 0;
+
+          float scale = glm::max(glm::length(glm::vec3(model_matrix[0])),glm::max(glm::length(glm::vec3(model_matrix[1])),glm::length(glm::vec3(model_matrix[2]))));
+          glm::vec3 center = glm::vec3(model_matrix * glm::vec4((this->aabb_min + this->aabb_max) * 0.5f,1.0));
+          float radius = glm::length(this->aabb_max - this->aabb_min) * 0.5f * scale;
+          float distance = glm::length(center - camera_position);
+          
+          if (distance <= radius)
+            return 0;
+          
+          float pixels_per_unit = viewport_height / (2.0f * (distance - radius) * (float) tan(fov_y / 2.0));
+
+          unsigned int result = 0;
+
+          for (unsigned int i = 1; i < this->lods.size(); i++)
+            if (this->lods[i].error * scale * pixels_per_unit <= max_pixel_error)
+              result = i;
+
+          return result;
+        }
+
+      /**
+       * Draws given LOD (see build_lods()).
+       */
+
+      void draw_lod(unsigned int lod)
+        {
+          if (lod == 0 || lod >= this->lods.size())
+            {
+              this->draw_as_triangles();
+              return;
+            }
+
+          unsigned int index_size = this->index_type == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(unsigned int);
+
+          GLState::bind_vertex_array(this->vao);
+          glDrawElementsBaseVertex(GL_TRIANGLES,this->lods[lod].number_of_indices,this->index_type,(const GLvoid *) (size_t) (this->lods[lod].first_index * index_size),this->get_base_vertex());
+        }
+
+      /**
+       * Splits the triangles of each LOD into spatially coherent meshlets
+       * that can be culled separately (see draw_culled()). The triangles are
+       * grouped by their dominant normal axis and each group is split
+       * recursively at centroid medians, so the meshlets are compact and have
+       * narrow normal cones. Each meshlet is then reordered for the vertex
+       * cache, the overdraw order of optimize() is not kept. Call this after
+       * build_lods().
+       *
+       * @param max_triangles maximum number of triangles in one meshlet
+       */
+
+      void build_meshlets(unsigned int max_triangles=128, unsigned int cache_size=16)
+        {
+          this->meshlets.clear();
+          
+          this->cluster_triangles(this->triangles,0,max_triangles,cache_size);
+          
+          for (unsigned int i = 0; i < this->lods.size(); i++)
+            {
+              geometry_lod *lod = &(this->lods[i]);
+              
+              if (i == 0)
+                lod->first_meshlet = 0;
+              else
+                {
+                  vector<unsigned int>::iterator first = this->lod_triangles.begin() + (lod->first_index - this->triangles.size());
+                  vector<unsigned int> lod_indices(first,first + lod->number_of_indices);
+                  
+                  lod->first_meshlet = this->meshlets.size();
+                  this->cluster_triangles(lod_indices,lod->first_index,max_triangles,cache_size);
+                  std::copy(lod_indices.begin(),lod_indices.end(),first);
+                }
+                
+              lod->number_of_meshlets = this->meshlets.size() - lod->first_meshlet;
+            }
+        }
+        
+      /**
+       * Splits given triangles into meshlets and reorders them accordingly,
+       * see build_meshlets().
+       *
+       * @param indices triangle indices, reordered in place
+       * @param first_index position of the indices in the GPU index buffer
+       */
+        
+      void cluster_triangles(vector<unsigned int> &indices, unsigned int first_index, unsigned int max_triangles, unsigned int cache_size)
+        {
+          unsigned int number_of_triangles = indices.size() / 3;
+          unsigned int i, j;
+
+          if (number_of_triangles == 0)
+            return;
+
+          vector<glm::vec3> centroids(number_of_triangles);
+          vector<unsigned int> buckets[6];   // by the dominant normal axis and sign
+
+          for (i = 0; i < number_of_triangles; i++)
+            {
+              glm::vec3 a = this->vertices[indices[i * 3]].position;
+              glm::vec3 b = this->vertices[indices[i * 3 + 1]].position;
+              glm::vec3 c = this->vertices[indices[i * 3 + 2]].position;
+              glm::vec3 normal = glm::cross(b - a,c - a);
+              glm::vec3 normal_abs = glm::abs(normal);
+
+              unsigned int axis = normal_abs.x >= normal_abs.y && normal_abs.x >= normal_abs.z ? 0 : (normal_abs.y >= normal_abs.z ? 1 : 2);
+
+              centroids[i] = (a + b + c) / 3.0f;
+              buckets[axis * 2 + (normal[axis] < 0 ? 1 : 0)].push_back(i);
+            }
+
+          vector<unsigned int> order;
+          vector<unsigned int> meshlet_starts;
+
+          for (i = 0; i < 6; i++)
+            {
+              split_triangles(buckets[i].begin(),buckets[i].end(),centroids,max_triangles);
+
+              for (j = 0; j < buckets[i].size(); j += max_triangles)
+                meshlet_starts.push_back(order.size() + j);
+
+              order.insert(order.end(),buckets[i].begin(),buckets[i].end());
+            }
+
+          meshlet_starts.push_back(number_of_triangles);
+
+          vector<unsigned int> sorted_triangles(indices.size());
+
+          for (i = 0; i < number_of_triangles; i++)
+            for (j = 0; j < 3; j++)
+              sorted_triangles[i * 3 + j] = indices[order[i] * 3 + j];
+
+          indices.clear();
+
+          vector<unsigned int> local_index(this->vertices.size(),VERTEX_WELDER_EMPTY);
+          vector<unsigned int> global_index;
+          vector<unsigned int> meshlet_indices;
+
+          for (unsigned int k = 0; k + 1 < meshlet_starts.size(); k++)
+            {
+              geometry_meshlet meshlet;
+              i = meshlet_starts[k];
+              unsigned int meshlet_triangles = meshlet_starts[k + 1] - i;
+
+              // reorder the meshlet for the vertex cache, with local vertex
+              // indices so that the cost doesn't depend on the mesh size:
+
+              global_index.clear();
+              meshlet_indices.assign(sorted_triangles.begin() + i * 3,sorted_triangles.begin() + (i + meshlet_triangles) * 3);
+
+              for (j = 0; j < meshlet_indices.size(); j++)
+                {
+                  if (local_index[meshlet_indices[j]] == VERTEX_WELDER_EMPTY)
+                    {
+                      local_index[meshlet_indices[j]] = global_index.size();
+                      global_index.push_back(meshlet_indices[j]);
+                    }
+
+                  meshlet_indices[j] = local_index[meshlet_indices[j]];
+                }
+
+              reorder_for_vertex_cache(meshlet_indices,global_index.size(),cache_size);
+
+              for (j = 0; j < meshlet_indices.size(); j++)
+                indices.push_back(global_index[meshlet_indices[j]]);
+
+              for (j = 0; j < global_index.size(); j++)
+                local_index[global_index[j]] = VERTEX_WELDER_EMPTY;
+
+              meshlet.first_index = first_index + i * 3;
+              meshlet.number_of_indices = meshlet_triangles * 3;
+
+              glm::vec3 meshlet_min = this->vertices[indices[i * 3]].position;
+              glm::vec3 meshlet_max = meshlet_min;
+              glm::vec3 normal_sum = glm::vec3(0,0,0);
+              vector<glm::vec3> normals;
+
+              for (j = i * 3; j < (i + meshlet_triangles) * 3; j += 3)
+                {
+                  glm::vec3 a = this->vertices[indices[j]].position;
+                  glm::vec3 b = this->vertices[indices[j + 1]].position;
+                  glm::vec3 c = this->vertices[indices[j + 2]].position;
+                  glm::vec3 normal = glm::cross(b - a,c - a);
+                  float normal_length = glm::length(normal);
+
+                  meshlet_min = glm::min(meshlet_min,glm::min(a,glm::min(b,c)));
+                  meshlet_max = glm::max(meshlet_max,glm::max(a,glm::max(b,c)));
+
+                  if (normal_length > 0)
+                    {
+                      normals.push_back(normal / normal_length);
+                      normal_sum += normals.back();
+                    }
+                }
+
+              float axis_length = glm::length(normal_sum);
+              glm::vec3 axis = axis_length > 0 ? normal_sum / axis_length : glm::vec3(1,0,0);
+              float min_dot = axis_length > 0 ? 1.0 : -1.0;
+
+              for (j = 0; j < normals.size(); j++)
+                min_dot = glm::min(min_dot,glm::dot(normals[j],axis));
+
+              for (j = 0; j < 3; j++)
+                {
+                  meshlet.aabb_min[j] = meshlet_min[j];
+                  meshlet.aabb_max[j] = meshlet_max[j];
+                  meshlet.cone_axis[j] = axis[j];
+                }
+
+              // the cone of view directions in which all the triangles are
+              // back facing is 90 degrees minus the normal spread wide:
+
+              meshlet.cone_cutoff = min_dot <= 0.01 ? 2.0 : sqrt(1.0 - min_dot * min_dot);
+              this->meshlets.push_back(meshlet);
+            }
+        }
+
+      unsigned int get_number_of_meshlets()
+        {
+          return this->meshlets.size();
+        }
+
+      /**
+       * Extracts the frustum planes (Gribb, Hartmann) from given matrix
+       * (projection * view * model), the planes are in the space the matrix
+       * transforms from and point inside the frustum.
+       */
+
+      static void get_frustum_planes(glm::mat4 matrix, glm::vec4 planes[6])
+        {
+          glm::vec4 rows[4];
+
+          for (int i = 0; i < 4; i++)
+            rows[i] = glm::vec4(matrix[0][i],matrix[1][i],matrix[2][i],matrix[3][i]);
+
+          for (int i = 0; i < 3; i++)
+            {
+              planes[i * 2] = rows[3] + rows[i];
+              planes[i * 2 + 1] = rows[3] - rows[i];
+            }
+        }
+
+      /**
+       * Draws the meshlets (see build_meshlets()) that are inside the view
+       * frustum and not completely back facing, with one multi-draw call in
+       * which neighbouring visible meshlets are merged. The culling is done
+       * in model space, the model matrix mustn't contain non-uniform scale.
+       * Draws the whole LOD if it has no meshlets.
+       *
+       * @param model_matrix model matrix the geometry is drawn with
+       * @param view_projection_matrix projection * view matrix
+       * @param camera_position camera position in world space
+       * @param cull_backfaces whether to cull with the normal cones, disable
+       *   this for geometry rendered with back faces
+       * @param lod LOD to draw (see build_lods())
+       * @return number of drawn triangles
+       */
+
+      unsigned int draw_culled(glm::mat4 model_matrix, glm::mat4 view_projection_matrix, glm::vec3 camera_position, bool cull_backfaces=true, unsigned int lod=0)
+        {
+          if (lod >= this->lods.size())
+            lod = 0;
+
+          unsigned int first_meshlet = this->lods.size() != 0 ? this->lods[lod].first_meshlet : 0;
+          unsigned int number_of_meshlets = this->lods.size() != 0 ? this->lods[lod].number_of_meshlets : this->meshlets.size();
+
+          if (number_of_meshlets == 0)
+            {
+              this->draw_lod(lod);
+              return (lod == 0 ? this->triangles.size() : this->lods[lod].number_of_indices) / 3;
+            }
+
+          glm::vec4 planes[6];
+          get_frustum_planes(view_projection_matrix * model_matrix,planes);
+
+          glm::vec3 camera_model = glm::vec3(glm::inverse(model_matrix) * glm::vec4(camera_position,1.0));
+          unsigned int index_size = this->index_type == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(unsigned int);
+          unsigned int result = 0;
+
+          this->draw_counts.clear();
+          this->draw_offsets.clear();
+
+          for (unsigned int i = first_meshlet; i < first_meshlet + number_of_meshlets; i++)
+            {
+              geometry_meshlet *meshlet = &(this->meshlets[i]);
+              glm::vec3 aabb_min = glm::vec3(meshlet->aabb_min[0],meshlet->aabb_min[1],meshlet->aabb_min[2]);
+              glm::vec3 aabb_max = glm::vec3(meshlet->aabb_max[0],meshlet->aabb_max[1],meshlet->aabb_max[2]);
+              bool visible = true;
+
+              for (int j = 0; j < 6 && visible; j++)   // test the AABB corner furthest along the plane normal
+                {
+                  glm::vec3 corner = glm::vec3(
+                    planes[j].x >= 0 ? aabb_max.x : aabb_min.x,
+                    planes[j].y >= 0 ? aabb_max.y : aabb_min.y,
+                    planes[j].z >= 0 ? aabb_max.z : aabb_min.z);
+
+                  if (glm::dot(glm::vec3(planes[j]),corner) + planes[j].w < 0)
+                    visible = false;
+                }
+
+              if (visible && cull_backfaces && meshlet->cone_cutoff <= 1.0)
+                {
+                  glm::vec3 center = (aabb_min + aabb_max) * 0.5f;
+                  glm::vec3 to_center = center - camera_model;
+                  glm::vec3 axis = glm::vec3(meshlet->cone_axis[0],meshlet->cone_axis[1],meshlet->cone_axis[2]);
+
+                  if (glm::dot(to_center,axis) >= meshlet->cone_cutoff * glm::length(to_center) + glm::length(aabb_max - center))
+                    visible = false;
+                }
+
+              if (!visible)
+                continue;
+
+              result += meshlet->number_of_indices / 3;
+
+              if (this->draw_counts.size() != 0 &&
+                (size_t) this->draw_offsets.back() + this->draw_counts.back() * index_size == meshlet->first_index * index_size)
+                this->draw_counts.back() += meshlet->number_of_indices;
+              else
+                {
+                  this->draw_counts.push_back(meshlet->number_of_indices);
+                  this->draw_offsets.push_back((const GLvoid *) (size_t) (meshlet->first_index * index_size));
+                }
+            }
+
+          if (this->draw_counts.size() != 0)
+            {
+              GLState::bind_vertex_array(this->vao);
+              this->draw_base_vertices.assign(this->draw_counts.size(),this->get_base_vertex());
+              glMultiDrawElementsBaseVertex(GL_TRIANGLES,this->draw_counts.data(),this->index_type,this->draw_offsets.data(),this->draw_counts.size(),this->draw_base_vertices.data());
+            }
+
+          return result;
+        }
+
+      /**
+       * Computes the axis aligned bounding box of the vertices.
+       */
+
+      void compute_aabb()
+        {
+          if (this->vertices.size() == 0)
+            {
+              this->aabb_min = glm::vec3(0,0,0);
+              this->aabb_max = glm::vec3(0,0,0);
+              return;
+            }
+
+          this->aabb_min = this->vertices[0].position;
+          this->aabb_max = this->vertices[0].position;
+
+          for (unsigned int i = 1; i < this->vertices.size(); i++)
+            {
+              this->aabb_min = glm::min(this->aabb_min,this->vertices[i].position);
+              this->aabb_max = glm::max(this->aabb_max,this->vertices[i].position);
+            }
+        }
+
+      glm::vec3 get_aabb_min()
+        {
+          return this->aabb_min;
+        }
+
+      glm::vec3 get_aabb_max()
+        {
+          return this->aabb_max;
+        }
+
+      /**
+       * Saves the geometry to a binary mesh file that can be loaded with
+       * load_mesh() much faster than the source model.
+       *
+       * @param filename file to write
+       * @param source_filename if given, the size and modification time of
+       *   this file are stored, so that load_mesh() can detect a stale file
+       * @param flags MESH_FILE_* flags to store
+       */
+
+      bool save_mesh(string filename, string source_filename="", unsigned int flags=0)
+        {
+          mesh_file_header header;
+          struct stat source_info;
+          FILE *file_handle;
+
+          memset(&header,0,sizeof(header));
+          memcpy(header.magic,"MESH",4);
+          header.version = MESH_FILE_VERSION;
+          header.flags = flags;
+          header.vertex_size = sizeof(Vertex3D);
+          header.number_of_vertices = this->vertices.size();
+          header.number_of_indices = this->triangles.size();
+          header.number_of_meshlets = this->meshlets.size();
+          header.number_of_lods = this->lods.size();
+          header.number_of_lod_indices = this->lod_triangles.size();
+
+          if (source_filename.length() != 0 && stat(source_filename.c_str(),&source_info) == 0)
+            {
+              header.source_size = source_info.st_size;
+              header.source_mtime = source_info.st_mtim.tv_sec * 1000000000LL + source_info.st_mtim.tv_nsec;
+            }
+
+          this->compute_aabb();
+
+          for (int i = 0; i < 3; i++)
+            {
+              header.aabb_min[i] = this->aabb_min[i];
+              header.aabb_max[i] = this->aabb_max[i];
+            }
+
+          file_handle = fopen(filename.c_str(),"wb");
+
+          if (!file_handle)
+            {
+              ErrorWriter::write_error("Could not write mesh file '" + filename + "'.");
+              return false;
+            }
+
+          fwrite(&header,sizeof(header),1,file_handle);
+          fwrite(this->vertices.data(),sizeof(Vertex3D),this->vertices.size(),file_handle);
+          fwrite(this->triangles.data(),sizeof(unsigned int),this->triangles.size(),file_handle);
+          fwrite(this->meshlets.data(),sizeof(geometry_meshlet),this->meshlets.size(),file_handle);
+          fwrite(this->lods.data(),sizeof(geometry_lod),this->lods.size(),file_handle);
+          fwrite(this->lod_triangles.data(),sizeof(unsigned int),this->lod_triangles.size(),file_handle);
+
+          fclose(file_handle);
+          return true;
+        }
+
+      /**
+       * Loads the geometry from a binary mesh file saved with save_mesh().
+       * The file is memory mapped and the arrays are copied out of it as
+       * they are, without any parsing. Fails silently (returns false) if
+       * the file doesn't exist, was written by a different version, with
+       * different flags or from a different source file.
+       *
+       * @param filename file to load
+       * @param source_filename if given, the file is only accepted if it
+       *   was made from this file in its current state (size and
+       *   modification time)
+       * @param flags MESH_FILE_* flags the file has to have
+       */
+
+      bool load_mesh(string filename, string source_filename="", unsigned int flags=0)
+        {
+          struct stat file_info, source_info;
+          int file_descriptor;
+
+          file_descriptor = open(filename.c_str(),O_RDONLY);
+
+          if (file_descriptor < 0)
+            return false;
+
+          if (fstat(file_descriptor,&file_info) != 0 || file_info.st_size < (off_t) sizeof(mesh_file_header))
+            {
+              close(file_descriptor);
+              return false;
+            }
+
+          size_t file_size = file_info.st_size;
+          unsigned char *file_data = (unsigned char *) mmap(0,file_size,PROT_READ,MAP_PRIVATE,file_descriptor,0);
+          close(file_descriptor);
+
+          if (file_data == MAP_FAILED)
+            return false;
+
+          mesh_file_header *header = (mesh_file_header *) file_data;
+          bool result =
+            memcmp(header->magic,"MESH",4) == 0 &&
+            header->version == MESH_FILE_VERSION &&
+            header->flags == flags &&
+            header->vertex_size == sizeof(Vertex3D) &&
+            file_size == sizeof(mesh_file_header) +
+              header->number_of_vertices * (size_t) sizeof(Vertex3D) +
+              header->number_of_indices * (size_t) sizeof(unsigned int) +
+              header->number_of_meshlets * (size_t) sizeof(geometry_meshlet) +
+              header->number_of_lods * (size_t) sizeof(geometry_lod) +
+              header->number_of_lod_indices * (size_t) sizeof(unsigned int);
+
+          if (result && source_filename.length() != 0)
+            result = stat(source_filename.c_str(),&source_info) == 0 &&
+              header->source_size == (uint64_t) source_info.st_size &&
+              header->source_mtime == source_info.st_mtim.tv_sec * 1000000000LL + source_info.st_mtim.tv_nsec;
+
+          if (result)
+            {
+              Vertex3D *vertex_data = (Vertex3D *) (file_data + sizeof(mesh_file_header));
+              unsigned int *index_data = (unsigned int *) (vertex_data + header->number_of_vertices);
+              geometry_meshlet *meshlet_data = (geometry_meshlet *) (index_data + header->number_of_indices);
+              geometry_lod *lod_data = (geometry_lod *) (meshlet_data + header->number_of_meshlets);
+              unsigned int *lod_index_data = (unsigned int *) (lod_data + header->number_of_lods);
+
+              this->vertices.assign(vertex_data,vertex_data + header->number_of_vertices);
+              this->triangles.assign(index_data,index_data + header->number_of_indices);
+              this->meshlets.assign(meshlet_data,meshlet_data + header->number_of_meshlets);
+              this->lods.assign(lod_data,lod_data + header->number_of_lods);
+              this->lod_triangles.assign(lod_index_data,lod_index_data + header->number_of_lod_indices);
+              this->aabb_min = glm::vec3(header->aabb_min[0],header->aabb_min[1],header->aabb_min[2]);
+              this->aabb_max = glm::vec3(header->aabb_max[0],header->aabb_max[1],header->aabb_max[2]);
+            }
+
+          munmap(file_data,file_size);
+          return result;
+        }
+
+      vector<Vertex3D> *get_vertices()
+        {
+          return &(this->vertices);
+        }
+        
+      vector<unsigned int> *get_triangles()
+        {
+          return &(this->triangles);
+        }
+        
+      void add_vertex(double x, double y, double z, double u=0, double v=0, double w=0, double normal_x=0, double normal_y=0, double normal_z=-1)
+        {
+          Vertex3D new_vertex;
+          new_vertex.position = glm::vec3(x,y,z);
+          new_vertex.texture_coord = glm::vec3(u,v,w);
+          new_vertex.normal = glm::vec3(normal_x,normal_y,normal_z);
+          this->vertices.push_back(new_vertex);
+        }
+      void add_triangle(unsigned int i1, unsigned int i2, unsigned int i3)
+        {
+          this->triangles.push_back(i1);
+          this->triangles.push_back(i2);
+          this->triangles.push_back(i3);
+        }
+        
+      virtual void print()
+        {
+          int i;
+          
+          cout << "vertices:" << endl;
+          
+          for (i = 0; i < (int) this->vertices.size(); i++)
+            this->vertices[i].print();
+            
+          cout << "triangles:" << endl;
+          
+          for (i = 0; i < (int) this->triangles.size(); i++)
+            {
+              if (i % 3 == 0)
+                cout << "  ";
+              
+              cout << triangles[i] << " ";
+              
+              if (i % 3 == 2)
+                cout << endl;
+            }
+        }
+  };
+
+Geometry3D make_triangle(float side_length)
+  {
+    Geometry3D result;
+    float helper1, helper2, helper3;
+    
+    helper1 = (side_length / 2.0) / sin(M_PI / 3.0);
+    helper2 = side_length * sin(M_PI / 6.0);
+    helper3 = helper1 - side_length * cos(M_PI / 6.0);
+    
+    result.add_vertex(0.0,helper1,0.0,      0.0,0.0,0.0,  0.0,0.0,1.0); 
+    result.add_vertex(-helper2,helper3,0.0,  0.0,0.0,0.0,  0.0,0.0,1.0); 
+    result.add_vertex(helper2,helper3,0.0,  0.0,0.0,0.0,  0.0,0.0,1.0); 
+  
+    result.add_triangle(0,1,2);
+    
+    return result;
+  }
+  
+Geometry3D make_quad(float width, float height, float shift_z)
+  {
+    Geometry3D result;
+    
+    float half_width = width / 2.0;
+    float half_height = height / 2.0;
+    
+    result.add_vertex(-half_width,-half_height,shift_z,0.0,0.0,0.0,0.0,1.0,0.0); 
+    result.add_vertex(half_width,-half_height,shift_z,1.0,0.0,0.0,0.0,1.0,0.0);   
+    result.add_vertex(-half_width,half_height,shift_z,0.0,1.0,0.0,0.0,1.0,0.0);  
+    result.add_vertex(half_width,half_height,shift_z,1.0,1.0,0.0,0.0,1.0,0.0);    
+  
+    result.add_triangle(1,0,2);
+    result.add_triangle(1,2,3); 
+    
+    return result;
+  }
+
+Geometry3D make_box(float width, float height, float depth)
+  {
+    Geometry3D result;
+    
+    float half_width = width / 2.0;
+    float half_height = height / 2.0;
+    float half_depth = depth / 2.0;
+    
+    result.add_vertex(-half_width,-half_height,-half_depth,0.25,0.25,0.0,-1.0,-1.0,-1.0); // 0
+    result.add_vertex(half_width,-half_height,-half_depth,0.75,0.25,0.0,1.0,-1.0,-1.0);   // 1
+    result.add_vertex(-half_width,half_height,-half_depth,0.25,0.75,0.0,-1.0,1.0,-1.0);   // 2
+    result.add_vertex(half_width,half_height,-half_depth,0.75,0.75,0.0,1.0,1.0,-1.0);     // 3
+
+    result.add_vertex(-half_width,-half_height,half_depth,0.0,0.0,0.0,-1.0,-1.0,1.0);     // 4
+    result.add_vertex(half_width,-half_height,half_depth,1.0,0.0,0.0,1.0,-1.0,1.0);       // 5
+    result.add_vertex(-half_width,half_height,half_depth,0.0,1.0,0.0,-1.0,1.0,1.0);       // 6
+    result.add_vertex(half_width,half_height,half_depth,1.0,1.0,0.0,1.0,1.0,1.0);         // 7
+    
+    result.add_triangle(1,0,2); // front
+    result.add_triangle(1,2,3); 
+    
+    result.add_triangle(4,5,6); // back
+    result.add_triangle(6,5,7);
+    
+    result.add_triangle(2,0,4); // left
+    result.add_triangle(2,4,6);
+    
+    result.add_triangle(1,3,5); // right
+    result.add_triangle(5,3,7);
+    
+    result.add_triangle(3,2,6); // top
+    result.add_triangle(7,3,6);
+    
+    result.add_triangle(0,1,4); // bottom
+    result.add_triangle(4,1,5);
+    
+    return result;
+  }
+
+/**
+ * Makes a box with separate sides and sharp edges.
+ */
+  
+Geometry3D make_box_sharp(float width, float height, float depth)
+  {
+    Geometry3D result;
+    
+    float half_width = width / 2.0;
+    float half_height = height / 2.0;
+    float half_depth = depth / 2.0;
+    
+    // front:
+    result.add_vertex(-half_width,-half_height,half_depth,0.501,0.665,0.0,0.0,0.0,1.0);  // 0
+    result.add_vertex(half_width,-half_height,half_depth,0.999,0.665,0.0,0.0,0.0,1.0);   // 1
+    result.add_vertex(-half_width,half_height,half_depth,0.501,0.334,0.0,0.0,0.0,1.0);   // 2
+    result.add_vertex(half_width,half_height,half_depth,0.999,0.334,0.0,0.0,0.0,1.0);    // 3
+
+    result.add_triangle(1,2,0);
     result.add_triangle(1,3,2); 
     
     // left vertices:
@@ -3121,177 +7499,1177 @@ glm::mat4 make_reflection_matrix(glm::vec3 point1, glm::vec3 point2, glm::vec3 p
     return result;
   }
   
-  /**
-    Parses the data contained in one line of obj file format
-    (e.g. "v 1.5 3 4.2" or "f 1/2 3/5 4/6 1/20").
-    @param data in this variable the parsed data will be returned, the
-       first index represents the element number (i.e. x, y, z for
-       a vertex or one of the triangle indices) and the second index
-       represents one of up to 3 shashed values (if the values are
-       in format a/b/3), if any of the values is not present, -1.0
-       is inserted.
-   */
-  
-void parse_obj_line(string line,float data[4][3])
+/**
+ * Parses a decimal number (e.g. "-1.5e-3") starting at given position and
+ * moves the position after it. This is used instead of stof, which needs
+ * null-terminated strings, locales and exceptions.
+ */
+
+inline float parse_obj_float(const char *&position, const char *end)
+  {
+    static const double powers[] = {1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22};
+
+    bool negative = false;
+    uint64_t mantissa = 0;
+    int exponent = 0;
+
+    if (position < end && (*position == '-' || *position == '+'))
+      {
+        negative = *position == '-';
+        position++;
+      }
+
+    while (position < end && *position >= '0' && *position <= '9')
+      {
+        if (mantissa < 100000000000000000ULL)
+          mantissa = mantissa * 10 + (*position - '0');
+        else
+          exponent++;     // ignore digits beyond precision
+
+        position++;
+      }
+
+    if (position < end && *position == '.')
+      {
+        position++;
+
+        while (position < end && *position >= '0' && *position <= '9')
+          {
+            if (mantissa < 100000000000000000ULL)
+              {
+                mantissa = mantissa * 10 + (*position - '0');
+                exponent--;
+              }
+
+            position++;
+          }
+      }
+
+    if (position < end && (*position == 'e' || *position == 'E'))
+      {
+        position++;
+
+        bool exponent_negative = false;
+        int exponent_value = 0;
+
+        if (position < end && (*position == '-' || *position == '+'))
+          {
+            exponent_negative = *position == '-';
+            position++;
+          }
+
+        while (position < end && *position >= '0' && *position <= '9')
+          {
+            exponent_value = glm::min(exponent_value * 10 + (*position - '0'),1000);
+            position++;
+          }
+
+        exponent += exponent_negative ? -exponent_value : exponent_value;
+      }
+
+    double result = (double) mantissa;
+
+    while (exponent > 22)
+      {
+        result *= 1e22;
+        exponent -= 22;
+      }
+
+    while (exponent < -22)
+      {
+        result /= 1e22;
+        exponent += 22;
+      }
+
+    result = exponent >= 0 ? result * powers[exponent] : result / powers[-exponent];
+
+    return (float) (negative ? -result : result);
+  }
+
+inline int parse_obj_int(const char *&position, const char *end)
+  {
+    bool negative = false;
+    int result = 0;
+
+    if (position < end && (*position == '-' || *position == '+'))
+      {
+        negative = *position == '-';
+        position++;
+      }
+
+    while (position < end && *position >= '0' && *position <= '9')
+      {
+        result = result * 10 + (*position - '0');
+        position++;
+      }
+
+    return negative ? -result : result;
+  }
+
+inline void skip_obj_spaces(const char *&position, const char *end)
+  {
+    while (position < end && (*position == ' ' || *position == '\t' || *position == '\r'))
+      position++;
+  }
+
+/**
+ * One corner of an OBJ face. Positive OBJ indices are stored as absolute
+ * (zero based), negative (relative) indices are stored relative to the
+ * beginning of the chunk they were parsed in and resolved when the chunks
+ * are merged. -1 means the index is missing.
+ */
+
+typedef struct
+  {
+    int index[3];             ///< position, texture vertex and normal index
+    unsigned char relative;   ///< bit i says index[i] is relative to its chunk
+  } obj_face_corner;
+
+/**
+ * Data parsed from one part of an OBJ file.
+ */
+
+typedef struct
+  {
+    vector<glm::vec3> attributes[3];       ///< positions, texture vertices and normals
+    vector<obj_face_corner> corners;
+    vector<unsigned int> face_sizes;       ///< number of corners of each face
+  } obj_chunk;
+
+/**
+ * Parses all whole lines between start and end into given chunk.
+ */
+
+void parse_obj_chunk(const char *start, const char *end, obj_chunk *chunk)
+  {
+    const char *position = start;
+
+    while (position < end)
+      {
+        const char *line_end = (const char *) memchr(position,'\n',end - position);
+
+        if (line_end == 0)
+          line_end = end;
+
+        skip_obj_spaces(position,line_end);
+
+        if (position < line_end && position[0] == 'v')
+          {
+            unsigned int attribute = 0;         // position vertex
+
+            if (position + 1 < line_end && position[1] == 't')
+              attribute = 1;
+            else if (position + 1 < line_end && position[1] == 'n')
+              attribute = 2;
+
+            while (position < line_end && *position != ' ' && *position != '\t')  // skip the keyword
+              position++;
+
+            glm::vec3 value(0,0,0);
+
+            for (int i = 0; i < 3; i++)
+              {
+                skip_obj_spaces(position,line_end);
+
+                if (position >= line_end)
+                  break;
+
+                value[i] = parse_obj_float(position,line_end);
+              }
+
+            chunk->attributes[attribute].push_back(value);
+          }
+        else if (position < line_end && position[0] == 'f')
+          {
+            unsigned int face_size = 0;
+
+            position++;
+
+            while (true)
+              {
+                skip_obj_spaces(position,line_end);
+
+                if (position >= line_end || ((*position < '0' || *position > '9') && *position != '-'))
+                  break;
+
+                obj_face_corner corner;
+                corner.relative = 0;
+                corner.index[0] = corner.index[1] = corner.index[2] = -1;
+
+                for (int i = 0; i < 3; i++)    // v/vt/vn, vt and vn are optional
+                  {
+                    if (position < line_end && ((*position >= '0' && *position <= '9') || *position == '-'))
+                      {
+                        int value = parse_obj_int(position,line_end);
+
+                        if (value > 0)
+                          corner.index[i] = value - 1;
+                        else if (value < 0)
+                          {
+                            corner.index[i] = chunk->attributes[i].size() + value;
+                            corner.relative |= 1 << i;
+                          }
+                      }
+
+                    if (position < line_end && *position == '/')
+                      position++;
+                    else
+                      break;
+                  }
+
+                while (position < line_end && *position != ' ' && *position != '\t' && *position != '\r')
+                  position++;
+
+                chunk->corners.push_back(corner);
+                face_size++;
+              }
+
+            if (face_size >= 3)
+              chunk->face_sizes.push_back(face_size);
+            else
+              chunk->corners.resize(chunk->corners.size() - face_size);   // degenerate face
+          }
+
+        position = line_end + 1;
+      }
+  }
+  
+/**
+ * Loads a 3D geometry from obj file format. This is a simple method and doesn't
+ * support OBJ in its full specification (only v, vt, vn and f lines are
+ * read, polygons are triangulated as fans).
+ *
+ * Each unique combination of position, texture coordinate and normal
+ * becomes one vertex (so vertices on UV seams and hard edges are split
+ * correctly), equal vertices are welded into one even if they come from
+ * different OBJ indices. Positions not used by any face are dropped.
+ *
+ * The file is memory mapped and split at line boundaries into chunks that
+ * are parsed in parallel, then the chunks are merged in file order, so the
+ * result is the same as if the file was parsed sequentially.
+ * 
+ * @param filename file to be loaded
+ * @param flip whether to flip object vertically (due to obj coords)
+ */
+  
+Geometry3D load_obj(string filename, bool flip=false)
+  {
+    Geometry3D result;   
+    struct stat file_info;
+    int file_descriptor;
+    
+    int flip_factor = flip ? -1 : 1;
+
+    file_descriptor = open(filename.c_str(),O_RDONLY);
+
+    if (file_descriptor < 0)
+      {
+        ErrorWriter::write_error("couldn't open file '" + filename + "'.");
+        return result;
+      }
+
+    if (fstat(file_descriptor,&file_info) != 0 || file_info.st_size == 0)
+      {
+        close(file_descriptor);
+        return result;
+      }
+
+    size_t file_size = file_info.st_size;
+    const char *file_data = (const char *) mmap(0,file_size,PROT_READ,MAP_PRIVATE,file_descriptor,0);
+    close(file_descriptor);
+
+    if (file_data == MAP_FAILED)
+      {
+        ErrorWriter::write_error("couldn't map file '" + filename + "'.");
+        return result;
+      }
+
+    madvise((void *) file_data,file_size,MADV_SEQUENTIAL);
+
+    // split the file into chunks at line ends:
+
+    const size_t minimum_chunk_size = 256 * 1024;    // smaller chunks aren't worth a thread
+    unsigned int number_of_chunks = glm::max((unsigned int) 1,thread::hardware_concurrency());
+    number_of_chunks = glm::max((size_t) 1,glm::min((size_t) number_of_chunks,file_size / minimum_chunk_size));
+
+    vector<const char *> chunk_starts;
+    chunk_starts.push_back(file_data);
+
+    for (unsigned int i = 1; i < number_of_chunks; i++)
+      {
+        const char *start = glm::max(chunk_starts.back(),file_data + (file_size / number_of_chunks) * i);
+        const char *line_end = (const char *) memchr(start,'\n',file_data + file_size - start);
+
+        if (line_end == 0)
+          break;
+
+        chunk_starts.push_back(line_end + 1);
+      }
+
+    chunk_starts.push_back(file_data + file_size);
+    number_of_chunks = chunk_starts.size() - 1;
+
+    vector<obj_chunk> chunks(number_of_chunks);
+    vector<thread> threads;
+
+    for (unsigned int i = 1; i < number_of_chunks; i++)
+      threads.push_back(thread(parse_obj_chunk,chunk_starts[i],chunk_starts[i + 1],&chunks[i]));
+
+    parse_obj_chunk(chunk_starts[0],chunk_starts[1],&chunks[0]);   // the calling thread parses the first chunk
+
+    for (unsigned int i = 0; i < threads.size(); i++)
+      threads[i].join();
+
+    munmap((void *) file_data,file_size);
+
+    // merge the chunks in order:
+
+    size_t totals[3] = {0,0,0};
+    size_t total_corners = 0;
+    size_t total_triangles = 0;
+
+    for (unsigned int i = 0; i < number_of_chunks; i++)
+      {
+        for (int j = 0; j < 3; j++)
+          totals[j] += chunks[i].attributes[j].size();
+
+        total_corners += chunks[i].corners.size();
+
+        for (unsigned int j = 0; j < chunks[i].face_sizes.size(); j++)
+          total_triangles += chunks[i].face_sizes[j] - 2;
+      }
+
+    vector<glm::vec3> attributes[3];     // positions, texture vertices, normals
+
+    for (int j = 0; j < 3; j++)
+      {
+        attributes[j].reserve(totals[j]);
+
+        for (unsigned int i = 0; i < number_of_chunks; i++)
+          attributes[j].insert(attributes[j].end(),chunks[i].attributes[j].begin(),chunks[i].attributes[j].end());
+      }
+
+    VertexWelder welder(&(result.vertices),total_corners);
+    result.triangles.reserve(total_triangles * 3);
+
+    size_t offsets[3] = {0,0,0};        // numbers of attributes in previous chunks
+    vector<unsigned int> face_indices;
+
+    for (unsigned int i = 0; i < number_of_chunks; i++)
+      {
+        obj_chunk *chunk = &chunks[i];
+        unsigned int corner = 0;
+
+        for (unsigned int j = 0; j < chunk->corners.size(); j++)   // resolve the indices
+          for (int k = 0; k < 3; k++)
+            if (chunk->corners[j].relative & (1 << k))
+              chunk->corners[j].index[k] += offsets[k];
+
+        for (unsigned int face = 0; face < chunk->face_sizes.size(); face++)
+          {
+            obj_face_corner *corners = &(chunk->corners[corner]);
+            unsigned int face_size = chunk->face_sizes[face];
+            bool valid = true;
+
+            corner += face_size;
+            face_indices.clear();
+
+            for (unsigned int j = 0; j < face_size && valid; j++)   // check first, not to weld vertices of a skipped face
+              valid = corners[j].index[0] >= 0 && (size_t) corners[j].index[0] < attributes[0].size();
+
+            if (!valid)
+              continue;
+
+            for (unsigned int j = 0; j < face_size; j++)
+              {
+                Vertex3D vertex;
+                int *index = corners[j].index;
+
+                vertex.position = attributes[0][index[0]];
+                vertex.position.y *= flip_factor;
+
+                if (index[1] >= 0 && (size_t) index[1] < attributes[1].size())
+                  {
+                    vertex.texture_coord.x = attributes[1][index[1]].x;
+                    vertex.texture_coord.y = 1.0 - attributes[1][index[1]].y;
+                  }
+
+                if (index[2] >= 0 && (size_t) index[2] < attributes[2].size())
+                  vertex.normal = attributes[2][index[2]];
+                else
+                  vertex.normal = glm::vec3(1.0,0.0,0.0);
+
+                face_indices.push_back(welder.add(vertex));
+              }
+
+            for (unsigned int j = 1; j + 1 < face_size; j++)
+              result.add_triangle(face_indices[0],face_indices[j],face_indices[j + 1]);
+          }
+
+        for (int k = 0; k < 3; k++)
+          offsets[k] += chunk->attributes[k].size();
+      }
+
+    result.compute_aabb();
+    return result;
+  }
+
+/**
+ * Same as load_obj(), but uses a binary mesh cache file (filename + ".mesh")
+ * next to the model. The cache is created on the first load and recreated
+ * whenever the model file changes. The geometry is optimized (see
+ * Geometry3D::optimize()), gets a LOD chain (Geometry3D::build_lods()) and
+ * each LOD is split into meshlets (Geometry3D::build_meshlets()) before it is
+ * stored in the cache.
+ */
+
+Geometry3D load_obj_cached(string filename, bool flip=false)
+  {
+    string cache_filename = filename + ".mesh";
+    unsigned int flags = flip ? MESH_FILE_FLIPPED : 0;
+    Geometry3D result;
+
+    if (result.load_mesh(cache_filename,filename,flags))
+      return result;
+
+    result = load_obj(filename,flip);
+
+    if (result.vertices.size() != 0)
+      {
+        float acmr_before = result.compute_acmr();
+        result.optimize();
+        cerr << "mesh cache for '" << filename << "' rebuilt, ACMR: " << acmr_before << " -> " << result.compute_acmr() << endl;   // not to mix with the program output
+        result.build_lods(4,0.5);
+        result.build_meshlets();
+        result.optimize_vertex_fetch();
+        result.save_mesh(cache_filename,filename,flags);
+      }
+
+    return result;
+  }
+  
+#define GEOMETRY_BATCH_BINDING_POINT 2    ///< SSBO binding of the per-draw data
+#define GEOMETRY_BATCH_DRAW_ID_LOCATION 3 ///< vertex attribute with the draw index
+
+/**
+ * Indirect draw command as read by glMultiDrawElementsIndirect.
+ */
+
+typedef struct
+  {
+    uint32_t count;
+    uint32_t instance_count;
+    uint32_t first_index;
+    int32_t base_vertex;
+    uint32_t base_instance;
+  } draw_elements_indirect_command;
+
+/**
+ * Per-draw data of GeometryBatch as laid out in the SSBO (std430):
+ *
+ * struct batch_draw
+ *   {
+ *     mat4 model_matrix;   // transposed, like the uniform matrices
+ *     uint flags;
+ *   };
+ */
+
+typedef struct
+  {
+    float model_matrix[16];
+    uint32_t flags;
+    uint32_t padding[3];
+  } geometry_batch_draw;
+
+/**
+ * Several geometries stored in shared vertex and index buffers and drawn
+ * with one glMultiDrawElementsIndirect call. The model matrix and user
+ * flags of each draw are stored in an SSBO bound to
+ * GEOMETRY_BATCH_BINDING_POINT, the vertex shader gets the index of the
+ * draw in an uint attribute at GEOMETRY_BATCH_DRAW_ID_LOCATION (sourced
+ * with divisor 1 and the base instance of the draw command, so no
+ * ARB_shader_draw_parameters is needed). The draws are made in the order
+ * they were added, so ranges of them can be drawn (e.g. without the
+ * objects that aren't visible in some pass).
+ */
+
+class GeometryBatch: public GPUObject
+  {
+    protected:
+      Geometry3D geometry;                            ///< all the geometries together
+      vector<draw_elements_indirect_command> commands;
+      vector<geometry_batch_draw> draws;
+      vector<glm::mat4> model_matrices;
+      GLuint indirect_buffer;
+      GLuint draw_buffer;
+      GLuint draw_id_buffer;
+      bool draws_changed;
+
+      void upload_draws()
+        {
+          for (unsigned int i = 0; i < this->draws.size(); i++)
+            {
+              glm::mat4 matrix = glm::transpose(this->model_matrices[i] * this->geometry.get_dequantization_matrix());
+              memcpy(this->draws[i].model_matrix,glm::value_ptr(matrix),sizeof(this->draws[i].model_matrix));
+            }
+
+          glBindBuffer(GL_SHADER_STORAGE_BUFFER,this->draw_buffer);
+          glBufferSubData(GL_SHADER_STORAGE_BUFFER,0,this->draws.size() * sizeof(geometry_batch_draw),this->draws.data());
+          this->draws_changed = false;
+        }
+
+    public:
+      /**
+       * @param vertex_format VERTEX_FORMAT_* flags of the shared vertex
+       *   buffer, the geometries are repacked into it
+       */
+
+      GeometryBatch(unsigned int vertex_format=VERTEX_FORMAT_FLOAT)
+        {
+          this->geometry.set_vertex_format(vertex_format);
+          this->draws_changed = true;
+
+          glGenBuffers(1,&(this->indirect_buffer));
+          glGenBuffers(1,&(this->draw_buffer));
+          glGenBuffers(1,&(this->draw_id_buffer));
+        }
+
+      virtual ~GeometryBatch()
+        {
+          glDeleteBuffers(1,&(this->indirect_buffer));
+          glDeleteBuffers(1,&(this->draw_buffer));
+          glDeleteBuffers(1,&(this->draw_id_buffer));
+        }
+
+      /**
+       * Adds a geometry (its full detail triangles) to the batch, the
+       * vertices are copied so the geometry can be deleted afterwards.
+       * update_gpu() has to be called after all geometries are added.
+       *
+       * @return index of the draw
+       */
+
+      unsigned int add(Geometry3D *geometry, glm::mat4 model_matrix=glm::mat4(1.0f), unsigned int flags=0)
+        {
+          draw_elements_indirect_command command;
+          geometry_batch_draw draw;
+
+          command.count = geometry->triangles.size();
+          command.instance_count = 1;
+          command.first_index = this->geometry.triangles.size();
+          command.base_vertex = this->geometry.vertices.size();
+          command.base_instance = this->commands.size();
+
+          this->geometry.vertices.insert(this->geometry.vertices.end(),geometry->vertices.begin(),geometry->vertices.end());
+          this->geometry.triangles.insert(this->geometry.triangles.end(),geometry->triangles.begin(),geometry->triangles.end());
+
+          memset(&draw,0,sizeof(draw));
+          draw.flags = flags;
+          this->commands.push_back(command);
+          this->draws.push_back(draw);
+          this->model_matrices.push_back(model_matrix);
+          this->draws_changed = true;
+
+          return command.base_instance;
+        }
+
+      unsigned int get_number_of_draws()
+        {
+          return this->commands.size();
+        }
+
+      /**
+       * Sets the model matrix of given draw, the data are only uploaded to
+       * GPU if they change.
+       */
+
+      void set_model_matrix(unsigned int draw, glm::mat4 model_matrix)
+        {
+          if (this->model_matrices[draw] != model_matrix)
+            {
+              this->model_matrices[draw] = model_matrix;
+              this->draws_changed = true;
+            }
+        }
+
+      void set_flags(unsigned int draw, unsigned int flags)
+        {
+          if (this->draws[draw].flags != flags)
+            {
+              this->draws[draw].flags = flags;
+              this->draws_changed = true;
+            }
+        }
+
+      virtual void update_gpu()
+        {
+          this->geometry.update_gpu();
+
+          vector<GLuint> draw_ids(this->commands.size());
+
+          for (unsigned int i = 0; i < draw_ids.size(); i++)
+            draw_ids[i] = i;
+
+          GLState::bind_vertex_array(this->geometry.get_vao());
+          glBindBuffer(GL_ARRAY_BUFFER,this->draw_id_buffer);
+          glBufferData(GL_ARRAY_BUFFER,draw_ids.size() * sizeof(GLuint),draw_ids.data(),GL_STATIC_DRAW);
+          glEnableVertexAttribArray(GEOMETRY_BATCH_DRAW_ID_LOCATION);
+          glVertexAttribIPointer(GEOMETRY_BATCH_DRAW_ID_LOCATION,1,GL_UNSIGNED_INT,0,0);
+          glVertexAttribDivisor(GEOMETRY_BATCH_DRAW_ID_LOCATION,1);
+          GLState::bind_vertex_array(0);
+
+          glBindBuffer(GL_DRAW_INDIRECT_BUFFER,this->indirect_buffer);
+          glBufferData(GL_DRAW_INDIRECT_BUFFER,this->commands.size() * sizeof(draw_elements_indirect_command),this->commands.data(),GL_STATIC_DRAW);
+          glBindBuffer(GL_DRAW_INDIRECT_BUFFER,0);
+
+          glBindBuffer(GL_SHADER_STORAGE_BUFFER,this->draw_buffer);
+          glBufferData(GL_SHADER_STORAGE_BUFFER,this->draws.size() * sizeof(geometry_batch_draw),0,GL_DYNAMIC_DRAW);
+          this->upload_draws();   // the dequantization matrix is only known after packing the vertices
+        }
+
+      /**
+       * Draws given range of the draws with one multi-draw call.
+       *
+       * @param first_draw index of the first draw
+       * @param number_of_draws number of draws, -1 means all up to the end
+       */
+
+      void draw(unsigned int first_draw=0, int number_of_draws=-1)
+        {
+          if (number_of_draws < 0)
+            number_of_draws = this->commands.size() - first_draw;
+
+          if (number_of_draws == 0)
+            return;
+
+          if (this->draws_changed)
+            this->upload_draws();
+
+          glBindBufferBase(GL_SHADER_STORAGE_BUFFER,GEOMETRY_BATCH_BINDING_POINT,this->draw_buffer);
+          GLState::bind_vertex_array(this->geometry.get_vao());
+          glBindBuffer(GL_DRAW_INDIRECT_BUFFER,this->indirect_buffer);
+          glMultiDrawElementsIndirect(GL_TRIANGLES,this->geometry.get_index_type(),(const GLvoid *) (size_t) (first_draw * sizeof(draw_elements_indirect_command)),number_of_draws,0);
+          glBindBuffer(GL_DRAW_INDIRECT_BUFFER,0);
+        }
+  };
+
+#define BVH_BINS 16                  ///< SAH bins per axis
+#define BVH_MAX_LEAF_TRIANGLES 16    ///< leaves can't be bigger, smaller leaves are made if SAH says so
+#define BVH_PARALLEL_MIN_TRIANGLES 4096   ///< smaller subtrees are built on the current thread
+#define BVH_MAX_DEPTH 64
+#define BVH_MAX_PACKET_SIZE 64
+#define BVH_NO_HIT 0xffffffff
+
+/**
+ * BVH node, 32 bytes. The nodes are stored in depth first order, so the
+ * left child of an inner node directly follows it.
+ */
+
+typedef struct
+  {
+    float aabb_min[3];
+    uint32_t first;                 ///< leaf: first triangle, inner node: index of the right child
+    float aabb_max[3];
+    uint32_t count;                 ///< number of triangles, 0 for inner nodes
+  } bvh_node;
+
+/**
+ * Result of a BVH ray query.
+ */
+
+typedef struct
+  {
+    float distance;                 ///< along the ray direction (in its length units)
+    uint32_t triangle;              ///< index of the triangle in the geometry, BVH_NO_HIT if nothing was hit
+    float u;                        ///< barycentric coordinates, the point is (1 - u - v) * v0 + u * v1 + v * v2
+    float v;
+  } bvh_hit;
+
+/**
+ * Bounding volume hierarchy over the triangles of a Geometry3D for CPU ray
+ * queries. It's built with the binned surface area heuristic, the top
+ * levels of the tree are built in parallel. The triangles are copied in the
+ * leaf order so the traversal reads memory sequentially.
+ */
+
+class BVH
   {
-    line = line.substr(line.find_first_of(' '));  // get rid of the first characters
+    protected:
+      vector<bvh_node> nodes;
+      vector<glm::vec3> triangle_vertices;    ///< 3 for each triangle, in leaf order
+      vector<unsigned int> triangle_ids;      ///< original triangle indices, in leaf order
+      vector<glm::vec3> centroids;            ///< build data
+      vector<glm::vec3> bounds_min;
+      vector<glm::vec3> bounds_max;
+
+      static float surface_area(glm::vec3 aabb_min, glm::vec3 aabb_max)
+        {
+          glm::vec3 extent = glm::max(aabb_max - aabb_min,glm::vec3(0,0,0));
+          return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+        }
+
+      /**
+       * Ray-AABB slab test, returns the entry distance or infinity on miss.
+       */
+
+      static float intersect_aabb(const bvh_node &node, glm::vec3 origin, glm::vec3 inverse_direction, float max_distance)
+        {
+          float t_min = 0, t_max = max_distance;
+
+          for (int i = 0; i < 3; i++)
+            {
+              float t1 = (node.aabb_min[i] - origin[i]) * inverse_direction[i];
+              float t2 = (node.aabb_max[i] - origin[i]) * inverse_direction[i];
+
+              t_min = glm::max(t_min,glm::min(t1,t2));
+              t_max = glm::min(t_max,glm::max(t1,t2));
+            }
+
+          return t_min <= t_max ? t_min : INFINITY;
+        }
+
+      /**
+       * Moller-Trumbore ray-triangle intersection, updates the hit if the
+       * triangle is closer.
+       */
+
+      bool intersect_triangle(unsigned int index, glm::vec3 origin, glm::vec3 direction, bvh_hit &hit)
+        {
+          glm::vec3 v0 = this->triangle_vertices[index * 3];
+          glm::vec3 edge1 = this->triangle_vertices[index * 3 + 1] - v0;
+          glm::vec3 edge2 = this->triangle_vertices[index * 3 + 2] - v0;
+          glm::vec3 p = glm::cross(direction,edge2);
+          float determinant = glm::dot(edge1,p);
+
+          if (fabs(determinant) < 1e-12)
+            return false;
+
+          float inverse_determinant = 1.0f / determinant;
+          glm::vec3 to_origin = origin - v0;
+          float u = glm::dot(to_origin,p) * inverse_determinant;
+
+          if (u < 0 || u > 1)
+            return false;
+
+          glm::vec3 q = glm::cross(to_origin,edge1);
+          float v = glm::dot(direction,q) * inverse_determinant;
+
+          if (v < 0 || u + v > 1)
+            return false;
+
+          float distance = glm::dot(edge2,q) * inverse_determinant;
+
+          if (distance <= 0 || distance >= hit.distance)
+            return false;
+
+          hit.distance = distance;
+          hit.triangle = this->triangle_ids[index];
+          hit.u = u;
+          hit.v = v;
+          return true;
+        }
+
+      /**
+       * Builds the subtree of given triangle range (of triangle_ids) and
+       * appends it to nodes in depth first order. The right subtrees of the
+       * first parallel_depth levels are built on new threads.
+       */
+
+      void build_node(unsigned int first, unsigned int count, vector<bvh_node> &nodes, unsigned int depth, unsigned int parallel_depth)
+        {
+          unsigned int node_index = nodes.size();
+          unsigned int i, axis;
+          bvh_node node;
+
+          glm::vec3 node_min = this->bounds_min[this->triangle_ids[first]];
+          glm::vec3 node_max = this->bounds_max[this->triangle_ids[first]];
+          glm::vec3 centroid_min = this->centroids[this->triangle_ids[first]];
+          glm::vec3 centroid_max = centroid_min;
+
+          for (i = first; i < first + count; i++)
+            {
+              unsigned int triangle = this->triangle_ids[i];
+              node_min = glm::min(node_min,this->bounds_min[triangle]);
+              node_max = glm::max(node_max,this->bounds_max[triangle]);
+              centroid_min = glm::min(centroid_min,this->centroids[triangle]);
+              centroid_max = glm::max(centroid_max,this->centroids[triangle]);
+            }
+
+          for (i = 0; i < 3; i++)
+            {
+              node.aabb_min[i] = node_min[i];
+              node.aabb_max[i] = node_max[i];
+            }
+
+          node.first = first;
+          node.count = count;
+          nodes.push_back(node);
+
+          if (count <= 2 || depth + 1 >= BVH_MAX_DEPTH)   // the traversal stack is limited
+            return;
+
+          // find the best split among the bin boundaries of all axes:
+
+          float best_cost = INFINITY;
+          unsigned int best_axis = 0, best_bin = 0;
+          glm::vec3 centroid_extent = centroid_max - centroid_min;
+
+          for (axis = 0; axis < 3; axis++)
+            {
+              if (centroid_extent[axis] <= 0)
+                continue;
+
+              unsigned int bin_counts[BVH_BINS];
+              glm::vec3 bin_min[BVH_BINS], bin_max[BVH_BINS];
+              float bin_scale = BVH_BINS / centroid_extent[axis];
+
+              for (i = 0; i < BVH_BINS; i++)
+                {
+                  bin_counts[i] = 0;
+                  bin_min[i] = glm::vec3(INFINITY,INFINITY,INFINITY);
+                  bin_max[i] = glm::vec3(-INFINITY,-INFINITY,-INFINITY);
+                }
+
+              for (i = first; i < first + count; i++)
+                {
+                  unsigned int triangle = this->triangle_ids[i];
+                  unsigned int bin = glm::min((unsigned int) ((this->centroids[triangle][axis] - centroid_min[axis]) * bin_scale),(unsigned int) BVH_BINS - 1);
+
+                  bin_counts[bin]++;
+                  bin_min[bin] = glm::min(bin_min[bin],this->bounds_min[triangle]);
+                  bin_max[bin] = glm::max(bin_max[bin],this->bounds_max[triangle]);
+                }
+
+              // sweep from the right to get the right side costs, then from the left:
+
+              float right_areas[BVH_BINS];
+              unsigned int right_counts[BVH_BINS];
+              glm::vec3 sweep_min = glm::vec3(INFINITY,INFINITY,INFINITY);
+              glm::vec3 sweep_max = glm::vec3(-INFINITY,-INFINITY,-INFINITY);
+              unsigned int sweep_count = 0;
+
+              for (i = BVH_BINS - 1; i > 0; i--)
+                {
+                  sweep_min = glm::min(sweep_min,bin_min[i]);
+                  sweep_max = glm::max(sweep_max,bin_max[i]);
+                  sweep_count += bin_counts[i];
+                  right_areas[i] = surface_area(sweep_min,sweep_max);
+                  right_counts[i] = sweep_count;
+                }
+
+              sweep_min = glm::vec3(INFINITY,INFINITY,INFINITY);
+              sweep_max = glm::vec3(-INFINITY,-INFINITY,-INFINITY);
+              sweep_count = 0;
+
+              for (i = 0; i + 1 < BVH_BINS; i++)
+                {
+                  sweep_min = glm::min(sweep_min,bin_min[i]);
+                  sweep_max = glm::max(sweep_max,bin_max[i]);
+                  sweep_count += bin_counts[i];
+
+                  if (sweep_count == 0 || right_counts[i + 1] == 0)
+                    continue;
+
+                  float cost = sweep_count * surface_area(sweep_min,sweep_max) + right_counts[i + 1] * right_areas[i + 1];
+
+                  if (cost < best_cost)
+                    {
+                      best_cost = cost;
+                      best_axis = axis;
+                      best_bin = i;
+                    }
+                }
+            }
+
+          // SAH with equal traversal and intersection costs:
+
+          float leaf_cost = count;
+          float split_cost = 1.0f + best_cost / glm::max(surface_area(node_min,node_max),1e-20f);
+
+          unsigned int middle;
+
+          if (best_cost == INFINITY)        // all centroids in one point
+            {
+              if (count <= BVH_MAX_LEAF_TRIANGLES)
+                return;
+
+              middle = first + count / 2;
+            }
+          else
+            {
+              if (split_cost >= leaf_cost && count <= BVH_MAX_LEAF_TRIANGLES)
+                return;
+
+              float bin_scale = BVH_BINS / centroid_extent[best_axis];
+              vector<unsigned int>::iterator split = partition(this->triangle_ids.begin() + first,this->triangle_ids.begin() + first + count,
+                [this,best_axis,best_bin,bin_scale,centroid_min](unsigned int triangle)
+                  {
+                    return glm::min((unsigned int) ((this->centroids[triangle][best_axis] - centroid_min[best_axis]) * bin_scale),(unsigned int) BVH_BINS - 1) <= best_bin;
+                  });
+
+              middle = split - this->triangle_ids.begin();
+            }
+
+          nodes[node_index].count = 0;
+
+          if (parallel_depth > 0 && count >= BVH_PARALLEL_MIN_TRIANGLES)
+            {
+              vector<bvh_node> right_nodes;
+              std::thread right_thread(&BVH::build_node,this,middle,first + count - middle,std::ref(right_nodes),depth + 1,parallel_depth - 1);
+
+              this->build_node(first,middle - first,nodes,depth + 1,parallel_depth - 1);
+              right_thread.join();
+
+              unsigned int right_index = nodes.size();
+              nodes[node_index].first = right_index;
+
+              for (i = 0; i < right_nodes.size(); i++)
+                {
+                  if (right_nodes[i].count == 0)
+                    right_nodes[i].first += right_index;   // child indices were local to the right subtree
+
+                  nodes.push_back(right_nodes[i]);
+                }
+            }
+          else
+            {
+              this->build_node(first,middle - first,nodes,depth + 1,0);
+              nodes[node_index].first = nodes.size();
+              this->build_node(middle,first + count - middle,nodes,depth + 1,0);
+            }
+        }
+
+    public:
+      BVH()
+        {
+        }
+
+      /**
+       * Builds the BVH over the triangles (full detail) of given geometry.
+       *
+       * @param geometry geometry to build the BVH for, it isn't referenced
+       *   afterwards
+       * @param transformation transformation applied to the vertices, e.g.
+       *   the model matrix to make queries in the world space
+       * @param threads number of threads to use, 0 means all hardware threads
+       */
+
+      void build(Geometry3D *geometry, glm::mat4 transformation=glm::mat4(1.0f), unsigned int threads=0)
+        {
+          unsigned int number_of_triangles = geometry->triangles.size() / 3;
+          unsigned int i;
+
+          this->nodes.clear();
+          this->triangle_vertices.clear();
+          this->triangle_ids.resize(number_of_triangles);
+          this->centroids.resize(number_of_triangles);
+          this->bounds_min.resize(number_of_triangles);
+          this->bounds_max.resize(number_of_triangles);
+
+          if (number_of_triangles == 0)
+            return;
+
+          vector<glm::vec3> positions(geometry->vertices.size());
+
+          for (i = 0; i < positions.size(); i++)
+            positions[i] = glm::vec3(transformation * glm::vec4(geometry->vertices[i].position,1.0));
+
+          for (i = 0; i < number_of_triangles; i++)
+            {
+              glm::vec3 a = positions[geometry->triangles[i * 3]];
+              glm::vec3 b = positions[geometry->triangles[i * 3 + 1]];
+              glm::vec3 c = positions[geometry->triangles[i * 3 + 2]];
+
+              this->triangle_ids[i] = i;
+              this->bounds_min[i] = glm::min(a,glm::min(b,c));
+              this->bounds_max[i] = glm::max(a,glm::max(b,c));
+              this->centroids[i] = (this->bounds_min[i] + this->bounds_max[i]) * 0.5f;
+            }
+
+          if (threads == 0)
+            threads = glm::max(std::thread::hardware_concurrency(),(unsigned int) 1);
+
+          unsigned int parallel_depth = 0;
+
+          while ((1u << parallel_depth) < threads)
+            parallel_depth++;
+
+          this->nodes.reserve(number_of_triangles * 2);
+          this->build_node(0,number_of_triangles,this->nodes,0,parallel_depth);
+
+          this->triangle_vertices.resize(number_of_triangles * 3);
+
+          for (i = 0; i < number_of_triangles; i++)
+            for (unsigned int j = 0; j < 3; j++)
+              this->triangle_vertices[i * 3 + j] = positions[geometry->triangles[this->triangle_ids[i] * 3 + j]];
+
+          vector<glm::vec3>().swap(this->centroids);
+          vector<glm::vec3>().swap(this->bounds_min);
+          vector<glm::vec3>().swap(this->bounds_max);
+        }
+
+      unsigned int get_number_of_nodes()
+        {
+          return this->nodes.size();
+        }
+
+      /**
+       * Finds the closest intersection of a ray with the triangles. Both
+       * faces of the triangles are hit.
+       *
+       * @param max_distance hits further than this are ignored
+       * @return true if something was hit
+       */
+
+      bool intersect(glm::vec3 origin, glm::vec3 direction, bvh_hit &hit, float max_distance=INFINITY)
+        {
+          hit.distance = max_distance;
+          hit.triangle = BVH_NO_HIT;
+          hit.u = 0;
+          hit.v = 0;
+
+          if (this->nodes.size() == 0)
+            return false;
+
+          glm::vec3 inverse_direction = glm::vec3(1.0f / direction.x,1.0f / direction.y,1.0f / direction.z);
+          unsigned int stack[BVH_MAX_DEPTH];
+          unsigned int stack_size = 0;
+          unsigned int current = 0;
+
+          if (intersect_aabb(this->nodes[0],origin,inverse_direction,hit.distance) == INFINITY)
+            return false;
+
+          while (true)
+            {
+              const bvh_node &node = this->nodes[current];
 
-    unsigned int i,j;
-    size_t position;
-    bool do_break;
+              if (node.count != 0)
+                {
+                  for (unsigned int i = node.first; i < node.first + node.count; i++)
+                    this->intersect_triangle(i,origin,direction,hit);
+                }
+              else
+                {
+                  // visit the closer child first, postpone the other one:
 
-    for (i = 0; i < 4; i++)
-      for (j = 0; j < 3; j++)
-        data[i][j] = -1.0;
+                  unsigned int left = current + 1, right = node.first;
+                  float distance_left = intersect_aabb(this->nodes[left],origin,inverse_direction,hit.distance);
+                  float distance_right = intersect_aabb(this->nodes[right],origin,inverse_direction,hit.distance);
 
-    for (i = 0; i < 4; i++)
-      {
-        for (j = 0; j < 3; j++)
-          {
-            do_break = false;
+                  if (distance_left > distance_right)
+                    {
+                      swap(left,right);
+                      swap(distance_left,distance_right);
+                    }
 
-            try
-              {
-                if (line[0] == '/')
-                  line = line.substr(1);
-                
-                if (line.length() >= 1)
-                  data[i][j] = stof(line,&position);
+                  if (distance_left != INFINITY)
+                    {
+                      if (distance_right != INFINITY && stack_size < BVH_MAX_DEPTH)
+                        stack[stack_size++] = right;
 
-                if (line[position] != '/')
-                  do_break = true;
+                      current = left;
+                      continue;
+                    }
+                }
 
-                if (position + 1 <= line.length())
-                  line = line.substr(position + 1);
-                else
-                  return;
+              if (stack_size == 0)
+                break;
 
-                if (do_break)
-                  break;
-              }
-            catch (exception& e)
-              {
-              }
-          }
-      }
-  }
-  
-/**
- * Loads a 3D geometry from obj file format. This is a simple method and doesn't
- * support OBJ in its full specification.
- * 
- * @param filename file to be loaded
- * @param flip whether to flip object vertically (due to obj coords)
- */
-  
-Geometry3D load_obj(string filename, bool flip=false)
-  {
-    Geometry3D result;   
-    ifstream obj_file(filename.c_str());
-    string line;
-    float obj_line_data[4][3];
-    glm::vec3 helper_point;
-    
-    int flip_factor = flip ? -1 : 1;
+              current = stack[--stack_size];
+            }
 
-    vector<glm::vec3> normals;
-    vector<glm::vec3> texture_vertices;
+          return hit.triangle != BVH_NO_HIT;
+        }
 
-    if (!obj_file.is_open())
-      {
-        ErrorWriter::write_error("couldn't open file '" + filename + "'.");
-        return result;
-      }
+      /**
+       * Intersects a packet of rays (up to BVH_MAX_PACKET_SIZE), which
+       * should be coherent (e.g. neighbouring pixels). The packet traverses
+       * the tree together, so each node is loaded once for all the rays.
+       *
+       * @return number of rays that hit something
+       */
 
-    while (getline(obj_file,line))
-      {
-        switch (line[0])
-          {
-            case 'v':
-              if (line[1] == 'n')        // normal vertex
-                {
-                  parse_obj_line(line,obj_line_data);
+      unsigned int intersect_packet(const glm::vec3 *origins, const glm::vec3 *directions, unsigned int number_of_rays, bvh_hit *hits, float max_distance=INFINITY)
+        {
+          unsigned int i, result = 0;
+          glm::vec3 inverse_directions[BVH_MAX_PACKET_SIZE];
 
-                  helper_point.x = obj_line_data[0][0];
-                  helper_point.y = obj_line_data[1][0];
-                  helper_point.z = obj_line_data[2][0];
+          number_of_rays = glm::min(number_of_rays,(unsigned int) BVH_MAX_PACKET_SIZE);
 
-                  normals.push_back(helper_point);
-                  break;
-                }
-              else if (line[1] == 't')   // texture vertex
-                {
-                  parse_obj_line(line,obj_line_data);
+          for (i = 0; i < number_of_rays; i++)
+            {
+              hits[i].distance = max_distance;
+              hits[i].triangle = BVH_NO_HIT;
+              hits[i].u = 0;
+              hits[i].v = 0;
+              inverse_directions[i] = glm::vec3(1.0f / directions[i].x,1.0f / directions[i].y,1.0f / directions[i].z);
+            }
 
-                  helper_point.x = obj_line_data[0][0];
-                  helper_point.y = obj_line_data[1][0];
-                  helper_point.z = 0;
+          if (this->nodes.size() == 0 || number_of_rays == 0)
+            return 0;
 
-                  texture_vertices.push_back(helper_point);
-                  break;
-                }
-              else                       // position vertex
-                {
-                  parse_obj_line(line,obj_line_data);
-                  result.add_vertex(obj_line_data[0][0],obj_line_data[1][0] * flip_factor,obj_line_data[2][0],0.0,0.0,0.0,1.0,0.0,0.0);
-                  break;
-                }
+          // stack of nodes with the masks of rays that entered them:
+
+          unsigned int stack[BVH_MAX_DEPTH * 2];
+          uint64_t stack_masks[BVH_MAX_DEPTH * 2];
+          unsigned int stack_size = 1;
 
-            case 'f':
-              unsigned int indices[4],i,faces;
+          stack[0] = 0;
+          stack_masks[0] = number_of_rays == 64 ? ~((uint64_t) 0) : (((uint64_t) 1) << number_of_rays) - 1;
 
-              parse_obj_line(line,obj_line_data);
+          while (stack_size != 0)
+            {
+              stack_size--;
+              const bvh_node &node = this->nodes[stack[stack_size]];
+              uint64_t mask = 0;
+
+              for (i = 0; i < number_of_rays; i++)
+                if ((stack_masks[stack_size] >> i) & 1)
+                  if (intersect_aabb(node,origins[i],inverse_directions[i],hits[i].distance) != INFINITY)
+                    mask |= ((uint64_t) 1) << i;
 
-              for (i = 0; i < 4; i++)     // triangle indices
-                indices[i] = floor(obj_line_data[i][0]) - 1;
+              if (mask == 0)
+                continue;
 
-              if (obj_line_data[3][0] < 0.0)
+              if (node.count != 0)
                 {
-                  result.add_triangle(indices[0],indices[1],indices[2]);
-                  faces = 3;     // 3 vertex face
+                  for (i = 0; i < number_of_rays; i++)
+                    if ((mask >> i) & 1)
+                      for (unsigned int j = node.first; j < node.first + node.count; j++)
+                        this->intersect_triangle(j,origins[i],directions[i],hits[i]);
                 }
-              else
+              else if (stack_size + 2 <= BVH_MAX_DEPTH * 2)
                 {
-                  result.add_triangle(indices[0],indices[1],indices[2]);
-                  result.add_triangle(indices[0],indices[2],indices[3]);
-                  faces = 4;     // 4 vertex face
-                }
+                  // push the farther child (for the first active ray) first:
 
-              unsigned int vt_index, vn_index;
+                  unsigned int first_ray = 0;
 
-              for (i = 0; i < faces; i++)    // texture coordinates and normals
-                {
-                  vt_index = floor(obj_line_data[i][1]) - 1;
-                  vn_index = floor(obj_line_data[i][2]) - 1;
+                  while (((mask >> first_ray) & 1) == 0)
+                    first_ray++;
 
-                  if (indices[i] >= result.vertices.size())
-                    continue;
-                  
-                  if (vt_index < texture_vertices.size() && vt_index >= 0)
-                    {
-                      result.vertices[indices[i]].texture_coord.x = texture_vertices[vt_index].x;
-                      result.vertices[indices[i]].texture_coord.y = 1.0 - texture_vertices[vt_index].y;
-                      result.vertices[indices[i]].texture_coord.z = texture_vertices[vt_index].z;
-                    }
-                  
-                  if (vn_index < normals.size() && vn_index >= 0)
-                    {
-                      result.vertices[indices[i]].normal.x = normals[vn_index].x;
-                      result.vertices[indices[i]].normal.y = normals[vn_index].y;
-                      result.vertices[indices[i]].normal.z = normals[vn_index].z;
-                    }
+                  unsigned int left = stack[stack_size] + 1, right = node.first;
+                  glm::vec3 center_left = glm::vec3(this->nodes[left].aabb_min[0] + this->nodes[left].aabb_max[0],this->nodes[left].aabb_min[1] + this->nodes[left].aabb_max[1],this->nodes[left].aabb_min[2] + this->nodes[left].aabb_max[2]);
+                  glm::vec3 center_right = glm::vec3(this->nodes[right].aabb_min[0] + this->nodes[right].aabb_max[0],this->nodes[right].aabb_min[1] + this->nodes[right].aabb_max[1],this->nodes[right].aabb_min[2] + this->nodes[right].aabb_max[2]);
+
+                  if (glm::dot(center_right - center_left,directions[first_ray]) < 0)
+                    swap(left,right);
+
+                  stack[stack_size] = right;
+                  stack_masks[stack_size] = mask;
+                  stack[stack_size + 1] = left;
+                  stack_masks[stack_size + 1] = mask;
+                  stack_size += 2;
                 }
+            }
 
-              break;
+          for (i = 0; i < number_of_rays; i++)
+            if (hits[i].triangle != BVH_NO_HIT)
+              result++;
+
+          return result;
+        }
+  };
 
-            default:
-              break;
-          }
-      }
-    obj_file.close();
-    return result;
-  }
-  
 /**
  * Class that uses static methods and provides methods for default
  * camera control.
@@ -3344,94 +8722,306 @@ class CameraHandler
           dx = x - initial_mouse_coords[0];
           dy = y - initial_mouse_coords[1];
           
-          if (CameraHandler::clicked)
-            camera_transformation.set_rotation(
-              glm::vec3(CameraHandler::initial_camera_rotation.x - dy / (800.0) * CameraHandler::rotation_step,
-                        CameraHandler::initial_camera_rotation.y - dx / (600.0) * CameraHandler::rotation_step,
-                        0.0));
+          if (CameraHandler::clicked)
+            camera_transformation.set_rotation(
+              glm::vec3(CameraHandler::initial_camera_rotation.x - dy / (800.0) * CameraHandler::rotation_step,
+                        CameraHandler::initial_camera_rotation.y - dx / (600.0) * CameraHandler::rotation_step,
+                        0.0));
+        }
+        
+      /**
+       * Set this method as mouse key callback or call it inside mouse
+       * key callback in order for camera transformation of this
+       * class to be handled.
+       */
+        
+      static void key_callback(unsigned char key, int x, int y)
+        {
+          glm::vec3 helper;
+          float speed_factor = CameraHandler::clicked_right ? 3.0 : 1.0;
+    
+          switch (key)
+            {
+              case 'd':
+                helper = CameraHandler::camera_transformation.get_direction_left();
+                helper *= -1 * speed_factor * CameraHandler::translation_step;
+                CameraHandler::camera_transformation.add_translation(helper);
+                break;
+          
+              case 'a':
+                helper = CameraHandler::camera_transformation.get_direction_left();
+                helper *= speed_factor * CameraHandler::translation_step;
+                CameraHandler::camera_transformation.add_translation(helper);
+                break;
+              
+              case 'w':
+                helper = CameraHandler::camera_transformation.get_direction_forward();
+                helper *= speed_factor * CameraHandler::translation_step;
+                CameraHandler::camera_transformation.add_translation(helper);
+                break;
+                
+              case 's':
+                helper = CameraHandler::camera_transformation.get_direction_forward();
+                helper *= -1 * speed_factor * CameraHandler::translation_step;
+                CameraHandler::camera_transformation.add_translation(helper);
+                break;
+              
+              case 'q':
+                helper = CameraHandler::camera_transformation.get_direction_up();
+                helper *= speed_factor * CameraHandler::translation_step;
+                CameraHandler::camera_transformation.add_translation(helper);
+                break;
+                
+              case 'e':
+                helper = CameraHandler::camera_transformation.get_direction_up();
+                helper *= -1 * speed_factor * CameraHandler::translation_step;
+                CameraHandler::camera_transformation.add_translation(helper);
+                break;
+                
+              default:
+                break;
+            }
+        }
+  };
+  
+/**
+ * Serves for gathering statistics about rendering and performance,
+ * can serve optimizations. The object holds a set of named double values
+ * that are being recorded each frame (with possible skip) and their
+ * average values and distributions (percentiles from a logarithmic
+ * histogram, maximum, standard deviation) can be retrieved or printed, so
+ * that the spikes don't hide in the averages. This class also provides
+ * methods for measuring metrics such as time or rasterised fragments
+ * (using OpenGL queries).
+ */
+  
+class Profiler: public Printable
+  {
+    protected:
+      int skip_frames;    ///< how many frames should be skipped before recording values
+      int frames_to_be_skipped;
+      
+      int frames_recorded_total;
+      
+      vector<double> cumulative_values;
+      vector<string> value_names;         ///< corresponding names to cumulative_values
+
+      GLuint time_query_id;               ///< for the blocking measurements
+      GLuint fragment_count_query_id;
+      
+      typedef struct
+        {
+          GLuint queries[PROFILER_QUERY_RING_SIZE];
+          bool pending[PROFILER_QUERY_RING_SIZE];
+          unsigned int next;              ///< slot for the next measurement
+          GLenum target;                  ///< GL_TIME_ELAPSED or GL_SAMPLES_PASSED, 0 = not created yet
+          bool measuring;                 ///< whether the current frame is being measured
+        } query_ring;
+        
+      vector<query_ring> query_rings;     ///< per value, for the non-blocking measurements
+      
+      typedef struct
+        {
+          vector<unsigned int> histogram; ///< sample counts in logarithmic buckets, see get_bucket()
+          unsigned int count;
+          double mean;                    ///< running mean and sum of squared differences from it (Welford's method)
+          double m2;
+          double maximum;
+        } value_distribution;
+        
+      vector<value_distribution> distributions;   ///< per value, of the single samples
+      
+      static unsigned int get_bucket(double value)
+        {
+          if (value < PROFILER_HISTOGRAM_MIN)
+            return 0;
+            
+          int bucket = log2(value / PROFILER_HISTOGRAM_MIN) * PROFILER_HISTOGRAM_BUCKETS_PER_OCTAVE;
+          
+          return 1 + glm::min(bucket,PROFILER_HISTOGRAM_OCTAVES * PROFILER_HISTOGRAM_BUCKETS_PER_OCTAVE - 1);
+        }
+        
+      /**
+       * Gets the value in the (geometric) middle of given bucket.
+       */
+        
+      static double get_bucket_value(unsigned int bucket)
+        {
+          if (bucket == 0)
+            return 0.0;
+            
+          return PROFILER_HISTOGRAM_MIN * pow(2.0,(bucket - 0.5) / PROFILER_HISTOGRAM_BUCKETS_PER_OCTAVE);
+        }
+        
+      void clear_distribution(unsigned int index)
+        {
+          value_distribution &distribution = this->distributions[index];
+          
+          distribution.histogram.assign(PROFILER_HISTOGRAM_OCTAVES * PROFILER_HISTOGRAM_BUCKETS_PER_OCTAVE + 1,0);
+          distribution.count = 0;
+          distribution.mean = 0;
+          distribution.m2 = 0;
+          distribution.maximum = 0;
+        }
+        
+      /**
+       * Adds one sample to given value's sum and distribution.
+       */
+      
+      void add_sample(unsigned int index, double value)
+        {
+          value_distribution &distribution = this->distributions[index];
+          
+          this->cumulative_values[index] += value;
+          
+          distribution.histogram[get_bucket(value)]++;
+          distribution.count++;
+          
+          double delta = value - distribution.mean;
+          distribution.mean += delta / distribution.count;
+          distribution.m2 += delta * (value - distribution.mean);
+          
+          distribution.maximum = distribution.count == 1 ? value : glm::max(distribution.maximum,value);
+        }
+      
+      /**
+       * Adds a finished query result to given value, times are converted
+       * to milliseconds.
+       */
+      
+      void record_query_result(unsigned int index, GLuint64 result)
+        {
+          if (this->query_rings[index].target == GL_TIME_ELAPSED)
+            this->add_sample(index,result / 1000000.0);
+          else
+            this->add_sample(index,result);
+        }
+        
+      /**
+       * Reads the results of the finished queries of given value without
+       * waiting for the unfinished ones.
+       */
+        
+      void collect_query_results(unsigned int index)
+        {
+          query_ring &ring = this->query_rings[index];
+          
+          for (unsigned int i = 0; i < PROFILER_QUERY_RING_SIZE; i++)
+            if (ring.pending[i])
+              {
+                GLuint available = 0;
+                glGetQueryObjectuiv(ring.queries[i],GL_QUERY_RESULT_AVAILABLE,&available);
+                
+                if (available)
+                  {
+                    GLuint64 result;
+                    glGetQueryObjectui64v(ring.queries[i],GL_QUERY_RESULT,&result);
+                    this->record_query_result(index,result);
+                    ring.pending[i] = false;
+                  }
+              }
+        }
+        
+      /**
+       * Starts a query of the value's ring, the results are collected in
+       * next_frame(). Nothing is measured in the skipped frames.
+       */
+        
+      void query_begin(unsigned int index, GLenum target)
+        {
+          query_ring &ring = this->query_rings[index];
+          
+          ring.measuring = this->frames_to_be_skipped == 0;
+          
+          if (!ring.measuring)
+            return;
+          
+          if (ring.target == 0)
+            {
+              glGenQueries(PROFILER_QUERY_RING_SIZE,ring.queries);
+              ring.target = target;
+            }
+          
+          GLuint query = ring.queries[ring.next];
+          
+          if (ring.pending[ring.next])   // the GPU is too far behind, only happens with no frame skip
+            {
+              GLuint64 result;
+              glGetQueryObjectui64v(query,GL_QUERY_RESULT,&result);
+              this->record_query_result(index,result);
+              ring.pending[ring.next] = false;
+            }
+          
+          glBeginQuery(target,query);
+        }
+        
+      void query_end(unsigned int index)
+        {
+          query_ring &ring = this->query_rings[index];
+          
+          if (!ring.measuring)
+            return;
+            
+          glEndQuery(ring.target);
+          ring.pending[ring.next] = true;
+          ring.next = (ring.next + 1) % PROFILER_QUERY_RING_SIZE;
+          ring.measuring = false;
+        }
+      
+      std::chrono::steady_clock::time_point time_start;
+      double last_present_time;          ///< get_cpu_time() at the last next_frame(), -1 = no frame yet
+      double frame_begin_time;           ///< get_cpu_time() at frame_begin(), -1 = not called this frame
+      unsigned int frames_total;         ///< number of next_frame() calls
+      
+      double frame_intervals[PROFILER_FRAME_WINDOW];   ///< present to present, ring buffers indexed by frame number, in ms, -1 = not known
+      double cpu_frame_times[PROFILER_FRAME_WINDOW];
+      double gpu_frame_times[PROFILER_FRAME_WINDOW];   ///< filled in a few frames later, -1 = not known (yet)
+      
+      GLuint frame_queries[PROFILER_QUERY_RING_SIZE][2];   ///< GL_TIMESTAMP at frame_begin() and next_frame()
+      bool frame_query_pending[PROFILER_QUERY_RING_SIZE];
+      unsigned int frame_query_frames[PROFILER_QUERY_RING_SIZE];   ///< frame numbers of the queries
+      unsigned int next_frame_query;
+      
+      /**
+       * Stores the GPU frame time of given query slot into the window,
+       * waits for the result if wait is true.
+       */
+      
+      void collect_frame_query(unsigned int slot, bool wait)
+        {
+          if (!this->frame_query_pending[slot])
+            return;
+            
+          GLuint available = 0;
+          
+          if (!wait)
+            {
+              glGetQueryObjectuiv(this->frame_queries[slot][1],GL_QUERY_RESULT_AVAILABLE,&available);
+              
+              if (!available)
+                return;
+            }
+            
+          GLuint64 times[2];
+          
+          glGetQueryObjectui64v(this->frame_queries[slot][0],GL_QUERY_RESULT,&times[0]);
+          glGetQueryObjectui64v(this->frame_queries[slot][1],GL_QUERY_RESULT,&times[1]);
+          
+          if (this->frames_total - this->frame_query_frames[slot] <= PROFILER_FRAME_WINDOW)
+            this->gpu_frame_times[this->frame_query_frames[slot] % PROFILER_FRAME_WINDOW] = (times[1] - times[0]) / 1000000.0;
+            
+          this->frame_query_pending[slot] = false;
         }
         
       /**
-       * Set this method as mouse key callback or call it inside mouse
-       * key callback in order for camera transformation of this
-       * class to be handled.
+       * Gets the ring buffer index of the frame that is given number of
+       * frames old (0 = the last finished frame).
        */
         
-      static void key_callback(unsigned char key, int x, int y)
+      unsigned int get_window_index(unsigned int frames_ago)
         {
-          glm::vec3 helper;
-          float speed_factor = CameraHandler::clicked_right ? 3.0 : 1.0;
-    
-          switch (key)
-            {
-              case 'd':
-                helper = CameraHandler::camera_transformation.get_direction_left();
-                helper *= -1 * speed_factor * CameraHandler::translation_step;
-                CameraHandler::camera_transformation.add_translation(helper);
-                break;
-          
-              case 'a':
-                helper = CameraHandler::camera_transformation.get_direction_left();
-                helper *= speed_factor * CameraHandler::translation_step;
-                CameraHandler::camera_transformation.add_translation(helper);
-                break;
-              
-              case 'w':
-                helper = CameraHandler::camera_transformation.get_direction_forward();
-                helper *= speed_factor * CameraHandler::translation_step;
-                CameraHandler::camera_transformation.add_translation(helper);
-                break;
-                
-              case 's':
-                helper = CameraHandler::camera_transformation.get_direction_forward();
-                helper *= -1 * speed_factor * CameraHandler::translation_step;
-                CameraHandler::camera_transformation.add_translation(helper);
-                break;
-              
-              case 'q':
-                helper = CameraHandler::camera_transformation.get_direction_up();
-                helper *= speed_factor * CameraHandler::translation_step;
-                CameraHandler::camera_transformation.add_translation(helper);
-                break;
-                
-              case 'e':
-                helper = CameraHandler::camera_transformation.get_direction_up();
-                helper *= -1 * speed_factor * CameraHandler::translation_step;
-                CameraHandler::camera_transformation.add_translation(helper);
-                break;
-                
-              default:
-                break;
-            }
+          return (this->frames_total - 1 - frames_ago) % PROFILER_FRAME_WINDOW;
         }
-  };
-  
-/**
- * Serves for gathering statistics about rendering and performance,
- * can serve optimizations. The object holds a set of named double values
- * that are being recorded each frame (with possible skip) and their
- * average values can be retrieved or printed. This class also provides
- * methods for measuring metrics such as time or rasterised fragments
- * (using OpenGL queries).
- */
-  
-class Profiler: public Printable
-  {
-    protected:
-      int skip_frames;    ///< how many frames should be skipped before recording values
-      int frames_to_be_skipped;
-      
-      int frames_recorded_total;
-      
-      vector<double> cumulative_values;
-      vector<string> value_names;         ///< corresponding names to cumulative_values
-
-      GLuint time_query_id;
-      GLuint fragment_count_query_id;
-      
-      int frame_count;
-      double time_start;     // for fps measurement
-      double fps;
       
     public:
       Profiler()
@@ -3446,19 +9036,34 @@ class Profiler: public Printable
           this->frames_to_be_skipped = 0;
           this->frames_recorded_total = 0;
           
-          this->frame_count = -1;
-          this->time_start = -1.0;
-          this->fps = 0;
+          this->time_start = std::chrono::steady_clock::now();
+          this->last_present_time = -1.0;
+          this->frame_begin_time = -1.0;
+          this->frames_total = 0;
+          
+          glGenQueries(2 * PROFILER_QUERY_RING_SIZE,&this->frame_queries[0][0]);
+          memset(this->frame_query_pending,0,sizeof(this->frame_query_pending));
+          this->next_frame_query = 0;
           
           this->reset();
         }
         
       virtual ~Profiler()
         {
+          for (unsigned int i = 0; i < this->query_rings.size(); i++)
+            if (this->query_rings[i].target != 0)
+              glDeleteQueries(PROFILER_QUERY_RING_SIZE,this->query_rings[i].queries);
+              
+          glDeleteQueries(1,&this->time_query_id);
+          glDeleteQueries(1,&this->fragment_count_query_id);
+          glDeleteQueries(2 * PROFILER_QUERY_RING_SIZE,&this->frame_queries[0][0]);
         }
         
       /**
-       * Starts measuting time of OpenGL commands.
+       * Starts measuting time of OpenGL commands. This and the other
+       * measurements without a value index wait for the GPU when they end
+       * (which distorts the per-frame times), so they should only be used
+       * for one-time measurements.
        */
         
       void time_measure_begin()
@@ -3471,11 +9076,11 @@ class Profiler: public Printable
           glBeginQuery(GL_SAMPLES_PASSED,this->fragment_count_query_id);
         }
         
-      unsigned int fragment_count_measure_end()
+      uint64_t fragment_count_measure_end()
         {
-          GLuint fragment_count;
+          GLuint64 fragment_count;
           glEndQuery(GL_SAMPLES_PASSED);
-          glGetQueryObjectuiv(this->fragment_count_query_id,GL_QUERY_RESULT,&fragment_count);
+          glGetQueryObjectui64v(this->fragment_count_query_id,GL_QUERY_RESULT,&fragment_count);
           return fragment_count;
         }
         
@@ -3488,11 +9093,43 @@ class Profiler: public Printable
         
       double time_measure_end()
         {
-          GLuint time_passed;
+          GLuint64 time_passed;
           glEndQuery(GL_TIME_ELAPSED);
-          glGetQueryObjectuiv(this->time_query_id,GL_QUERY_RESULT,&time_passed);
+          glGetQueryObjectui64v(this->time_query_id,GL_QUERY_RESULT,&time_passed);
           return (time_passed / 1000000.0);
         }
+        
+      /**
+       * Starts measuring time of OpenGL commands for given value, in
+       * milliseconds. Unlike time_measure_begin() this doesn't stall, the
+       * result is read a few frames later (in next_frame()) and recorded as
+       * if record_value() was called in this frame.
+       */
+        
+      void time_measure_begin(unsigned int value_index)
+        {
+          this->query_begin(value_index,GL_TIME_ELAPSED);
+        }
+        
+      void time_measure_end(unsigned int value_index)
+        {
+          this->query_end(value_index);
+        }
+        
+      /**
+       * Non-blocking measurement of rasterised fragments for given value,
+       * see time_measure_begin(unsigned int).
+       */
+        
+      void fragment_count_measure_begin(unsigned int value_index)
+        {
+          this->query_begin(value_index,GL_SAMPLES_PASSED);
+        }
+        
+      void fragment_count_measure_end(unsigned int value_index)
+        {
+          this->query_end(value_index);
+        }
       
       /**
        * Creates a new value to be recorded. Values must be created before
@@ -3501,13 +9138,21 @@ class Profiler: public Printable
         
       void new_value(string value_name)
         {
+          query_ring ring;
+          
+          memset(&ring,0,sizeof(ring));
+          
           this->cumulative_values.push_back(0.0);
           this->value_names.push_back(value_name);
+          this->query_rings.push_back(ring);
+          this->distributions.push_back(value_distribution());
+          this->clear_distribution(this->distributions.size() - 1);
         }
         
       /**
        * Records given value, this should be called every rendering frame for
        * each recorded value (for frame skipping call set_fram_skip(...) method).
+       * Each call is one sample of the value's distribution.
        * 
        * @param index value index
        * @param value value to be recorded
@@ -3516,39 +9161,75 @@ class Profiler: public Printable
       void record_value(unsigned int index, double value)
         {
           if (this->frames_to_be_skipped == 0)
-            this->cumulative_values[index] += value;
+            this->add_sample(index,value);
         }
         
       unsigned int get_cpu_seconds()
         {
-          time_t time_sec;
-          time(&time_sec);
-          return time_sec;
+          return this->get_cpu_time() / 1000.0;
+        }
+        
+      /**
+       * Gets the time since the profiler creation in milliseconds, from a
+       * monotonic high resolution clock.
+       */
+        
+      double get_cpu_time()
+        {
+          return std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now() - this->time_start).count();
+        }
+        
+      /**
+       * Marks the start of the frame's work, optional. If called, the CPU
+       * and GPU (GL_TIMESTAMP) time from here to next_frame() is recorded
+       * in the frame window, otherwise only the present to present
+       * intervals are.
+       */
+        
+      void frame_begin()
+        {
+          unsigned int slot = this->next_frame_query;
+          
+          this->collect_frame_query(slot,true);    // only waits if the GPU is PROFILER_QUERY_RING_SIZE frames behind
+          
+          glQueryCounter(this->frame_queries[slot][0],GL_TIMESTAMP);
+          this->frame_begin_time = this->get_cpu_time();
         }
         
       /**
        * This must be called at the end of each rendering frame (for frame skipping
-       * call set_fram_skip(...) method).
+       * call set_fram_skip(...) method), right after swapping the buffers.
        */ 
        
       void next_frame()
         {
-          if (this->frame_count >= 0 )
-            {
-              if (this->time_start < 0)
-                this->time_start = this->get_cpu_seconds();
-            }
-
-          this->frame_count++;
-
-          double elapsed_time = this->get_cpu_seconds() - this->time_start;
+          for (unsigned int i = 0; i < this->query_rings.size(); i++)
+            if (this->query_rings[i].target != 0)
+              this->collect_query_results(i);
               
-          if (elapsed_time >= 5)  // recompute fps after each 5 seconds
+          double now = this->get_cpu_time();
+          unsigned int index = this->frames_total % PROFILER_FRAME_WINDOW;
+          
+          this->frame_intervals[index] = this->last_present_time < 0 ? -1 : now - this->last_present_time;
+          this->cpu_frame_times[index] = this->frame_begin_time < 0 ? -1 : now - this->frame_begin_time;
+          this->gpu_frame_times[index] = -1;
+          
+          if (this->frame_begin_time >= 0)
             {
-              this->fps = this->frame_count / (double) elapsed_time;
-              this->frame_count = 0;
-              this->time_start = -1.0;
+              unsigned int slot = this->next_frame_query;
+              
+              glQueryCounter(this->frame_queries[slot][1],GL_TIMESTAMP);
+              this->frame_query_pending[slot] = true;
+              this->frame_query_frames[slot] = this->frames_total;
+              this->next_frame_query = (slot + 1) % PROFILER_QUERY_RING_SIZE;
             }
+          
+          this->last_present_time = now;
+          this->frame_begin_time = -1;
+          this->frames_total++;
+          
+          for (unsigned int i = 0; i < PROFILER_QUERY_RING_SIZE; i++)
+            this->collect_frame_query(i,false);
      
           if (this->frames_to_be_skipped <= 0)
             {
@@ -3570,7 +9251,13 @@ class Profiler: public Printable
           unsigned int i;
           
           for (i = 0; i < this->cumulative_values.size(); i++)
-            this->cumulative_values[i] = 0.0;
+            {
+              this->cumulative_values[i] = 0.0;
+              this->clear_distribution(i);
+            }
+            
+          for (i = 0; i < this->query_rings.size(); i++)   // the results still on the way belong to the old values
+            memset(this->query_rings[i].pending,0,sizeof(this->query_rings[i].pending));
           
            this->frames_recorded_total = 0;
         }
@@ -3585,25 +9272,290 @@ class Profiler: public Printable
           this->skip_frames = number_of_frames;
         }
         
+      /**
+       * Gets the average of the value's samples. The number of samples is used
+       * rather than the number of recorded frames, because the query results
+       * of the last frames may not have arrived yet.
+       */
+        
       double get_average_value(unsigned int index)
         {
-          return this->cumulative_values[index] / this->frames_recorded_total;
+          unsigned int count = this->distributions[index].count;
+          return count > 0 ? this->cumulative_values[index] / count : 0.0;
+        }
+        
+      unsigned int get_number_of_samples(unsigned int index)
+        {
+          return this->distributions[index].count;
+        }
+        
+      /**
+       * Gets given percentile of the value's samples, with the precision of
+       * the histogram buckets (never more than the maximum sample).
+       *
+       * @param percentile 0 to 100, e.g. 99 for p99
+       */
+        
+      double get_percentile(unsigned int index, double percentile)
+        {
+          value_distribution &distribution = this->distributions[index];
+          
+          if (distribution.count == 0)
+            return 0.0;
+            
+          unsigned int rank = glm::max((unsigned int) ceil(percentile / 100.0 * distribution.count),(unsigned int) 1);
+          unsigned int samples = 0;
+          
+          for (unsigned int i = 0; i < distribution.histogram.size(); i++)
+            {
+              samples += distribution.histogram[i];
+              
+              if (samples >= rank)
+                return glm::min(get_bucket_value(i),distribution.maximum);
+            }
+            
+          return distribution.maximum;
+        }
+        
+      double get_maximum_value(unsigned int index)
+        {
+          return this->distributions[index].maximum;
+        }
+        
+      double get_standard_deviation(unsigned int index)
+        {
+          value_distribution &distribution = this->distributions[index];
+          return distribution.count > 1 ? sqrt(distribution.m2 / (distribution.count - 1)) : 0.0;
+        }
+        
+      /**
+       * Gets the number of frames in the frame window (at most
+       * PROFILER_FRAME_WINDOW).
+       */
+        
+      unsigned int get_frame_window_size()
+        {
+          return glm::min(this->frames_total,(unsigned int) PROFILER_FRAME_WINDOW);
+        }
+        
+      /**
+       * Gets the present to present interval in ms of the frame that is
+       * given number of frames old (0 = the last one), -1 if not known.
+       */
+        
+      double get_frame_interval(unsigned int frames_ago)
+        {
+          return frames_ago < this->get_frame_window_size() ? this->frame_intervals[this->get_window_index(frames_ago)] : -1;
+        }
+        
+      /**
+       * Gets the CPU time in ms from frame_begin() to next_frame(), -1 if
+       * not known.
+       */
+        
+      double get_cpu_frame_time(unsigned int frames_ago)
+        {
+          return frames_ago < this->get_frame_window_size() ? this->cpu_frame_times[this->get_window_index(frames_ago)] : -1;
+        }
+        
+      /**
+       * Gets the GPU time in ms from frame_begin() to next_frame(), -1 if
+       * not known (yet, the latest frames are usually still being
+       * processed).
+       */
+        
+      double get_gpu_frame_time(unsigned int frames_ago)
+        {
+          return frames_ago < this->get_frame_window_size() ? this->gpu_frame_times[this->get_window_index(frames_ago)] : -1;
+        }
+        
+      /**
+       * Gets the frames per second from the average present interval in the
+       * frame window.
+       */
+        
+      double get_fps()
+        {
+          double sum = 0;
+          unsigned int count = 0;
+          
+          for (unsigned int i = 0; i < this->get_frame_window_size(); i++)
+            if (this->get_frame_interval(i) > 0)
+              {
+                sum += this->get_frame_interval(i);
+                count++;
+              }
+              
+          return sum > 0 ? 1000.0 * count / sum : 0;
+        }
+        
+      /**
+       * Draws a graph of the frame window into the bottom left corner of the
+       * current frame buffer, one column per frame, the newest on the right.
+       * Each column shows the present interval (gray), the CPU time (orange,
+       * left half) and the GPU time (green, right half), the line marks
+       * target_ms.
+       *
+       * @param ms_per_pixel vertical scale of the graph
+       */
+        
+      void draw_frame_graph(double target_ms=16.667, double ms_per_pixel=0.25, unsigned int column_width=2)
+        {
+          GLfloat clear_color[4];
+          unsigned int height = 2 * target_ms / ms_per_pixel;
+          unsigned int size = this->get_frame_window_size();
+          
+          glGetFloatv(GL_COLOR_CLEAR_VALUE,clear_color);
+          GLState::set_capability(GL_SCISSOR_TEST,true);
+          
+          glScissor(0,0,PROFILER_FRAME_WINDOW * column_width,height);   // background
+          glClearColor(0,0,0,1);
+          glClear(GL_COLOR_BUFFER_BIT);
+          
+          for (unsigned int i = 0; i < size; i++)
+            {
+              unsigned int x = (PROFILER_FRAME_WINDOW - 1 - i) * column_width;
+              double times[3] = {this->get_frame_interval(i),this->get_cpu_frame_time(i),this->get_gpu_frame_time(i)};
+              GLfloat colors[3][3] = {{0.4,0.4,0.4},{1.0,0.6,0.0},{0.0,0.9,0.2}};
+              
+              for (int j = 0; j < 3; j++)
+                {
+                  unsigned int bar_height = glm::min((unsigned int) (glm::max(times[j],0.0) / ms_per_pixel),height);
+                  
+                  if (bar_height == 0)
+                    continue;
+                  
+                  unsigned int bar_width = j == 0 ? column_width : glm::max(column_width / 2,(unsigned int) 1);
+                  
+                  glScissor(x + (j == 2 ? column_width - bar_width : 0),0,bar_width,bar_height);
+                  glClearColor(colors[j][0],colors[j][1],colors[j][2],1);
+                  glClear(GL_COLOR_BUFFER_BIT);
+                }
+            }
+            
+          glScissor(0,target_ms / ms_per_pixel,PROFILER_FRAME_WINDOW * column_width,1);   // target line
+          glClearColor(1,1,1,1);
+          glClear(GL_COLOR_BUFFER_BIT);
+          
+          GLState::set_capability(GL_SCISSOR_TEST,false);
+          glClearColor(clear_color[0],clear_color[1],clear_color[2],clear_color[3]);
         }
         
       virtual void print()
         {
           unsigned int i;
+          double frame_times[3] = {0,0,0};        // averages over the frame window
+          unsigned int frame_counts[3] = {0,0,0};
+          double max_interval = 0;
+          
+          for (i = 0; i < this->get_frame_window_size(); i++)
+            {
+              double times[3] = {this->get_frame_interval(i),this->get_cpu_frame_time(i),this->get_gpu_frame_time(i)};
+              
+              for (int j = 0; j < 3; j++)
+                if (times[j] >= 0)
+                  {
+                    frame_times[j] += times[j];
+                    frame_counts[j]++;
+                  }
+                  
+              max_interval = glm::max(max_interval,times[0]);
+            }
+            
+          for (i = 0; i < 3; i++)
+            frame_times[i] = frame_counts[i] > 0 ? frame_times[i] / frame_counts[i] : 0;
           
           cout << "profiling info:" << endl;
-          cout << "  fps: " << this->fps << endl;
+          cout << "  fps: " << this->get_fps() << endl;
+          cout << "  last " << this->get_frame_window_size() << " frames (ms): interval " << frame_times[0] << " (max " << max_interval <<
+            "), CPU " << frame_times[1] << ", GPU " << frame_times[2] << endl;
           //cout << "  total frames recorded (" << this->skip_frames << " frame skip): " << this->frames_recorded_total << endl;
-          cout << "  average values recorded:" << endl;
+          cout << "  average values recorded (p50 / p90 / p99 / max, standard deviation, samples):" << endl;
           
           for (i = 0; i < this->cumulative_values.size(); i++)
-            cout << "    " << this->value_names[i] << ": " << this->get_average_value(i) << endl;
+            cout << "    " << this->value_names[i] << ": " << this->get_average_value(i) << " (" <<
+              this->get_percentile(i,50) << " / " << this->get_percentile(i,90) << " / " << this->get_percentile(i,99) << " / " <<
+              this->get_maximum_value(i) << ", " << this->get_standard_deviation(i) << ", " << this->get_number_of_samples(i) << ")" << endl;
         };
   };
   
+/**
+ * Uniform buffer object holding a std140 block, e.g. per-frame data shared
+ * by several programs. The data are edited in the CPU copy, update_gpu()
+ * uploads them only if they differ from the last upload.
+ */
+
+class UniformBuffer: public GPUObject
+  {
+    protected:
+      GLuint ubo;
+      GLuint binding_point;
+      unsigned int size;
+      unsigned char *data;
+      unsigned char *uploaded_data;      ///< copy of what the GPU has
+      bool uploaded;
+      
+    public:
+      /**
+       * @param size block size in bytes, the layout of the data has to
+       *   follow the std140 rules of the block in the shaders
+       * @param binding_point uniform buffer binding point, the shaders
+       *   should declare it with layout (binding = ...)
+       */
+      
+      UniformBuffer(unsigned int size, GLuint binding_point)
+        {
+          this->size = size;
+          this->binding_point = binding_point;
+          this->uploaded = false;
+          
+          this->data = (unsigned char *) malloc(size);
+          this->uploaded_data = (unsigned char *) malloc(size);
+          memset(this->data,0,size);
+          
+          glGenBuffers(1,&(this->ubo));
+          glBindBuffer(GL_UNIFORM_BUFFER,this->ubo);
+          glBufferData(GL_UNIFORM_BUFFER,size,0,GL_DYNAMIC_DRAW);
+          glBindBufferBase(GL_UNIFORM_BUFFER,this->binding_point,this->ubo);
+        }
+        
+      virtual ~UniformBuffer()
+        {
+          glDeleteBuffers(1,&(this->ubo));
+          free(this->data);
+          free(this->uploaded_data);
+        }
+        
+      void *get_data_pointer()
+        {
+          return this->data;
+        }
+        
+      void bind()
+        {
+          glBindBufferBase(GL_UNIFORM_BUFFER,this->binding_point,this->ubo);
+        }
+        
+      virtual void update_gpu()
+        {
+          if (this->uploaded && memcmp(this->data,this->uploaded_data,this->size) == 0)
+            return;
+            
+          glBindBuffer(GL_UNIFORM_BUFFER,this->ubo);
+          glBufferSubData(GL_UNIFORM_BUFFER,0,this->size,this->data);
+          memcpy(this->uploaded_data,this->data,this->size);
+          this->uploaded = true;
+        }
+        
+      virtual void load_from_gpu()
+        {
+          glBindBuffer(GL_UNIFORM_BUFFER,this->ubo);
+          glGetBufferSubData(GL_UNIFORM_BUFFER,0,this->size,this->data);
+          memcpy(this->uploaded_data,this->data,this->size);
+          this->uploaded = true;
+        }
+  };
+
 class StorageBuffer: public GPUObject, public Printable
   {
     // WORK IN PROGRESS
@@ -3891,20 +9843,20 @@ void draw_fullscreen_quad(int viewport_width=-1, int viewport_height=-1)
 
     if (viewport_width >= 0 && viewport_height >= 0)
       {
-        glGetIntegerv(GL_VIEWPORT,old_viewport);   // save the old viewport
-        glViewport(0,0,viewport_width,viewport_height);
+        GLState::get_viewport(old_viewport);   // save the old viewport
+        GLState::set_viewport(0,0,viewport_width,viewport_height);
       }
     
-    glDisable(GL_DEPTH_TEST);
+    GLState::set_capability(GL_DEPTH_TEST,false);
     glClear(GL_COLOR_BUFFER_BIT);
     
     geometry_fullscreen_quad->draw_as_triangles();
     
-    glEnable(GL_DEPTH_TEST);
+    GLState::set_capability(GL_DEPTH_TEST,true);
     
     if (viewport_width >= 0 && viewport_height >= 0)
       {
-        glViewport(old_viewport[0],old_viewport[1],old_viewport[2],old_viewport[3]);
+        GLState::set_viewport(old_viewport[0],old_viewport[1],old_viewport[2],old_viewport[3]);
       }
   }
 
@@ -62,7 +62,7 @@ int main(int argc, char** argv)
     transformation_model.set_rotation(glm::vec3(0.5,1.4,0.0));
     transformation_model.set_scale(glm::vec3(3.0,1.0,2.0));
     
-    texture = new Texture2D(8,8,TEXEL_TYPE_COLOR);
+    texture = new Texture2D(8,8,TEXEL_TYPE_COLOR,true);
     texture->load_ppm("../resources/texture.ppm");
     texture->update_gpu();                          // uploads the texture to GPU
  
@@ -37,7 +37,7 @@ void render()
     glClearColor(1,1,1,1);
     glClear(GL_COLOR_BUFFER_BIT);
     glClear(GL_DEPTH_BUFFER_BIT);
-    glEnable(GL_STENCIL_TEST);
+    GLState::set_capability(GL_STENCIL_TEST,true);
     
     // first pass:
     
@@ -82,7 +82,7 @@ void render()
     
     geometry_cup->draw_as_triangles();         // draw the mirrored cup over the mirror
 
-    glDisable(GL_STENCIL_TEST);
+    GLState::set_capability(GL_STENCIL_TEST,false);
     
     glutSwapBuffers();
   }
@@ -144,7 +144,7 @@ int main(int argc, char** argv)
     CameraHandler::camera_transformation.set_translation(glm::vec3(5.5,2.0,8.0));
     CameraHandler::camera_transformation.set_rotation(glm::vec3(-0.05,0.1,0.0));
  
-    glDisable(GL_CULL_FACE);    // the mirror will reverse the vertex order :/
+    GLState::set_capability(GL_CULL_FACE,false);  // the mirror will reverse the vertex order :/
     
     Geometry3D g = load_obj("../resources/cup.obj");
     geometry_cup = &g;
@@ -158,7 +158,7 @@ int main(int argc, char** argv)
     transformation_mirror.set_translation(glm::vec3(0.0,0.0,-20.0));
     transformation_mirror.set_rotation(glm::vec3(3.1415,0.0,0));
     
-    texture = new Texture2D(8,8,TEXEL_TYPE_COLOR);
+    texture = new Texture2D(8,8,TEXEL_TYPE_COLOR,true);
     texture->load_ppm("../resources/texture.ppm");
     texture->update_gpu();
     
@@ -0,0 +1,254 @@
+/*
+  Offline tool that converts ppm textures to BC1 (DXT1) compressed KTX
+  files with a precomputed mipmap chain, which can then be loaded with
+  Texture2D::load_ktx(). BC1 is used because ppm images carry no alpha,
+  it takes 8 times less memory than RGBA8 (and 32 times less than the
+  RGBA32F textures created from ppm files).
+
+  usage: ./main                      converts all ppm files in ../resources
+         ./main input.ppm output.ktx converts one file
+
+  Miloslav Číž, 2017
+*/
+
+#include "../gl_wrapper.h"
+#include <dirent.h>
+
+/**
+ * Quantizes a color to 16 bit 5:6:5 format.
+ */
+
+uint16_t pack_565(float r, float g, float b)
+  {
+    unsigned int r5 = glm::clamp<float>(r * 31.0 + 0.5,0,31);
+    unsigned int g6 = glm::clamp<float>(g * 63.0 + 0.5,0,63);
+    unsigned int b5 = glm::clamp<float>(b * 31.0 + 0.5,0,31);
+    return (r5 << 11) | (g6 << 5) | b5;
+  }
+
+void unpack_565(uint16_t color, float result[3])
+  {
+    result[0] = ((color >> 11) & 31) / 31.0;
+    result[1] = ((color >> 5) & 63) / 63.0;
+    result[2] = (color & 31) / 31.0;
+  }
+
+/**
+ * Compresses one 4x4 block starting at given pixel into 8 bytes of BC1
+ * data. The endpoints are the extremes of the block colors projected on
+ * the main diagonal of their bounding box, inset slightly to reduce the
+ * quantization error.
+ */
+
+void compress_bc1_block(Image2D *image, int x0, int y0, unsigned char output[8])
+  {
+    float pixels[16][3];
+    float color_min[3] = {1,1,1};
+    float color_max[3] = {0,0,0};
+    float a;
+    int i, j;
+
+    for (i = 0; i < 16; i++)   // pixels out of the image are clamped to its edge
+      {
+        image->get_pixel(x0 + i % 4,y0 + i / 4,&pixels[i][0],&pixels[i][1],&pixels[i][2],&a);
+
+        for (j = 0; j < 3; j++)
+          {
+            color_min[j] = glm::min(color_min[j],pixels[i][j]);
+            color_max[j] = glm::max(color_max[j],pixels[i][j]);
+          }
+      }
+
+    float axis[3], projection_min = 999, projection_max = -999;
+    int index_min = 0, index_max = 0;
+
+    for (j = 0; j < 3; j++)
+      axis[j] = color_max[j] - color_min[j];
+
+    for (i = 0; i < 16; i++)
+      {
+        float projection = pixels[i][0] * axis[0] + pixels[i][1] * axis[1] + pixels[i][2] * axis[2];
+
+        if (projection < projection_min)
+          {
+            projection_min = projection;
+            index_min = i;
+          }
+
+        if (projection > projection_max)
+          {
+            projection_max = projection;
+            index_max = i;
+          }
+      }
+
+    float endpoint0[3], endpoint1[3];
+
+    for (j = 0; j < 3; j++)
+      {
+        float inset = (pixels[index_max][j] - pixels[index_min][j]) / 16.0;
+        endpoint0[j] = pixels[index_max][j] - inset;
+        endpoint1[j] = pixels[index_min][j] + inset;
+      }
+
+    uint16_t color0 = pack_565(endpoint0[0],endpoint0[1],endpoint0[2]);
+    uint16_t color1 = pack_565(endpoint1[0],endpoint1[1],endpoint1[2]);
+    uint32_t indices = 0;
+
+    if (color0 < color1)     // color0 > color1 selects the 4 color mode
+      {
+        uint16_t helper = color0;
+        color0 = color1;
+        color1 = helper;
+      }
+
+    if (color0 != color1)
+      {
+        float palette[4][3];
+
+        unpack_565(color0,palette[0]);
+        unpack_565(color1,palette[1]);
+
+        for (j = 0; j < 3; j++)
+          {
+            palette[2][j] = (2 * palette[0][j] + palette[1][j]) / 3.0;
+            palette[3][j] = (palette[0][j] + 2 * palette[1][j]) / 3.0;
+          }
+
+        for (i = 0; i < 16; i++)
+          {
+            unsigned int best_index = 0;
+            float best_error = 999;
+
+            for (unsigned int k = 0; k < 4; k++)
+              {
+                float error = 0;
+
+                for (j = 0; j < 3; j++)
+                  error += (pixels[i][j] - palette[k][j]) * (pixels[i][j] - palette[k][j]);
+
+                if (error < best_error)
+                  {
+                    best_error = error;
+                    best_index = k;
+                  }
+              }
+
+            indices |= best_index << (2 * i);
+          }
+      }
+
+    output[0] = color0 & 0xff;
+    output[1] = color0 >> 8;
+    output[2] = color1 & 0xff;
+    output[3] = color1 >> 8;
+    output[4] = indices & 0xff;
+    output[5] = (indices >> 8) & 0xff;
+    output[6] = (indices >> 16) & 0xff;
+    output[7] = indices >> 24;
+  }
+
+/**
+ * Makes the next mipmap level of given image with a box filter.
+ */
+
+Image2D *downsample(Image2D *image)
+  {
+    Image2D *result = new Image2D(glm::max(1,image->get_width() / 2),glm::max(1,image->get_height() / 2),TEXEL_TYPE_COLOR);
+
+    for (int y = 0; y < result->get_height(); y++)
+      for (int x = 0; x < result->get_width(); x++)
+        {
+          float sum[4] = {0,0,0,0};
+
+          for (int i = 0; i < 4; i++)
+            {
+              float r = 0, g = 0, b = 0, a = 0;
+              image->get_pixel(2 * x + i % 2,2 * y + i / 2,&r,&g,&b,&a);
+              sum[0] += r;
+              sum[1] += g;
+              sum[2] += b;
+              sum[3] += a;
+            }
+
+          result->set_pixel(x,y,sum[0] / 4.0,sum[1] / 4.0,sum[2] / 4.0,sum[3] / 4.0);
+        }
+
+    return result;
+  }
+
+bool convert(string input_filename, string output_filename)
+  {
+    Image2D *image = new Image2D(1,1,TEXEL_TYPE_COLOR);
+
+    if (!image->load_ppm(input_filename))
+      {
+        delete image;
+        return false;
+      }
+
+    CompressedImage compressed(GL_COMPRESSED_RGB_S3TC_DXT1_EXT,image->get_width(),image->get_height(),1);
+
+    while (true)   // for each mipmap level
+      {
+        vector<unsigned char> level_data;
+        unsigned char block[8];
+
+        for (int y = 0; y < image->get_height(); y += 4)
+          for (int x = 0; x < image->get_width(); x += 4)
+            {
+              compress_bc1_block(image,x,y,block);
+              level_data.insert(level_data.end(),block,block + 8);
+            }
+
+        compressed.add_level_data(level_data);
+
+        if (image->get_width() == 1 && image->get_height() == 1)
+          break;
+
+        Image2D *next_level = downsample(image);
+        delete image;
+        image = next_level;
+      }
+
+    delete image;
+
+    cout << input_filename << " -> " << output_filename << " (" << compressed.get_number_of_levels() << " mipmap levels)" << endl;
+
+    if (!compressed.save_ktx(output_filename))
+      {
+        ErrorWriter::write_error("Could not write file '" + output_filename + "'.");
+        return false;
+      }
+
+    return true;
+  }
+
+int main(int argc, char** argv)
+  {
+    if (argc == 3)
+      return convert(argv[1],argv[2]) ? 0 : 1;
+
+    string directory = "../resources/";
+    DIR *directory_handle = opendir(directory.c_str());
+    struct dirent *entry;
+    bool result = true;
+
+    if (!directory_handle)
+      {
+        ErrorWriter::write_error("Could not open directory '" + directory + "'.");
+        return 1;
+      }
+
+    while ((entry = readdir(directory_handle)) != 0)
+      {
+        string name = entry->d_name;
+
+        if (name.length() > 4 && name.substr(name.length() - 4) == ".ppm")
+          result = convert(directory + name,directory + name.substr(0,name.length() - 4) + ".ktx") && result;
+      }
+
+    closedir(directory_handle);
+
+    return result ? 0 : 1;
+  }